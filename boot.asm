@@ -28,6 +28,51 @@ _start:
     hlt
     jmp .hang
 
+; ---- Interrupt entry stubs ----
+; Vectors 0..31 are CPU exceptions, 32..47 the remapped PIC IRQs. Each
+; stub leaves the same frame for interrupt_dispatch: the error code the
+; CPU pushed (or a dummy 0), the vector, the general registers and the
+; data segments (InterruptFrame in libs/kernel.h).
+
+extern interrupt_dispatch
+isr_common:
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+    cld
+    push esp
+    call interrupt_dispatch
+    add esp, 4
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popa
+    add esp, 8
+    iret
+
+%assign i 0
+%rep 48
+isr_stub_%+i:
+%if !(i == 8 || (i >= 10 && i <= 14) || i == 17 || i == 21 || i == 29 || i == 30)
+    push dword 0
+%endif
+    push dword i
+    jmp isr_common
+%assign i i + 1
+%endrep
+
+section .data
+global isr_stub_table
+isr_stub_table:
+%assign i 0
+%rep 48
+    dd isr_stub_%+i
+%assign i i + 1
+%endrep
+
 section .bss
 regs: resb 32
 align 16
@@ -1,270 +1,1215 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define SECTOR_SIZE 512
-#define MAX_FILES 64
-#define MAX_FILENAME 64
-#define FIRST_DATA_SECTOR 10
-#define K_MAGIC "ZOS1"
+// Commands that work on a file system run the kernel's code (libs/fs.h)
+// against the image, like fs_host.c. fs.h brings its own O_* flags,
+// which have Linux's values, in place of <fcntl.h>'s.
+#undef O_RDONLY
+#undef O_WRONLY
+#undef O_RDWR
+#undef O_ACCMODE
+#undef O_CREAT
+#undef O_TRUNC
+#undef O_APPEND
 
-typedef struct {
-    char filename[MAX_FILENAME];
-    uint32_t size;
-    uint32_t first_sector;
-    uint32_t num_sectors;
-    uint8_t in_use;
-} FileEntry;
+void kernel_panic(const char* message) {
+    printf("panic: %s", message);
+    exit(1);
+}
 
+#include "libs/fs.h"
+
+#define STRIPE_MAGIC "ZSTR"
+#define STRIPE_MAX_MEMBERS 4
+#define STRIPE_DATA_SECTOR 1
+
+// Sector 0 of every member of a striped set.
 typedef struct {
     char magic[4];
-    uint32_t num_files;
-    FileEntry files[MAX_FILES];
-} FileTable;
+    uint32_t set_id;
+    uint32_t index;
+    uint32_t members;
+    uint32_t chunk_sectors;
+    uint32_t total_sectors;
+} StripeLabel;
 
-void create_disk_image(const char* filename, uint32_t size_mb) {
-    uint8_t buffer[SECTOR_SIZE];
-    memset(buffer, 0, SECTOR_SIZE);
-    
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
-        printf("Error creating disk image\n");
-        return;
-    }
-    
-    for (uint32_t i = 0; i < size_mb * 1024 * 2; i++) {
-        fwrite(buffer, SECTOR_SIZE, 1, file);
+static int bit_test(const uint8_t* bits, uint32_t n) {
+    return bits[n >> 3] & (1 << (n & 7));
+}
+
+static void bitmap_mark(uint8_t* bits, uint32_t first, uint32_t count, int used) {
+    for (uint32_t n = first; n < first + count; n++) {
+        if (used) bits[n >> 3] |= (1 << (n & 7));
+        else bits[n >> 3] &= ~(1 << (n & 7));
     }
-    
-    fclose(file);
-    printf("Created disk image %s of size %dMB\n", filename, size_mb);
 }
 
-void init_filesystem(const char* disk_image) {
-    FILE* disk = fopen(disk_image, "r+b");
-    if (!disk) {
-        printf("Could not open disk image\n");
-        return;
+// ---------------- Image device ----------------
+
+static int image_fd = -1;
+static uint32_t image_zeroed;   // sectors below this are known to be zero
+
+static void image_read(uint32_t lba, uint32_t count, uint8_t* buffer) {
+    size_t size = (size_t)count * SECTOR_SIZE;
+    ssize_t got = pread(image_fd, buffer, size, (off_t)lba * SECTOR_SIZE);
+    if (got < 0) got = 0;
+    if ((size_t)got < size) memset(buffer + got, 0, size - got);
+}
+
+static void image_write(uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    size_t size = (size_t)count * SECTOR_SIZE;
+    if (lba + count <= image_zeroed) {
+        size_t i = 0;
+        while (i < size && buffer[i] == 0) i++;
+        if (i == size) return;  // keeps the metadata of a big image sparse
+    }
+    if (pwrite(image_fd, buffer, size, (off_t)lba * SECTOR_SIZE) != (ssize_t)size) {
+        printf("Write to sector %d failed\n", lba);
     }
-    
-    FileTable ft;
-    memset(&ft, 0, sizeof(FileTable));
-    memcpy(ft.magic, K_MAGIC, 4);
-    ft.num_files = 0;
-    
-    fseek(disk, SECTOR_SIZE, SEEK_SET);
-    fwrite(&ft, sizeof(FileTable), 1, disk);
-    fclose(disk);
-    
-    printf("Filesystem initialized on %s\n", disk_image);
 }
 
-void list_files(const char* disk_image) {
-    FILE* disk = fopen(disk_image, "rb");
-    if (!disk) {
+// fs.h orders a journal commit with flushes; they reach the host disk
+// too, so an interrupted command leaves the image as a crash would.
+static void image_flush() {
+    fdatasync(image_fd);
+}
+
+static BlockDevice image_device = {"image", 0, image_read, image_write, image_flush, 0};
+
+static int open_image(const char* disk_image) {
+    struct stat st;
+    image_fd = open(disk_image, O_RDWR);
+    if (image_fd < 0 || fstat(image_fd, &st) != 0) {
         printf("Could not open disk image\n");
-        return;
+        if (image_fd >= 0) close(image_fd);
+        return -1;
     }
-    
-    FileTable ft;
-    fseek(disk, SECTOR_SIZE, SEEK_SET);
-    fread(&ft, sizeof(FileTable), 1, disk);
-    
-    if (strncmp(ft.magic, K_MAGIC, 4) != 0) {
+    image_device.name = disk_image;
+    image_device.sectors = (uint64_t)st.st_size / SECTOR_SIZE;
+    disk_dev = &image_device;
+    return 0;
+}
+
+// Mounting replays a transaction the kernel committed but did not
+// checkpoint, so everything read below is current.
+static int open_fs(const char* disk_image) {
+    if (open_image(disk_image) != 0) return -1;
+    tmpfs_init();
+    fs_mount(&image_device);
+    if (fs_total_sectors == 0) {
         printf("Invalid filesystem or not initialized\n");
-        fclose(disk);
+        close(image_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_fs() {
+    fs_sync();
+    disk_flush();
+    close(image_fd);
+}
+
+// ---------------- Commands ----------------
+
+// The image is sparse: nothing is written, so even large images are
+// created at once and take no host space until used. `prealloc`
+// reserves the space up front instead.
+void create_disk_image(const char* filename, uint32_t size_mb, int prealloc) {
+    off_t size = (off_t)size_mb * 1024 * 1024;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        printf("Error creating disk image\n");
+        if (fd >= 0) close(fd);
         return;
     }
-    
-    printf("Files on disk: %d\n", ft.num_files);
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use) {
-            printf("%s - %d bytes (sectors %d-%d)\n", 
-                   ft.files[i].filename, 
-                   ft.files[i].size,
-                   ft.files[i].first_sector,
-                   ft.files[i].first_sector + ft.files[i].num_sectors - 1);
-        }
+    if (prealloc) {
+        int err = posix_fallocate(fd, 0, size);
+        if (err != 0) printf("Could not preallocate: %s\n", strerror(err));
     }
-    
-    fclose(disk);
+    close(fd);
+    printf("Created disk image %s of size %dMB%s\n", filename, size_mb, prealloc ? ", preallocated" : "");
 }
 
-void write_file_to_image(const char* disk_image, const char* filename, const char* source_file) {
-    FILE* disk = fopen(disk_image, "r+b");
-    if (!disk) {
-        printf("Could not open disk image\n");
-        return;
+// Zeroes sectors [first, first + count), punching a hole where the host
+// file system supports it so that sparse images stay sparse.
+static void zero_sectors(uint32_t first, uint32_t count) {
+    static const uint8_t zero[64 * SECTOR_SIZE];
+    off_t offset = (off_t)first * SECTOR_SIZE;
+    off_t length = (off_t)count * SECTOR_SIZE;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) return;
+#endif
+    while (length > 0) {
+        size_t n = length < (off_t)sizeof(zero) ? (size_t)length : sizeof(zero);
+        if (pwrite(image_fd, zero, n, offset) != (ssize_t)n) break;
+        offset += n;
+        length -= n;
     }
-    
-    FileTable ft;
-    fseek(disk, SECTOR_SIZE, SEEK_SET);
-    fread(&ft, sizeof(FileTable), 1, disk);
-    
-    if (strncmp(ft.magic, K_MAGIC, 4) != 0) {
-        printf("Invalid filesystem or not initialized\n");
-        fclose(disk);
+}
+
+// Only the metadata area is touched: it is zeroed, then fs_format writes
+// the sectors that are not zero. File data sectors are left as they
+// are, since nothing points at them any more.
+void init_filesystem(const char* disk_image) {
+    if (open_image(disk_image) != 0) return;
+
+    uint64_t image_sectors = image_device.sectors;
+    uint32_t total_sectors = image_sectors > FS_MAX_SECTORS ? FS_MAX_SECTORS : (uint32_t)image_sectors;
+    if (image_sectors > FS_MAX_SECTORS) {
+        printf("Image larger than %d sectors, only the first %d are used\n", FS_MAX_SECTORS, FS_MAX_SECTORS);
+    }
+    SuperBlock sb;
+    FsLayout layout;
+    memset(&sb, 0, sizeof(sb));
+    fs_layout_size(&sb, total_sectors);
+    if (fs_layout_load(&sb, &layout) != 0) {
+        printf("Image too small\n");
+        close(image_fd);
         return;
     }
-    
-    int free_entry = -1;
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use && strcmp(ft.files[i].filename, filename) == 0) {
-            printf("File %s already exists, replacing it\n", filename);
-            free_entry = i;
-            break;
-        }
-        if (!ft.files[i].in_use && free_entry == -1) {
-            free_entry = i;
+
+    zero_sectors(FS_SUPERBLOCK_SECTOR, layout.data - FS_SUPERBLOCK_SECTOR);
+    image_zeroed = layout.data;
+    fs_format(total_sectors);
+    image_zeroed = 0;
+    close_fs();
+
+    printf("Filesystem initialized on %s\n", disk_image);
+}
+
+static void list_dir(uint32_t dir_ino, const char* prefix) {
+    FileEntry dir, fe;
+    DirBlock blk;
+    char path[FS_MAX_PATH];
+
+    fs_inode_read(dir_ino, &dir);
+    for (uint32_t b = 0; b < dir.num_sectors; b++) {
+        fs_cache_peek(dir.first_sector + b, &blk);
+        for (uint32_t off = 0; off < blk.used; off += dir_record_size(blk.records + off)) {
+            uint8_t* rec = blk.records + off;
+            fs_inode_read(dir_record_inode(rec), &fe);
+            snprintf(path, sizeof(path), "%s/%.*s", prefix, rec[4], (char*)rec + DIR_RECORD_HEADER);
+            if (fe.type == FS_TYPE_DIR) {
+                printf("%s/\n", path);
+                list_dir(dir_record_inode(rec), path);
+            } else if (fe.flags & FS_FILE_INLINE) {
+                printf("%s - %d bytes (inline)\n", path, fe.size);
+            } else if (fe.num_sectors == 0) {
+                printf("%s - %d bytes\n", path, fe.size);
+            } else {
+                printf("%s - %d bytes (sectors %d-%d%s)\n", path, fe.size,
+                       fe.first_sector, fe.first_sector + fe.num_sectors - 1,
+                       (fe.flags & FS_FILE_COMPRESSED) ? ", lz4" : "");
+            }
         }
     }
-    
-    if (free_entry == -1) {
-        printf("No free file entries\n");
-        fclose(disk);
-        return;
+}
+
+void list_files(const char* disk_image) {
+    if (open_fs(disk_image) != 0) return;
+
+    printf("Files on disk: %d\n", fs_sb.num_files - 1);
+    list_dir(FS_ROOT_INODE, "");
+    close_fs();
+}
+
+// Creates the directories on `path` that do not exist yet, up to its
+// last component, or including it when `whole` is set.
+static int make_dirs(const char* path, int whole) {
+    char prefix[FS_MAX_PATH];
+    FileEntry fe;
+    size_t len = strlen(path);
+    if (len >= sizeof(prefix)) {
+        printf("Invalid path %s\n", path);
+        return -1;
     }
-    
+    for (size_t i = 1; i <= len; i++) {
+        if (i < len && path[i] != '/') continue;
+        if (path[i - 1] == '/' || (i == len && !whole)) continue;
+        memcpy(prefix, path, i);
+        prefix[i] = '\0';
+        uint32_t ino = fs_resolve(prefix);
+        if (ino == FS_NO_INODE) {
+            if (fs_mkdir(prefix) != 0) return -1;
+            continue;
+        }
+        fs_inode_read(ino, &fe);
+        if (fe.type != FS_TYPE_DIR) {
+            printf("%s is not a directory\n", prefix);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void make_directory(const char* disk_image, const char* path) {
+    if (open_fs(disk_image) != 0) return;
+    make_dirs(path, 1);
+    close_fs();
+}
+
+// Creates or replaces `filename`, making its directories as needed.
+// fs_edit_file rewrites only what changed.
+static int store_file(const char* filename, const uint8_t* data, uint32_t size) {
+    if (make_dirs(filename, 0) != 0) return -1;
+    if (fs_file_exists(filename)) return fs_edit_file(filename, data, size);
+    return fs_create_file(filename, data, size);
+}
+
+void write_file_to_image(const char* disk_image, const char* filename, const char* source_file) {
     FILE* src = fopen(source_file, "rb");
     if (!src) {
         printf("Could not open source file %s\n", source_file);
-        fclose(disk);
         return;
     }
-    
+
     fseek(src, 0, SEEK_END);
     uint32_t size = ftell(src);
     fseek(src, 0, SEEK_SET);
-    
-    uint8_t* buffer = malloc(size);
+
+    uint8_t* buffer = malloc(size ? size : 1);
     fread(buffer, 1, size, src);
     fclose(src);
-    
-    uint32_t num_sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
-    uint32_t highest_sector = FIRST_DATA_SECTOR;
-    
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use && i != free_entry) {
-            uint32_t last_sector = ft.files[i].first_sector + ft.files[i].num_sectors;
-            if (last_sector > highest_sector) {
-                highest_sector = last_sector;
+
+    if (open_fs(disk_image) != 0) {
+        free(buffer);
+        return;
+    }
+    if (fs_file_exists(filename)) printf("File %s already exists, replacing it\n", filename);
+    int ret = store_file(filename, buffer, size);
+    free(buffer);
+
+    FileEntry fe;
+    if (ret == 0) fs_inode_read(fs_resolve(filename), &fe);
+    close_fs();
+    if (ret != 0) return;
+    if (fe.flags & FS_FILE_INLINE) {
+        printf("File %s written to disk image (%d bytes, inline)\n", filename, size);
+    } else {
+        printf("File %s written to disk image (%d bytes, %d sectors%s)\n", filename, size, fe.num_sectors,
+               (fe.flags & FS_FILE_COMPRESSED) ? ", lz4" : "");
+    }
+}
+
+// ---------------- Import ----------------
+
+typedef struct {
+    char path[FS_MAX_PATH];     // on the image
+    char* source;               // on the host, NULL for a directory
+    uint32_t size;
+} ImportEntry;
+
+typedef struct {
+    ImportEntry* entries;
+    uint32_t count;
+    uint32_t capacity;
+} ImportList;
+
+static void import_add(ImportList* list, const char* path, const char* source, uint32_t size) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->entries = realloc(list->entries, list->capacity * sizeof(ImportEntry));
+    }
+    ImportEntry* e = &list->entries[list->count++];
+    strcpy(e->path, path);
+    e->source = source ? strdup(source) : NULL;
+    e->size = size;
+}
+
+// Collects a directory's files in name order before descending into its
+// subdirectories, so the files of one directory end up side by side.
+static void import_scan(ImportList* list, const char* host_dir, const char* disk_dir) {
+    struct dirent** names;
+    int n = scandir(host_dir, &names, NULL, alphasort);
+    if (n < 0) {
+        printf("Could not read directory %s\n", host_dir);
+        return;
+    }
+
+    char source[4096];
+    char path[FS_MAX_PATH];
+    struct stat st;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < n; i++) {
+            const char* name = names[i]->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+            snprintf(source, sizeof(source), "%s/%s", host_dir, name);
+            if (stat(source, &st) != 0 || (pass == 0) != (S_ISREG(st.st_mode) != 0)) continue;
+            if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) continue;
+            if (strlen(name) >= MAX_FILENAME ||
+                snprintf(path, sizeof(path), "%s/%s", disk_dir, name) >= (int)sizeof(path)) {
+                printf("Skipping %s: name too long\n", source);
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                import_add(list, path, NULL, 0);
+                import_scan(list, source, path);
+            } else if ((uint64_t)st.st_size > UINT32_MAX) {
+                printf("Skipping %s: too large\n", source);
+            } else {
+                import_add(list, path, source, (uint32_t)st.st_size);
             }
         }
     }
+    for (int i = 0; i < n; i++) free(names[i]);
+    free(names);
+}
+
+// Copies a host directory tree into `disk_dir`. Room for every file is
+// reserved as one run up front, held by FS_NO_INODE, and fs_alloc_extent
+// lays the files out in it back to back. The run is only ever reserved
+// in memory, so whatever an interrupted import did not use is free.
+void import_directory(const char* disk_image, const char* host_dir, const char* disk_dir) {
+    struct timespec start, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (open_fs(disk_image) != 0) return;
+
+    char base[FS_MAX_PATH];
+    snprintf(base, sizeof(base), "%s", disk_dir);
+    size_t len = strlen(base);
+    while (len > 0 && base[len - 1] == '/') base[--len] = '\0';
+
+    ImportList list = {0};
+    import_scan(&list, host_dir, base);
+
+    uint64_t sectors = 0;
+    for (uint32_t i = 0; i < list.count; i++) {
+        if (list.entries[i].source && list.entries[i].size > FS_INLINE_MAX) {
+            sectors += (list.entries[i].size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        }
+    }
+    uint32_t first = (sectors > 0 && sectors < fs_total_sectors) ? fs_find_extent((uint32_t)sectors) : 0;
+    if (first) fs_reserve(FS_NO_INODE, first, (uint32_t)sectors);
+    else if (sectors > 0) printf("No free run of %llu sectors, placing files one by one\n", (unsigned long long)sectors);
+
+    uint32_t files = 0, dirs = 0, failed = 0;
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < list.count; i++) {
+        ImportEntry* e = &list.entries[i];
+        if (!e->source) {
+            if (make_dirs(e->path, 1) != 0) failed++;
+            else dirs++;
+            continue;
+        }
+
+        int fd = open(e->source, O_RDONLY);
+        const uint8_t* data = NULL;
+        if (fd >= 0 && e->size > 0) {
+            void* map = mmap(NULL, e->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = map == MAP_FAILED ? NULL : map;
+        }
+        if (fd < 0 || (e->size > 0 && !data)) {
+            printf("Could not read %s\n", e->source);
+            failed++;
+        } else if (store_file(e->path, data ? data : (const uint8_t*)"", e->size) != 0) {
+            failed++;
+        } else {
+            files++;
+            bytes += e->size;
+        }
+        if (data) munmap((void*)data, e->size);
+        if (fd >= 0) close(fd);
+        free(e->source);
+    }
+    fs_reserve_drop(FS_NO_INODE);
+    close_fs();
+    free(list.entries);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double ms = (end_time.tv_sec - start.tv_sec) * 1000.0 + (end_time.tv_nsec - start.tv_nsec) / 1e6;
+    printf("Imported %d files (%llu KB) and %d directories in %.1f ms", files,
+           (unsigned long long)(bytes >> 10), dirs, ms);
+    if (failed) printf(", %d failed", failed);
+    printf("\n");
+}
+
+// Decodes the chunks of a compressed file whose sectors are at `packed`,
+// writing them to `out` unless it is NULL. `chunk` holds FS_CZ_CHUNK
+// bytes. Returns the first chunk that does not decode, or -1.
+static int unpack_file(const FileEntry* fe, const uint8_t* packed, uint8_t* chunk, FILE* out) {
+    uint32_t size = fe->size;
+    uint32_t chunks = (size + FS_CZ_CHUNK - 1) / FS_CZ_CHUNK;
+    uint32_t index_bytes = (chunks * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    const uint32_t* index = (const uint32_t*)packed;
+    if (index_bytes > fe->num_sectors * SECTOR_SIZE) return 0;
+    for (uint32_t i = 0; i < chunks; i++) {
+        uint32_t start = i ? index[i - 1] : 0;
+        uint32_t raw_len = size - i * FS_CZ_CHUNK < FS_CZ_CHUNK ? size - i * FS_CZ_CHUNK : FS_CZ_CHUNK;
+        const uint8_t* src = packed + index_bytes + start;
+        if (index[i] < start || index_bytes + index[i] > fe->num_sectors * SECTOR_SIZE ||
+            (index[i] - start != raw_len &&
+             lz4_decompress(src, index[i] - start, chunk, raw_len) != (int)raw_len)) {
+            return i;
+        }
+        if (out) fwrite(index[i] - start == raw_len ? src : chunk, raw_len, 1, out);
+    }
+    return -1;
+}
+
+void extract_file(const char* disk_image, const char* filename, const char* output_file) {
+    static uint8_t buffer[FS_RA_MAX_WINDOW * SECTOR_SIZE];
+    if (open_fs(disk_image) != 0) return;
+
+    int fd = fs_open(filename, O_RDONLY);
+    if (fd < 0) {
+        close_fs();
+        return;
+    }
+    FILE* out = fopen(output_file, "wb");
+    if (!out) {
+        printf("Could not create output file\n");
+        fs_close(fd);
+        close_fs();
+        return;
+    }
+
+    uint32_t size = 0;
+    int n;
+    while ((n = fs_read(fd, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, n, 1, out);
+        size += n;
+    }
+    if (n < 0) printf("Read failed after %d bytes\n", size);
+
+    fclose(out);
+    fs_close(fd);
+    close_fs();
+
+    printf("File %s extracted to %s (%d bytes)\n", filename, output_file, size);
+}
+
+// ---------------- Verify and extract-all ----------------
+// The tree is walked once to build a job per file; a pool of threads
+// then claims jobs in order, reads each extent with one pread, checks
+// every sector against its CRC32C and, for extract-all, writes the file
+// out. Problems are collected per job and reported after the join, so
+// the output does not depend on the thread count. The workers only
+// touch their own buffers and the image, never fs.h.
+
+#define CHECK_MAX_THREADS 64
+
+typedef struct {
+    char path[FS_MAX_PATH];
+    FileEntry fe;
+    uint32_t bad;               // sectors failing their checksum
+    uint32_t first_bad;
+    int bad_chunk;              // first compressed chunk that does not decode, or -1
+    int write_failed;
+} CheckJob;
+
+typedef struct {
+    const uint32_t* csums;      // the whole checksum table
+    const char* out_dir;        // NULL for verify
+    CheckJob* jobs;
+    uint32_t count;
+    uint32_t next;              // next job to claim
+    uint64_t bytes;             // bytes read from the image
+} CheckPool;
+
+static void check_scan(uint32_t dir_ino, const char* prefix, const char* out_dir,
+                       CheckJob** jobs, uint32_t* count, uint32_t* capacity) {
+    FileEntry dir, fe;
+    DirBlock blk;
+    char path[FS_MAX_PATH];
+    char host[4096];
+
+    fs_inode_read(dir_ino, &dir);
+    for (uint32_t b = 0; b < dir.num_sectors; b++) {
+        fs_cache_peek(dir.first_sector + b, &blk);
+        for (uint32_t off = 0; off < blk.used; off += dir_record_size(blk.records + off)) {
+            uint8_t* rec = blk.records + off;
+            uint32_t ino = dir_record_inode(rec);
+            if (ino >= MAX_FILES || ino == dir_ino) continue;
+            fs_inode_read(ino, &fe);
+            if (!fe.in_use) continue;
+            snprintf(path, sizeof(path), "%s/%.*s", prefix, rec[4], (char*)rec + DIR_RECORD_HEADER);
+            if (fe.type == FS_TYPE_DIR) {
+                if (out_dir) {
+                    snprintf(host, sizeof(host), "%s%s", out_dir, path);
+                    if (mkdir(host, 0755) != 0 && errno != EEXIST) printf("Could not create %s\n", host);
+                }
+                check_scan(ino, path, out_dir, jobs, count, capacity);
+                continue;
+            }
+            if (*count == *capacity) {
+                *capacity = *capacity ? *capacity * 2 : 256;
+                *jobs = realloc(*jobs, *capacity * sizeof(CheckJob));
+            }
+            CheckJob* job = &(*jobs)[(*count)++];
+            memset(job, 0, sizeof(CheckJob));
+            strcpy(job->path, path);
+            job->fe = fe;
+            job->bad_chunk = -1;
+        }
+    }
+}
+
+static void check_file(CheckPool* pool, CheckJob* job, uint8_t** buffer, size_t* buffer_size, uint8_t* chunk) {
+    const FileEntry* fe = &job->fe;
+    size_t bytes = (size_t)fe->num_sectors * SECTOR_SIZE;
+    int inline_data = (fe->flags & FS_FILE_INLINE) != 0;
+
+    if (!inline_data && bytes > 0) {
+        if (bytes > *buffer_size) {
+            *buffer = realloc(*buffer, bytes);
+            *buffer_size = bytes;
+        }
+        ssize_t got = pread(image_fd, *buffer, bytes, (off_t)fe->first_sector * SECTOR_SIZE);
+        if (got < 0) got = 0;
+        if ((size_t)got < bytes) memset(*buffer + got, 0, bytes - got);
+        __atomic_fetch_add(&pool->bytes, (uint64_t)got, __ATOMIC_RELAXED);
+
+        for (uint32_t i = 0; i < fe->num_sectors; i++) {
+            uint32_t lba = fe->first_sector + i;
+            if (lba < fs_layout.data || lba >= fs_total_sectors ||
+                crc32c(0, *buffer + (size_t)i * SECTOR_SIZE, SECTOR_SIZE) != pool->csums[lba]) {
+                if (job->bad++ == 0) job->first_bad = lba;
+            }
+        }
+    }
+
+    FILE* out = NULL;
+    if (pool->out_dir) {
+        char host[4096];
+        snprintf(host, sizeof(host), "%s%s", pool->out_dir, job->path);
+        out = fopen(host, "wb");
+        if (!out) {
+            job->write_failed = 1;
+            return;
+        }
+    }
+    if (fe->flags & FS_FILE_COMPRESSED) {
+        job->bad_chunk = bytes > 0 ? unpack_file(fe, *buffer, chunk, out) : 0;
+    } else if (out && fe->size > 0) {
+        const uint8_t* data = inline_data ? fe->data : *buffer;
+        if (!inline_data && fe->size > bytes) job->write_failed = 1;
+        else if (fwrite(data, fe->size, 1, out) != 1) job->write_failed = 1;
+    }
+    if (out && fclose(out) != 0) job->write_failed = 1;
+}
+
+static void* check_worker(void* arg) {
+    CheckPool* pool = arg;
+    uint8_t* buffer = NULL;
+    size_t buffer_size = 0;
+    uint8_t* chunk = malloc(FS_CZ_CHUNK);
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= pool->count) break;
+        check_file(pool, &pool->jobs[i], &buffer, &buffer_size, chunk);
+    }
+    free(buffer);
+    free(chunk);
+    return NULL;
+}
+
+static int extent_order(const void* a, const void* b) {
+    const DefragExtent* x = a;
+    const DefragExtent* y = b;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+// Reports extents that overlap each other, fall outside the data area
+// or are not marked in use. The defrag index has every extent in use.
+// Returns the number of problems.
+static uint32_t check_extents() {
+    fs_defrag_index_build();
+    qsort(fs_defrag_index, fs_defrag_extents, sizeof(DefragExtent), extent_order);
+
+    uint64_t end = 0;
+    uint32_t end_ino = 0, problems = 0;
+    for (uint32_t i = 0; i < fs_defrag_extents; i++) {
+        DefragExtent* e = &fs_defrag_index[i];
+        uint64_t e_end = (uint64_t)e->first + e->count;
+        if (e->first < fs_layout.data || e_end > fs_total_sectors) {
+            printf("Inode %d: sectors %d-%llu outside the data area\n", e->ino, e->first,
+                   (unsigned long long)e_end - 1);
+            problems++;
+            continue;
+        }
+        if (e->first < end) {
+            printf("Inode %d: sectors %d-%llu overlap inode %d\n", e->ino, e->first,
+                   (unsigned long long)e_end - 1, end_ino);
+            problems++;
+        }
+        for (uint32_t lba = e->first; lba < e_end; lba++) {
+            if (!fs_bitmap_test(lba)) {
+                printf("Inode %d: sector %d is marked free\n", e->ino, lba);
+                problems++;
+                break;
+            }
+        }
+        if (e_end > end) {
+            end = e_end;
+            end_ino = e->ino;
+        }
+    }
+    return problems;
+}
+
+static uint32_t default_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > CHECK_MAX_THREADS ? CHECK_MAX_THREADS : (uint32_t)n;
+}
+
+// Checks every file of the image, or extracts them into `out_dir` when
+// it is not NULL. Returns the number of problems found.
+uint32_t check_image(const char* disk_image, const char* out_dir, uint32_t threads) {
+    struct timespec start, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (open_fs(disk_image) != 0) return 1;
+    if (out_dir && mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+        printf("Could not create %s\n", out_dir);
+        close_fs();
+        return 1;
+    }
+    if (threads == 0) threads = default_threads();
+    if (threads > CHECK_MAX_THREADS) threads = CHECK_MAX_THREADS;
+
+    // The mount left nothing in the journal, so the table on disk is current.
+    uint32_t* csums = malloc((size_t)fs_layout.csum_sectors * SECTOR_SIZE);
+    disk_read_sectors(fs_layout.csum, fs_layout.csum_sectors, (uint8_t*)csums);
+    CheckPool pool = {csums, out_dir, NULL, 0, 0, 0};
+    uint32_t capacity = 0;
+    check_scan(FS_ROOT_INODE, "", out_dir, &pool.jobs, &pool.count, &capacity);
+    uint32_t problems = check_extents();
+
+    pthread_t workers[CHECK_MAX_THREADS];
+    uint32_t started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, check_worker, &pool) != 0) break;
+    }
+    if (started == 0) check_worker(&pool);
+    for (uint32_t t = 0; t < started; t++) pthread_join(workers[t], NULL);
+
+    uint64_t bytes = 0;
+    uint32_t bad_sectors = 0, bad_files = 0;
+    for (uint32_t i = 0; i < pool.count; i++) {
+        CheckJob* job = &pool.jobs[i];
+        bytes += job->fe.size;
+        if (job->bad) printf("%s: %d bad sectors, first at %d\n", job->path, job->bad, job->first_bad);
+        if (job->bad_chunk >= 0) printf("%s: compressed chunk %d does not decode\n", job->path, job->bad_chunk);
+        if (job->write_failed) printf("%s: could not write %s%s\n", job->path, out_dir, job->path);
+        bad_sectors += job->bad;
+        bad_files += job->bad || job->bad_chunk >= 0 || job->write_failed;
+    }
+    problems += bad_files;
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double ms = (end_time.tv_sec - start.tv_sec) * 1000.0 + (end_time.tv_nsec - start.tv_nsec) / 1e6;
+    printf("%s %d files (%llu KB, %llu KB read) with %d threads in %.1f ms, %.1f MB/s\n",
+           out_dir ? "Extracted" : "Verified", pool.count, (unsigned long long)(bytes >> 10),
+           (unsigned long long)(pool.bytes >> 10), started ? started : 1, ms,
+           ms > 0 ? pool.bytes / (ms * 1000.0) : 0.0);
+    printf("%d bad sectors, %d damaged files, %d extent problems\n", bad_sectors, bad_files,
+           problems - bad_files);
+    free(pool.jobs);
+    free(csums);
+    close_fs();
+    return problems;
+}
+
+// ---------------- Defrag ----------------
+// Runs the kernel's background defrag (fs_defrag_step in libs/fs.h) to
+// the end, so the image is compacted the same way and every move is as
+// crash-safe as it is there.
+
+void defrag_image(const char* disk_image) {
+    if (open_fs(disk_image) != 0) return;
+
+    fs_frag_report();
+    if (fs_defrag_start() == 0) {
+        while (fs_defrag_step());
+    }
+    fs_defrag_report();
+    close_fs();
+}
+
+// ---------------- Trace replay ----------------
+// Replays a block trace (libs/blktrace.h) through a model: an LRU cache
+// of N sectors in front of a disk that charges a fixed cost per request,
+// a seek proportional to the distance from the end of the previous
+// request and a transfer time per sector. Writes go through the cache.
+// Allocator policies are compared by finding the allocations in the
+// trace: a write into sectors that are free in the image's bitmap starts
+// an extent, and writes that continue it in the same fs call, or in an
+// append, grow it. Each policy places
+// those extents in its own copy of the bitmap, and every later request
+// to them follows. Frees are not visible in a block trace, so replayed
+// allocations never reuse space. The image should be the one the trace
+// started from.
+
+#define REPLAY_REQUEST_US       20.0
+#define REPLAY_SECTOR_US        5.0
+#define REPLAY_SEEK_US          4000.0  // across the whole disk
+#define REPLAY_FLUSH_US         500.0
+#define REPLAY_MAX_CACHES       16
+#define REPLAY_NONE             0xFFFFFFFF
+
+#define POLICY_BEST_FIT         0
+#define POLICY_FIRST_FIT        1
+#define POLICY_NEXT_FIT         2
+#define POLICIES                3
+
+static const char* policy_names[POLICIES] = {"best-fit", "first-fit", "next-fit"};
+
+// An extent allocated during the trace, `first` as recorded.
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+    uint32_t record;            // record that starts it
+    uint32_t placed;            // where the replayed policy put it, 0 if nowhere
+} ReplayAlloc;
+
+// LRU list threaded through slot indices, with hash chains for lookup.
+typedef struct {
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t* lba;
+    uint32_t* prev;
+    uint32_t* next;
+    uint32_t* chain;
+    uint32_t* buckets;
+    uint32_t nbuckets;
+    uint32_t head;              // most recently used
+    uint32_t tail;
+} SimCache;
+
+typedef struct {
+    uint64_t reads;             // sectors asked for
+    uint64_t hits;
+    uint64_t requests;          // device requests after the cache
+    double us;
+} ReplayResult;
+
+static void sim_cache_init(SimCache* c, uint32_t capacity) {
+    memset(c, 0, sizeof(SimCache));
+    c->capacity = capacity;
+    c->nbuckets = 1;
+    while (c->nbuckets < capacity * 2) c->nbuckets *= 2;
+    c->lba = malloc((capacity + 1) * sizeof(uint32_t));
+    c->prev = malloc((capacity + 1) * sizeof(uint32_t));
+    c->next = malloc((capacity + 1) * sizeof(uint32_t));
+    c->chain = malloc((capacity + 1) * sizeof(uint32_t));
+    c->buckets = malloc(c->nbuckets * sizeof(uint32_t));
+    memset(c->buckets, 0xFF, c->nbuckets * sizeof(uint32_t));
+    c->head = c->tail = REPLAY_NONE;
+}
+
+static void sim_cache_free(SimCache* c) {
+    free(c->lba);
+    free(c->prev);
+    free(c->next);
+    free(c->chain);
+    free(c->buckets);
+}
+
+static void sim_cache_unlink(SimCache* c, uint32_t slot) {
+    if (c->prev[slot] != REPLAY_NONE) c->next[c->prev[slot]] = c->next[slot];
+    else c->head = c->next[slot];
+    if (c->next[slot] != REPLAY_NONE) c->prev[c->next[slot]] = c->prev[slot];
+    else c->tail = c->prev[slot];
+}
+
+static void sim_cache_push(SimCache* c, uint32_t slot) {
+    c->prev[slot] = REPLAY_NONE;
+    c->next[slot] = c->head;
+    if (c->head != REPLAY_NONE) c->prev[c->head] = slot;
+    c->head = slot;
+    if (c->tail == REPLAY_NONE) c->tail = slot;
+}
+
+// Returns 1 on a hit. Either way `lba` ends up most recently used.
+static int sim_cache_access(SimCache* c, uint32_t lba) {
+    if (c->capacity == 0) return 0;
+    uint32_t* bucket = &c->buckets[(lba * 2654435761u) & (c->nbuckets - 1)];
+    for (uint32_t slot = *bucket; slot != REPLAY_NONE; slot = c->chain[slot]) {
+        if (c->lba[slot] == lba) {
+            sim_cache_unlink(c, slot);
+            sim_cache_push(c, slot);
+            return 1;
+        }
+    }
+    uint32_t slot;
+    if (c->used < c->capacity) {
+        slot = c->used++;
+    } else {
+        slot = c->tail;
+        sim_cache_unlink(c, slot);
+        uint32_t* link = &c->buckets[(c->lba[slot] * 2654435761u) & (c->nbuckets - 1)];
+        while (*link != slot) link = &c->chain[*link];
+        *link = c->chain[slot];
+    }
+    c->lba[slot] = lba;
+    c->chain[slot] = *bucket;
+    *bucket = slot;
+    sim_cache_push(c, slot);
+    return 0;
+}
+
+static uint32_t policy_find(const uint8_t* bitmap, uint32_t total, uint32_t count, int policy, uint32_t* cursor) {
+    uint32_t best_start = 0, best_len = 0;
+    uint32_t run_start = 0, run_len = 0;
+    uint32_t from = policy == POLICY_NEXT_FIT && *cursor > fs_layout.data ? *cursor : fs_layout.data;
     
-    strncpy(ft.files[free_entry].filename, filename, MAX_FILENAME-1);
-    ft.files[free_entry].size = size;
-    ft.files[free_entry].first_sector = highest_sector;
-    ft.files[free_entry].num_sectors = num_sectors;
-    
-    if (!ft.files[free_entry].in_use) {
-        ft.files[free_entry].in_use = 1;
-        ft.num_files++;
+    for (uint32_t n = 0; n <= total - fs_layout.data; n++) {
+        uint32_t lba = from + n;
+        if (lba >= total) lba -= total - fs_layout.data;
+        int last = n == total - fs_layout.data || lba == total - 1;
+        if (n < total - fs_layout.data && !bit_test(bitmap, lba)) {
+            if (run_len == 0) run_start = lba;
+            run_len++;
+            if (!last) continue;
+        }
+        if (run_len >= count && (best_len == 0 || run_len < best_len)) {
+            best_start = run_start;
+            best_len = run_len;
+            if (policy != POLICY_BEST_FIT || run_len == count) break;
+        }
+        run_len = 0;
     }
+    if (best_len) *cursor = best_start + count;
+    return best_start;
+}
+
+// Finds the extents the trace allocated, in the order it started them.
+static ReplayAlloc* replay_allocs(const TraceRecord* recs, uint32_t count, const uint8_t* image_bitmap,
+                                  uint32_t total, uint32_t* nallocs) {
+    uint8_t* bitmap = malloc(sizeof(fs_bitmap));
+    memcpy(bitmap, image_bitmap, sizeof(fs_bitmap));
+    ReplayAlloc* allocs = NULL;
+    uint32_t n = 0, capacity = 0;
     
-    fseek(disk, SECTOR_SIZE, SEEK_SET);
-    fwrite(&ft, sizeof(FileTable), 1, disk);
+    for (uint32_t r = 0; r < count; r++) {
+        if (recs[r].op != TRACE_WRITE) continue;
+        for (uint32_t lba = recs[r].lba; lba < recs[r].lba + recs[r].count; lba++) {
+            if (lba < fs_layout.data || lba >= total || bit_test(bitmap, lba)) continue;
+            bitmap_mark(bitmap, lba, 1, 1);
+            const ReplayAlloc* last = n ? &allocs[n - 1] : NULL;
+            if (last && last->first + last->count == lba &&
+                (recs[last->record].seq == recs[r].seq || recs[r].call == TRACE_CALL_WRITE)) {
+                allocs[n - 1].count++;
+                continue;
+            }
+            if (n == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                allocs = realloc(allocs, capacity * sizeof(ReplayAlloc));
+            }
+            allocs[n++] = (ReplayAlloc){lba, 1, r, 0};
+        }
+    }
+    free(bitmap);
+    *nallocs = n;
+    return allocs;
+}
+
+static int alloc_order(const void* a, const void* b) {
+    const ReplayAlloc* x = *(const ReplayAlloc* const*)a;
+    const ReplayAlloc* y = *(const ReplayAlloc* const*)b;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+// Where `lba` lives under the replayed policy.
+static uint32_t replay_map(ReplayAlloc** sorted, uint32_t n, uint32_t lba) {
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (sorted[mid]->first <= lba) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return lba;
+    ReplayAlloc* a = sorted[lo - 1];
+    if (lba >= a->first + a->count || a->placed == 0) return lba;
+    return a->placed + (lba - a->first);
+}
+
+static void replay_run(const TraceRecord* recs, uint32_t count, ReplayAlloc* allocs, ReplayAlloc** sorted,
+                       uint32_t nallocs, const uint8_t* image_bitmap, uint32_t total, int policy,
+                       uint32_t cache_sectors, ReplayResult* result) {
+    uint8_t* bitmap = malloc(sizeof(fs_bitmap));
+    memcpy(bitmap, image_bitmap, sizeof(fs_bitmap));
+    SimCache cache;
+    sim_cache_init(&cache, cache_sectors);
+    memset(result, 0, sizeof(ReplayResult));
+    uint32_t next_alloc = 0, cursor = 0;
+    uint64_t head = 0;
     
-    uint8_t sector_buffer[SECTOR_SIZE];
-    for (uint32_t i = 0; i < num_sectors; i++) {
-        memset(sector_buffer, 0, SECTOR_SIZE);
-        
-        uint32_t bytes_to_write = (i == num_sectors - 1) ? 
-                                (size % SECTOR_SIZE ? size % SECTOR_SIZE : SECTOR_SIZE) : 
-                                SECTOR_SIZE;
-        
-        memcpy(sector_buffer, buffer + (i * SECTOR_SIZE), bytes_to_write);
+    for (uint32_t r = 0; r < count; r++) {
+        const TraceRecord* rec = &recs[r];
+        while (next_alloc < nallocs && allocs[next_alloc].record == r) {
+            ReplayAlloc* a = &allocs[next_alloc++];
+            a->placed = policy_find(bitmap, total, a->count, policy, &cursor);
+            if (a->placed) bitmap_mark(bitmap, a->placed, a->count, 1);
+        }
+        if (rec->op == TRACE_FLUSH) {
+            result->us += REPLAY_FLUSH_US;
+            continue;
+        }
+        if (rec->op != TRACE_READ && rec->op != TRACE_WRITE) continue;
         
-        fseek(disk, (highest_sector + i) * SECTOR_SIZE, SEEK_SET);
-        fwrite(sector_buffer, SECTOR_SIZE, 1, disk);
+        // Contiguous runs of sectors that reach the disk, one request each.
+        uint64_t run_start = 0, run_len = 0;
+        for (uint32_t i = 0; i <= rec->count; i++) {
+            uint32_t lba = 0;
+            int to_disk = 0;
+            if (i < rec->count) {
+                lba = replay_map(sorted, nallocs, rec->lba + i);
+                int hit = sim_cache_access(&cache, lba);
+                if (rec->op == TRACE_READ) {
+                    result->reads++;
+                    result->hits += hit;
+                }
+                to_disk = rec->op == TRACE_WRITE || !hit;
+                if (to_disk && run_len && lba == run_start + run_len) {
+                    run_len++;
+                    continue;
+                }
+            }
+            if (run_len) {
+                uint64_t distance = run_start > head ? run_start - head : head - run_start;
+                result->requests++;
+                result->us += REPLAY_REQUEST_US + REPLAY_SECTOR_US * run_len + REPLAY_SEEK_US * distance / total;
+                head = run_start + run_len;
+                run_len = 0;
+            }
+            if (to_disk) {
+                run_start = lba;
+                run_len = 1;
+            }
+        }
     }
-    
-    free(buffer);
-    fclose(disk);
-    
-    printf("File %s written to disk image (%d bytes, %d sectors)\n", filename, size, num_sectors);
+    for (uint32_t i = 0; i < nallocs; i++) allocs[i].placed = 0;
+    sim_cache_free(&cache);
+    free(bitmap);
 }
 
-void extract_file(const char* disk_image, const char* filename, const char* output_file) {
-    FILE* disk = fopen(disk_image, "rb");
-    if (!disk) {
-        printf("Could not open disk image\n");
+void replay_trace(const char* trace_file, const char* disk_image, uint32_t* cache_sizes, int ncaches) {
+    FILE* f = fopen(trace_file, "rb");
+    if (!f) {
+        printf("Could not open %s\n", trace_file);
         return;
     }
+    TraceHeader hdr;
+    if (fread(&hdr, sizeof(TraceHeader), 1, f) != 1 || memcmp(hdr.magic, TRACE_MAGIC, 4) != 0) {
+        printf("%s is not a block trace\n", trace_file);
+        fclose(f);
+        return;
+    }
+    if (hdr.version > TRACE_VERSION) {
+        printf("Trace version %d is newer than %d\n", hdr.version, TRACE_VERSION);
+        fclose(f);
+        return;
+    }
+    fseeko(f, 0, SEEK_END);
+    uint32_t count = (uint32_t)((ftello(f) - sizeof(TraceHeader)) / sizeof(TraceRecord));
+    TraceRecord* recs = malloc((size_t)count * sizeof(TraceRecord) + 1);
+    fseeko(f, sizeof(TraceHeader), SEEK_SET);
+    count = fread(recs, sizeof(TraceRecord), count, f);
+    fclose(f);
     
-    FileTable ft;
-    fseek(disk, SECTOR_SIZE, SEEK_SET);
-    fread(&ft, sizeof(FileTable), 1, disk);
-    
-    if (strncmp(ft.magic, K_MAGIC, 4) != 0) {
-        printf("Invalid filesystem or not initialized\n");
-        fclose(disk);
+    if (open_fs(disk_image) != 0) {
+        free(recs);
         return;
     }
+    uint32_t total = fs_total_sectors;
     
-    int file_index = -1;
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use && strcmp(ft.files[i].filename, filename) == 0) {
-            file_index = i;
-            break;
+    uint64_t by_call[TRACE_CALLS] = {0};
+    uint64_t by_op[4] = {0};
+    uint64_t lost = 0, sectors = 0;
+    for (uint32_t r = 0; r < count; r++) {
+        if (recs[r].op == TRACE_LOST) {
+            lost += recs[r].lba;
+            continue;
         }
+        if (recs[r].op > TRACE_FLUSH) continue;
+        by_op[recs[r].op]++;
+        sectors += recs[r].count;
+        if (recs[r].call < TRACE_CALLS) by_call[recs[r].call]++;
+    }
+    printf("%d requests: %llu reads, %llu writes, %llu flushes, %llu sectors, %llu lost\n", count,
+           (unsigned long long)by_op[TRACE_READ], (unsigned long long)by_op[TRACE_WRITE],
+           (unsigned long long)by_op[TRACE_FLUSH], (unsigned long long)sectors, (unsigned long long)lost);
+    if (count > 1 && hdr.tsc_hz) {
+        printf("Recorded over %.3f s\n", (double)(recs[count - 1].tsc - recs[0].tsc) / hdr.tsc_hz);
+    }
+    printf("By call:");
+    for (int c = 0; c < TRACE_CALLS; c++) {
+        if (by_call[c]) printf(" %s %llu", trace_call_name(c), (unsigned long long)by_call[c]);
     }
+    printf("\n");
     
-    if (file_index == -1) {
-        printf("File not found\n");
-        fclose(disk);
+    uint32_t nallocs;
+    ReplayAlloc* allocs = replay_allocs(recs, count, fs_bitmap, total, &nallocs);
+    ReplayAlloc** sorted = malloc((nallocs + 1) * sizeof(ReplayAlloc*));
+    for (uint32_t i = 0; i < nallocs; i++) sorted[i] = &allocs[i];
+    qsort(sorted, nallocs, sizeof(ReplayAlloc*), alloc_order);
+    printf("%d extents allocated during the trace\n\n", nallocs);
+    
+    printf("%-10s %8s %7s %10s %12s\n", "policy", "cache", "hit%", "requests", "simulated ms");
+    for (int policy = 0; policy < POLICIES; policy++) {
+        for (int c = 0; c < ncaches; c++) {
+            ReplayResult res;
+            replay_run(recs, count, allocs, sorted, nallocs, fs_bitmap, total, policy, cache_sizes[c], &res);
+            printf("%-10s %8d %6.1f%% %10llu %12.1f\n", policy_names[policy], cache_sizes[c],
+                   res.reads ? 100.0 * res.hits / res.reads : 0.0, (unsigned long long)res.requests, res.us / 1000);
+        }
+        // Without allocations all policies replay the same.
+        if (nallocs == 0) break;
+    }
+    free(sorted);
+    free(allocs);
+    free(recs);
+    close_fs();
+}
+
+// Splits a flat image into members that the kernel assembles into one
+// volume. The last stripe is padded with zeros.
+void stripe_image(const char* disk_image, uint32_t chunk_kb, int members, char** member_images) {
+    uint32_t chunk = chunk_kb * 2;
+    if (chunk == 0 || chunk > 256) {
+        printf("Chunk size must be between 1 and 128 KB\n");
         return;
     }
-    
-    FILE* out = fopen(output_file, "wb");
+    if (members < 1 || members > STRIPE_MAX_MEMBERS) {
+        printf("A set has between 1 and %d members\n", STRIPE_MAX_MEMBERS);
+        return;
+    }
+    FILE* src = fopen(disk_image, "rb");
+    if (!src) {
+        printf("Could not open disk image\n");
+        return;
+    }
+    fseek(src, 0, SEEK_END);
+    uint32_t total = ftell(src) / SECTOR_SIZE;
+    fseek(src, 0, SEEK_SET);
+    uint32_t rows = (total + chunk * members - 1) / (chunk * members);
+
+    FILE* out[STRIPE_MAX_MEMBERS];
+    StripeLabel label;
+    uint8_t buffer[256 * SECTOR_SIZE];
+    memset(&label, 0, sizeof(label));
+    memcpy(label.magic, STRIPE_MAGIC, 4);
+    label.set_id = (uint32_t)time(NULL) ^ (uint32_t)getpid();
+    label.members = members;
+    label.chunk_sectors = chunk;
+    label.total_sectors = rows * chunk * members;
+    for (int m = 0; m < members; m++) {
+        out[m] = fopen(member_images[m], "wb");
+        if (!out[m]) {
+            printf("Could not create %s\n", member_images[m]);
+            while (m-- > 0) fclose(out[m]);
+            fclose(src);
+            return;
+        }
+        label.index = m;
+        memset(buffer, 0, SECTOR_SIZE);
+        memcpy(buffer, &label, sizeof(label));
+        fwrite(buffer, SECTOR_SIZE, STRIPE_DATA_SECTOR, out[m]);
+    }
+
+    for (uint32_t row = 0; row < rows; row++) {
+        for (int m = 0; m < members; m++) {
+            memset(buffer, 0, chunk * SECTOR_SIZE);
+            if (fread(buffer, SECTOR_SIZE, chunk, src) == 0 && ferror(src)) {
+                printf("Read error\n");
+            }
+            fwrite(buffer, SECTOR_SIZE, chunk, out[m]);
+        }
+    }
+    for (int m = 0; m < members; m++) fclose(out[m]);
+    fclose(src);
+    printf("Striped %s over %d members, %d KB chunks (%d sectors)\n", disk_image, members, chunk_kb, label.total_sectors);
+}
+
+// Reassembles a flat image from the members of a set, in any order.
+void unstripe_image(const char* disk_image, int members, char** member_images) {
+    FILE* in[STRIPE_MAX_MEMBERS] = {0};
+    StripeLabel labels[STRIPE_MAX_MEMBERS];
+    if (members < 1 || members > STRIPE_MAX_MEMBERS) {
+        printf("A set has between 1 and %d members\n", STRIPE_MAX_MEMBERS);
+        return;
+    }
+    for (int m = 0; m < members; m++) {
+        StripeLabel label;
+        FILE* f = fopen(member_images[m], "rb");
+        if (!f || fread(&label, sizeof(label), 1, f) != 1 || memcmp(label.magic, STRIPE_MAGIC, 4) != 0 ||
+            label.members != (uint32_t)members || label.index >= label.members || in[label.index] ||
+            (m > 0 && label.set_id != labels[0].set_id)) {
+            printf("%s is not a member of this set\n", member_images[m]);
+            if (f) fclose(f);
+            for (int i = 0; i < members; i++) if (in[i]) fclose(in[i]);
+            return;
+        }
+        in[label.index] = f;
+        labels[m] = label;
+        fseek(f, STRIPE_DATA_SECTOR * SECTOR_SIZE, SEEK_SET);
+    }
+
+    FILE* out = fopen(disk_image, "wb");
     if (!out) {
-        printf("Could not create output file\n");
-        fclose(disk);
+        printf("Could not create disk image\n");
+        for (int i = 0; i < members; i++) fclose(in[i]);
         return;
     }
-    
-    uint32_t size = ft.files[file_index].size;
-    uint32_t num_sectors = ft.files[file_index].num_sectors;
-    uint32_t first_sector = ft.files[file_index].first_sector;
-    
-    uint8_t buffer[SECTOR_SIZE];
-    for (uint32_t i = 0; i < num_sectors; i++) {
-        fseek(disk, (first_sector + i) * SECTOR_SIZE, SEEK_SET);
-        fread(buffer, SECTOR_SIZE, 1, disk);
-        
-        uint32_t bytes_to_write = (i == num_sectors - 1) ? 
-                                (size % SECTOR_SIZE ? size % SECTOR_SIZE : SECTOR_SIZE) : 
-                                SECTOR_SIZE;
-        
-        fwrite(buffer, bytes_to_write, 1, out);
+    uint32_t chunk = labels[0].chunk_sectors;
+    uint32_t rows = labels[0].total_sectors / (chunk * members);
+    uint8_t buffer[256 * SECTOR_SIZE];
+    for (uint32_t row = 0; row < rows; row++) {
+        for (int m = 0; m < members; m++) {
+            memset(buffer, 0, chunk * SECTOR_SIZE);
+            if (fread(buffer, SECTOR_SIZE, chunk, in[m]) == 0 && ferror(in[m])) {
+                printf("Read error\n");
+            }
+            fwrite(buffer, SECTOR_SIZE, chunk, out);
+        }
     }
-    
+    for (int m = 0; m < members; m++) fclose(in[m]);
     fclose(out);
-    fclose(disk);
-    
-    printf("File %s extracted to %s (%d bytes)\n", filename, output_file, size);
+    printf("Reassembled %s from %d members\n", disk_image, members);
 }
 
 int main(int argc, char* argv[]) {
+    crc32c_init();
     if (argc < 2) {
         printf("Usage:\n");
-        printf("  %s create <disk_image> <size_mb>\n", argv[0]);
+        printf("  %s create <disk_image> <size_mb> [--prealloc]\n", argv[0]);
         printf("  %s format <disk_image>\n", argv[0]);
         printf("  %s list <disk_image>\n", argv[0]);
+        printf("  %s mkdir <disk_image> <dir_on_disk>\n", argv[0]);
         printf("  %s write <disk_image> <file_on_disk> <source_file>\n", argv[0]);
         printf("  %s extract <disk_image> <file_on_disk> <output_file>\n", argv[0]);
+        printf("  %s extract-all <disk_image> <output_dir> [threads]\n", argv[0]);
+        printf("  %s verify <disk_image> [threads]\n", argv[0]);
+        printf("  %s import <disk_image> <host_dir> [dir_on_disk]\n", argv[0]);
+        printf("  %s defrag <disk_image>\n", argv[0]);
+        printf("  %s replay <trace> <disk_image> [cache_sectors]...\n", argv[0]);
+        printf("  %s stripe <disk_image> <chunk_kb> <member_image>...\n", argv[0]);
+        printf("  %s unstripe <disk_image> <member_image>...\n", argv[0]);
         return 1;
     }
     
     if (strcmp(argv[1], "create") == 0) {
-        if (argc != 4) {
-            printf("Usage: %s create <disk_image> <size_mb>\n", argv[0]);
+        int prealloc = argc == 5 && strcmp(argv[4], "--prealloc") == 0;
+        if (argc != 4 && !prealloc) {
+            printf("Usage: %s create <disk_image> <size_mb> [--prealloc]\n", argv[0]);
             return 1;
         }
-        create_disk_image(argv[2], atoi(argv[3]));
+        create_disk_image(argv[2], atoi(argv[3]), prealloc);
     }
     else if (strcmp(argv[1], "format") == 0) {
         if (argc != 3) {
@@ -280,6 +1225,13 @@ int main(int argc, char* argv[]) {
         }
         list_files(argv[2]);
     }
+    else if (strcmp(argv[1], "mkdir") == 0) {
+        if (argc != 4) {
+            printf("Usage: %s mkdir <disk_image> <dir_on_disk>\n", argv[0]);
+            return 1;
+        }
+        make_directory(argv[2], argv[3]);
+    }
     else if (strcmp(argv[1], "write") == 0) {
         if (argc != 5) {
             printf("Usage: %s write <disk_image> <file_on_disk> <source_file>\n", argv[0]);
@@ -287,6 +1239,13 @@ int main(int argc, char* argv[]) {
         }
         write_file_to_image(argv[2], argv[3], argv[4]);
     }
+    else if (strcmp(argv[1], "import") == 0) {
+        if (argc != 4 && argc != 5) {
+            printf("Usage: %s import <disk_image> <host_dir> [dir_on_disk]\n", argv[0]);
+            return 1;
+        }
+        import_directory(argv[2], argv[3], argc == 5 ? argv[4] : "");
+    }
     else if (strcmp(argv[1], "extract") == 0) {
         if (argc != 5) {
             printf("Usage: %s extract <disk_image> <file_on_disk> <output_file>\n", argv[0]);
@@ -294,6 +1253,54 @@ int main(int argc, char* argv[]) {
         }
         extract_file(argv[2], argv[3], argv[4]);
     }
+    else if (strcmp(argv[1], "extract-all") == 0) {
+        if (argc != 4 && argc != 5) {
+            printf("Usage: %s extract-all <disk_image> <output_dir> [threads]\n", argv[0]);
+            return 1;
+        }
+        return check_image(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : 0) != 0;
+    }
+    else if (strcmp(argv[1], "verify") == 0) {
+        if (argc != 3 && argc != 4) {
+            printf("Usage: %s verify <disk_image> [threads]\n", argv[0]);
+            return 1;
+        }
+        return check_image(argv[2], NULL, argc == 4 ? atoi(argv[3]) : 0) != 0;
+    }
+    else if (strcmp(argv[1], "defrag") == 0) {
+        if (argc != 3) {
+            printf("Usage: %s defrag <disk_image>\n", argv[0]);
+            return 1;
+        }
+        defrag_image(argv[2]);
+    }
+    else if (strcmp(argv[1], "replay") == 0) {
+        if (argc < 4 || argc - 4 > REPLAY_MAX_CACHES) {
+            printf("Usage: %s replay <trace> <disk_image> [cache_sectors]...\n", argv[0]);
+            return 1;
+        }
+        uint32_t cache_sizes[REPLAY_MAX_CACHES] = {0, 64, 256, 1024, 4096, 16384};
+        int ncaches = 6;
+        if (argc > 4) {
+            ncaches = argc - 4;
+            for (int i = 0; i < ncaches; i++) cache_sizes[i] = atoi(argv[4 + i]);
+        }
+        replay_trace(argv[2], argv[3], cache_sizes, ncaches);
+    }
+    else if (strcmp(argv[1], "stripe") == 0) {
+        if (argc < 5) {
+            printf("Usage: %s stripe <disk_image> <chunk_kb> <member_image>...\n", argv[0]);
+            return 1;
+        }
+        stripe_image(argv[2], atoi(argv[3]), argc - 4, argv + 4);
+    }
+    else if (strcmp(argv[1], "unstripe") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s unstripe <disk_image> <member_image>...\n", argv[0]);
+            return 1;
+        }
+        unstripe_image(argv[2], argc - 3, argv + 3);
+    }
     else {
         printf("Unknown command %s\n", argv[1]);
         return 1;
@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+// Runs the kernel's file system code (libs/fs.h) against an image file,
+// to benchmark and stress-test it at native speed. fs.h brings its own
+// O_* flags, so <fcntl.h> stays out.
+
+void kernel_panic(const char* message) {
+    printf("panic: %s", message);
+    exit(1);
+}
+
+#include "libs/fs.h"
+
+// ---------------- Image device ----------------
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t flushes;
+} DeviceStats;
+
+static int image_fd = -1;
+static DeviceStats dev_stats;
+static FILE* trace_out = NULL;
+
+// Writes out the block trace queued by fs.h, see blktrace.h.
+static void trace_drain() {
+    TraceRecord* rec;
+    if (!trace_out) return;
+    while ((rec = fs_trace_peek()) != NULL) {
+        fwrite(rec, sizeof(TraceRecord), 1, trace_out);
+        fs_trace_next();
+    }
+}
+
+static void image_read(uint32_t lba, uint32_t count, uint8_t* buffer) {
+    size_t size = (size_t)count * SECTOR_SIZE;
+    ssize_t got = pread(image_fd, buffer, size, (off_t)lba * SECTOR_SIZE);
+    if (got < 0) got = 0;
+    if ((size_t)got < size) memset(buffer + got, 0, size - got);
+    dev_stats.reads++;
+    dev_stats.sectors_read += count;
+    trace_drain();
+}
+
+static void image_write(uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    size_t size = (size_t)count * SECTOR_SIZE;
+    if (pwrite(image_fd, buffer, size, (off_t)lba * SECTOR_SIZE) != (ssize_t)size) {
+        printf("Write to sector %d failed\n", lba);
+    }
+    dev_stats.writes++;
+    dev_stats.sectors_written += count;
+    trace_drain();
+}
+
+static void image_flush() {
+    dev_stats.flushes++;
+    trace_drain();
+}
+
+static BlockDevice image_device = {"image", 0, image_read, image_write, image_flush, 0};
+
+static int open_fs(const char* disk_image) {
+    FILE* disk = fopen(disk_image, "r+b");
+    if (!disk) {
+        printf("Could not open disk image\n");
+        return -1;
+    }
+    fseeko(disk, 0, SEEK_END);
+    image_device.sectors = (uint64_t)ftello(disk) / SECTOR_SIZE;
+    image_fd = dup(fileno(disk));
+    fclose(disk);
+
+    tmpfs_init();
+    fs_mount(&image_device);
+    if (fs_total_sectors == 0) {
+        printf("No usable file system on %s\n", disk_image);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_fs() {
+    fs_sync();
+    disk_flush();
+    fsync(image_fd);
+    close(image_fd);
+    if (trace_out) {
+        fs_trace_on = 0;
+        trace_drain();
+        fclose(trace_out);
+        printf("Traced %d requests\n", fs_trace_head);
+    }
+}
+
+static int open_trace(const char* path) {
+    trace_out = fopen(path, "wb");
+    if (!trace_out) {
+        printf("Could not create %s\n", path);
+        return -1;
+    }
+    TraceHeader hdr;
+    memset(&hdr, 0, sizeof(TraceHeader));
+    memcpy(hdr.magic, TRACE_MAGIC, 4);
+    hdr.version = TRACE_VERSION;
+    fwrite(&hdr, sizeof(TraceHeader), 1, trace_out);
+    fs_trace_start();
+    return 0;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Prints the time per operation and the device traffic since `start`.
+static void report(const char* phase, uint32_t ops, uint64_t start, const DeviceStats* before) {
+    uint64_t ns = now_ns() - start;
+    printf("%-10s %7u ops %9.0f ns/op %8llu reads %8llu writes %6llu flushes\n", phase, ops,
+           ops ? (double)ns / ops : 0.0,
+           (unsigned long long)(dev_stats.sectors_read - before->sectors_read),
+           (unsigned long long)(dev_stats.sectors_written - before->sectors_written),
+           (unsigned long long)(dev_stats.flushes - before->flushes));
+}
+
+// ---------------- Commands ----------------
+
+void cat_file(const char* path) {
+    uint8_t buffer[4096];
+    int fd = fs_open(path, O_RDONLY);
+    if (fd < 0) return;
+    int n;
+    while ((n = fs_read(fd, buffer, sizeof(buffer))) > 0) fwrite(buffer, 1, n, stdout);
+    fs_close(fd);
+}
+
+// Small-file create, lookup (through the dentry cache and without it),
+// read and delete, then a sequential stream.
+void bench(uint32_t files) {
+    static uint8_t buffer[4096];
+    char name[FS_MAX_PATH];
+    DeviceStats before;
+    uint64_t start;
+    uint32_t size;
+    memset(buffer, 'z', sizeof(buffer));
+
+    if (fs_mkdir("/fs_host.bench") != 0) return;
+    uint32_t free_before = fs_free_sectors();
+
+    before = dev_stats;
+    start = now_ns();
+    for (uint32_t i = 0; i < files; i++) {
+        sprintf(name, "/fs_host.bench/%u", i);
+        if (fs_create_file(name, buffer, 1024) != 0) {
+            files = i;
+            break;
+        }
+    }
+    fs_sync();
+    report("create", files, start, &before);
+
+    before = dev_stats;
+    start = now_ns();
+    for (uint32_t i = 0; i < files; i++) {
+        sprintf(name, "/fs_host.bench/%u", i);
+        if (!fs_file_exists(name)) printf("Lookup of %s failed\n", name);
+    }
+    report("lookup", files, start, &before);
+
+    fs_sync();
+    fs_forget();
+    before = dev_stats;
+    start = now_ns();
+    for (uint32_t i = 0; i < files; i++) {
+        sprintf(name, "/fs_host.bench/%u", i);
+        fs_file_exists(name);
+    }
+    report("cold", files, start, &before);
+
+    before = dev_stats;
+    start = now_ns();
+    for (uint32_t i = 0; i < files; i++) {
+        sprintf(name, "/fs_host.bench/%u", i);
+        if (fs_read_file(name, buffer, &size) != 0 || size != 1024) printf("Read of %s failed\n", name);
+    }
+    report("read", files, start, &before);
+
+    before = dev_stats;
+    start = now_ns();
+    for (uint32_t i = 0; i < files; i++) {
+        sprintf(name, "/fs_host.bench/%u", i);
+        fs_delete_file(name);
+    }
+    fs_sync();
+    report("delete", files, start, &before);
+
+    uint32_t stream_kb = 16384;
+    int fd = fs_open("/fs_host.bench/stream", O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0) return;
+    before = dev_stats;
+    start = now_ns();
+    for (uint32_t kb = 0; kb < stream_kb; kb += 4) {
+        if (fs_write(fd, buffer, sizeof(buffer)) < 0) {
+            stream_kb = kb;
+            break;
+        }
+    }
+    fs_close(fd);
+    fs_sync();
+    report("write 4K", stream_kb / 4, start, &before);
+
+    fs_forget();
+    fd = fs_open("/fs_host.bench/stream", O_RDONLY);
+    before = dev_stats;
+    start = now_ns();
+    uint32_t chunks = 0;
+    while (fs_read(fd, buffer, sizeof(buffer)) > 0) chunks++;
+    report("read 4K", chunks, start, &before);
+    fs_close(fd);
+    fs_ra_report();
+
+    fs_delete_file("/fs_host.bench/stream");
+    fs_delete_file("/fs_host.bench");
+    fs_sync();
+    if (fs_free_sectors() != free_before + 1) {
+        printf("Leaked %d sectors\n", free_before + 1 - fs_free_sectors());
+    }
+}
+
+void defrag() {
+    DeviceStats before = dev_stats;
+    uint64_t start = now_ns();
+    uint32_t steps = 0;
+    fs_frag_report();
+    if (fs_defrag_start() != 0) return;
+    while (fs_defrag_step()) steps++;
+    report("defrag", steps, start, &before);
+    fs_defrag_report();
+}
+
+// ---------------- Stress ----------------
+// Random operations on a set of files, checked against copies kept in
+// host memory. Every cache is dropped now and then, a background defrag
+// runs between operations, and the file system is remounted before the
+// final check.
+
+#define STRESS_FILES            48
+#define STRESS_MAX_SIZE         (96 * 1024)
+
+typedef struct {
+    int exists;
+    uint32_t size;
+    uint8_t* data;
+} ModelFile;
+
+static ModelFile model[STRESS_FILES];
+static uint8_t stress_buffer[STRESS_MAX_SIZE];
+
+static int stress_check(uint32_t i) {
+    char name[FS_MAX_PATH];
+    uint32_t size = 0;
+    sprintf(name, "/fs_host.stress/%u", i);
+    if (!model[i].exists) {
+        if (!fs_file_exists(name)) return 0;
+        printf("%s exists but was deleted\n", name);
+        return -1;
+    }
+    if (fs_read_file(name, stress_buffer, &size) != 0 || size != model[i].size ||
+        memcmp(stress_buffer, model[i].data, size) != 0) {
+        printf("%s does not match: %d bytes, expected %d\n", name, size, model[i].size);
+        return -1;
+    }
+    return 0;
+}
+
+int stress(uint32_t ops, uint32_t seed) {
+    char name[FS_MAX_PATH];
+    uint8_t chunk[8192];
+    srand(seed);
+
+    fs_mkdir("/fs_host.stress");
+    uint32_t free_before = fs_free_sectors();
+    for (uint32_t i = 0; i < STRESS_FILES; i++) model[i].data = calloc(1, STRESS_MAX_SIZE);
+
+    DeviceStats before = dev_stats;
+    uint64_t start = now_ns();
+    for (uint32_t op = 0; op < ops; op++) {
+        uint32_t i = rand() % STRESS_FILES;
+        ModelFile* m = &model[i];
+        sprintf(name, "/fs_host.stress/%u", i);
+        int what = rand() % 100;
+        if (!fs_defrag_step() && rand() % 64 == 0) fs_defrag_start();
+
+        if (what < 40) {
+            uint32_t offset = rand() % (STRESS_MAX_SIZE - sizeof(chunk));
+            uint32_t count = 1 + rand() % (rand() % 4 ? 64 : sizeof(chunk));
+            if (rand() % 2 && m->exists && m->size <= STRESS_MAX_SIZE - sizeof(chunk)) offset = m->size;
+            for (uint32_t b = 0; b < count; b++) chunk[b] = rand() % (rand() % 3 ? 4 : 256);
+            int fd = fs_open(name, O_WRONLY | O_CREAT);
+            if (fd < 0 || fs_pwrite(fd, chunk, count, offset) != (int)count) {
+                printf("op %d: write to %s failed\n", op, name);
+                return -1;
+            }
+            fs_close(fd);
+            if (!m->exists) m->size = 0;
+            if (offset > m->size) memset(m->data + m->size, 0, offset - m->size);
+            memcpy(m->data + offset, chunk, count);
+            if (offset + count > m->size) m->size = offset + count;
+            m->exists = 1;
+        } else if (what < 55) {
+            if (!m->exists) continue;
+            uint32_t size = rand() % (m->size + 1);
+            int fd = fs_open(name, O_WRONLY);
+            if (fd < 0 || fs_ftruncate(fd, size) != 0) {
+                printf("op %d: truncate of %s failed\n", op, name);
+                return -1;
+            }
+            fs_close(fd);
+            m->size = size;
+        } else if (what < 65) {
+            if (!m->exists) continue;
+            if (fs_delete_file(name) != 0) {
+                printf("op %d: delete of %s failed\n", op, name);
+                return -1;
+            }
+            m->exists = 0;
+        } else if (what < 98) {
+            if (stress_check(i) != 0) return -1;
+        } else {
+            fs_sync();
+            fs_forget();
+        }
+    }
+    report("stress", ops, start, &before);
+    while (fs_defrag_step());
+    printf("Defrag moved %d extents, %d restarted\n", fs_defrag.moved, fs_defrag.restarts);
+
+    fs_mount(disk_dev);
+    for (uint32_t i = 0; i < STRESS_FILES; i++) {
+        if (stress_check(i) != 0) return -1;
+    }
+    uint32_t bad = fs_scrub();
+    for (uint32_t i = 0; i < STRESS_FILES; i++) {
+        sprintf(name, "/fs_host.stress/%u", i);
+        if (model[i].exists) fs_delete_file(name);
+        free(model[i].data);
+    }
+    fs_sync();
+    uint32_t leaked = free_before - fs_free_sectors();
+    fs_delete_file("/fs_host.stress");
+    printf("%d ops with seed %d: %d bad sectors, %d sectors leaked\n", ops, seed, bad, leaked);
+    return bad || leaked ? -1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    const char* prog = argv[0];
+    // -t <trace_file> records the block requests of the command.
+    const char* trace_path = NULL;
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+        trace_path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 3) {
+        printf("Usage:\n");
+        printf("  %s [-t <trace_file>] <disk_image> ls [path]\n", prog);
+        printf("  %s [-t <trace_file>] <disk_image> cat <file_on_disk>\n", prog);
+        printf("  %s [-t <trace_file>] <disk_image> bench [files]\n", prog);
+        printf("  %s [-t <trace_file>] <disk_image> defrag\n", prog);
+        printf("  %s [-t <trace_file>] <disk_image> stress [ops] [seed]\n", prog);
+        return 1;
+    }
+    if (trace_path && open_trace(trace_path) != 0) return 1;
+    if (open_fs(argv[1]) != 0) return 1;
+
+    int ret = 0;
+    const char* command = argv[2];
+    if (strcmp(command, "ls") == 0) {
+        fs_list_files(argc > 3 ? argv[3] : "/");
+    } else if (strcmp(command, "cat") == 0 && argc > 3) {
+        cat_file(argv[3]);
+    } else if (strcmp(command, "bench") == 0) {
+        bench(argc > 3 ? atoi(argv[3]) : 2000);
+    } else if (strcmp(command, "defrag") == 0) {
+        defrag();
+    } else if (strcmp(command, "stress") == 0) {
+        ret = stress(argc > 3 ? atoi(argv[3]) : 20000, argc > 4 ? atoi(argv[4]) : 1) != 0;
+    } else {
+        printf("Unknown command: %s\n", command);
+        ret = 1;
+    }
+    close_fs();
+    return ret;
+}
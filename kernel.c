@@ -5,7 +5,7 @@
 // FileSystem > Load programs from disk
 // > DONE: disk and files 
 // > Load program from disk
-// > Directories
+// > DONE: Directories
 // TODO: Drivers
 // TODO: Some Text Editor
 // > DONE: simple text based file editor
@@ -14,6 +14,8 @@
 // TODO: Graphics
 #include "msstd.h"
 #include "libs/disk.h"
+#include "libs/serial.h"
+#include "libs/multiboot.h"
 #include "config.h"
 
 typedef struct {
@@ -153,77 +155,164 @@ void print_calendar(int year, int month) {
     printf("\n");
 }
 
-static inline uint64_t rdtsc(void) {
-    uint32_t lo, hi;
-    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
-    return ((uint64_t)hi << 32) | lo;
+// Single-sector reads, which is what the fs issues on a cache miss,
+// against large reads that keep several requests in flight.
+void disk_bench(BlockDevice *dev) {
+    static uint8_t buffer[256 * SECTOR_SIZE];
+    uint64_t start = rdtsc();
+    for (uint32_t lba = 0; lba < 1024; lba++) {
+        dev->read(lba, 1, buffer);
+    }
+    uint32_t single = (uint32_t)(rdtsc() - start) / 1024;
+    start = rdtsc();
+    for (uint32_t lba = 0; lba < 4096; lba += 256) {
+        dev->read(lba, 256, buffer);
+    }
+    uint32_t batched = (uint32_t)(rdtsc() - start) / 4096;
+    printf("%s: %d cycles/sector single, %d cycles/sector in 256-sector reads\n",
+           dev->name, single, batched);
 }
 
-uint64_t get_cpu_speed(void) {
-    uint64_t start, end;
-    uint64_t cycles;
+// Small-file and streaming workloads in the working directory. Run it
+// after `mount ram` to see the file system's own cost, or in /tmp.
+void fs_bench() {
+    static uint8_t buffer[4096];
+    char name[32];
+    uint32_t files = 32;
+    uint32_t stream_kb = 1024;
+    memset(buffer, 'z', sizeof(buffer));
+
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < files; i++) {
+        sprintf(name, "fsbench.%d", i);
+        if (fs_create_file(name, buffer, 1024) != 0) {
+            files = i;
+            break;
+        }
+    }
+    if (files == 0) return;
+    fs_sync();
+    uint32_t create = (uint32_t)(rdtsc() - start) / files;
+
+    uint32_t size;
     start = rdtsc();
-    for (volatile int i = 0; i < 1000000; i++) {}
-    end = rdtsc();
-    cycles = end - start;
-    return cycles;
-}
+    for (uint32_t i = 0; i < files; i++) {
+        sprintf(name, "fsbench.%d", i);
+        fs_read_file(name, buffer, &size);
+    }
+    uint32_t read = (uint32_t)(rdtsc() - start) / files;
 
-void less_view_file(const char *filename) {
-    uint32_t fsize = fs_get_file_size(filename);
-    uint8_t *buffer = malloc(fsize + 1);
-    fs_read_file(filename, buffer, &fsize);
-    buffer[fsize] = '\0';
+    start = rdtsc();
+    for (uint32_t i = 0; i < files; i++) {
+        sprintf(name, "fsbench.%d", i);
+        fs_delete_file(name);
+    }
+    fs_sync();
+    uint32_t remove = (uint32_t)(rdtsc() - start) / files;
+    printf("%d x 1 KB files: %d cycles/create, %d cycles/read, %d cycles/delete\n",
+           files, create, read, remove);
+
+    int fd = fs_open("fsbench.seq", O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0) return;
+    start = rdtsc();
+    for (uint32_t kb = 0; kb < stream_kb; kb += 4) {
+        if (fs_write(fd, buffer, sizeof(buffer)) < 0) break;
+    }
+    fs_close(fd);
+    fs_sync();
+    uint32_t write = (uint32_t)(rdtsc() - start) / stream_kb;
+
+    fd = fs_open("fsbench.seq", O_RDONLY);
+    start = rdtsc();
+    while (fs_read(fd, buffer, sizeof(buffer)) > 0) {}
+    uint32_t stream_read = (uint32_t)(rdtsc() - start) / stream_kb;
+    fs_close(fd);
+    fs_delete_file("fsbench.seq");
+    fs_sync();
+    printf("%d KB stream: %d cycles/KB write, %d cycles/KB read\n", stream_kb, write, stream_read);
+}
 
-    int lines = 0;
-    for (uint32_t i = 0; i < fsize; i++) {
-        if (buffer[i] == '\n') {
-            lines++;
+// Start of the line after the one beginning at `pos`, or `pos` when it is the last.
+uint32_t less_next_line(int fd, uint32_t pos) {
+    char chunk[SECTOR_SIZE];
+    fs_lseek(fd, pos, SEEK_SET);
+    int n;
+    while ((n = fs_read(fd, chunk, sizeof(chunk))) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (chunk[i] == '\n') return pos + i + 1;
         }
+        pos += n;
     }
-    if (fsize > 0 && buffer[fsize - 1] != '\n') {
-        lines++;
+    return pos;
+}
+
+// Start of the line before the one beginning at `pos`.
+uint32_t less_prev_line(int fd, uint32_t pos) {
+    char chunk[SECTOR_SIZE];
+    if (pos == 0) return 0;
+    uint32_t end = pos - 1;
+    while (end > 0) {
+        uint32_t start = end > sizeof(chunk) ? end - sizeof(chunk) : 0;
+        fs_lseek(fd, start, SEEK_SET);
+        fs_read(fd, chunk, end - start);
+        for (uint32_t i = end - start; i > 0; i--) {
+            if (chunk[i - 1] == '\n') return start + i;
+        }
+        end = start;
     }
-    
+    return 0;
+}
+
+// Reads only the visible part of the file, one sector-sized chunk at a time.
+void less_view_file(const char *filename) {
+    int fd = fs_open(filename, O_RDONLY);
+    if (fd < 0) return;
+
     int screen_lines = VGA_HEIGHT;
-    int start_line = 0;
+    uint32_t top = 0;
+    char chunk[SECTOR_SIZE];
     
     while (1) {
         kernel_clear_screen();
-        int current_line = 0;
         int printed_lines = 0;
-        for (uint32_t i = 0; i < fsize && printed_lines < screen_lines; i++) {
-            if (current_line >= start_line) {
-                printf("%c", buffer[i]);
-                if (buffer[i] == '\n') {
-                    printed_lines++;
+        int at_end = 1;
+        int n;
+        fs_lseek(fd, top, SEEK_SET);
+        while (printed_lines < screen_lines && (n = fs_read(fd, chunk, sizeof(chunk))) > 0) {
+            for (int i = 0; i < n; i++) {
+                printf("%c", chunk[i]);
+                if (chunk[i] == '\n' && ++printed_lines >= screen_lines) {
+                    at_end = 0;
+                    break;
                 }
             }
-            if (buffer[i] == '\n') {
-                current_line++;
-            }
         }
         
         char key = getchar();
         if (key == 'q') break;
-        if (key == 's' && start_line + screen_lines < lines) start_line++;
-        if (key == 'w' && start_line > 0) start_line--;
+        if (key == 's' && !at_end) top = less_next_line(fd, top);
+        if (key == 'w') top = less_prev_line(fd, top);
     }
     
+    fs_close(fd);
     kernel_clear_screen();
 }
 
 
 void text_editor(const char *filename) {
-    uint32_t fsize = fs_get_file_size(filename);
+    // A file that does not exist yet starts out empty and is created on save.
+    int fd = fs_open(filename, O_RDONLY);
+    uint32_t fsize = fd < 0 ? 0 : fs_lseek(fd, 0, SEEK_END);
     uint32_t buffer_size = fsize + 1024;
     char *buffer = malloc(buffer_size);
-    if (fsize > 0) {
-        fs_read_file(filename, (uint8_t *)buffer, &fsize);
-        buffer[fsize] = '\0';
-    } else {
-        buffer[0] = '\0';
+    if (fd >= 0) {
+        fs_lseek(fd, 0, SEEK_SET);
+        fsize = fs_read(fd, buffer, fsize);
+        fs_close(fd);
     }
+    buffer[fsize] = '\0';
+    // Everything before `dirty_from` matches the file on disk.
+    uint32_t dirty_from = fsize;
     
     char command[32];
     int editing = 1;
@@ -260,6 +349,7 @@ void text_editor(const char *filename) {
             }
             strcat(line, "\n");
             if (strlen(buffer) + strlen(line) < buffer_size - 1) {
+                if (strlen(buffer) < dirty_from) dirty_from = strlen(buffer);
                 strcat(buffer, line);
             } else {
                 printf("Buffer full! Cannot append more text.\n");
@@ -272,9 +362,20 @@ void text_editor(const char *filename) {
             } else {
                 buffer[0] = '\0';
             }
+            if (strlen(buffer) < dirty_from) dirty_from = strlen(buffer);
         } else if (strcmp(command, "s") == 0) {
             uint32_t new_size = strlen(buffer);
-            fs_edit_file(filename, (uint8_t *)buffer, new_size);
+            fd = fs_open(filename, O_WRONLY | O_CREAT);
+            if (fd < 0) {
+                printf("Cannot save %s\n", filename);
+                kernel_delay(1000);
+                continue;
+            }
+            fs_pwrite(fd, buffer + dirty_from, new_size - dirty_from, dirty_from);
+            fs_ftruncate(fd, new_size);
+            fs_close(fd);
+            fs_sync();
+            dirty_from = new_size;
             printf("File saved.\n");
             kernel_delay(1000);
         } else if (strcmp(command, "q") == 0) {
@@ -289,7 +390,62 @@ void text_editor(const char *filename) {
 
 
 
+uint32_t trace_sent = 0;    // bytes of the oldest queued record already sent
+
+// Sends queued trace records while the UART has room, without waiting.
+void trace_drain() {
+    while (serial_present && serial_ready()) {
+        for (int i = 0; i < SERIAL_FIFO_SIZE; i++) {
+            TraceRecord *rec = fs_trace_peek();
+            if (!rec) return;
+            outb(SERIAL_COM1 + SERIAL_REG_DATA, ((const uint8_t *)rec)[trace_sent++]);
+            if (trace_sent == sizeof(TraceRecord)) {
+                trace_sent = 0;
+                fs_trace_next();
+            }
+        }
+    }
+}
+
+void trace_start() {
+    if (fs_trace_on) {
+        printf("Already tracing\n");
+        return;
+    }
+    if (serial_init() != 0) {
+        printf("No serial port\n");
+        return;
+    }
+    TraceHeader hdr;
+    memcpy(hdr.magic, TRACE_MAGIC, 4);
+    hdr.version = TRACE_VERSION;
+    hdr.tsc_hz = (uint64_t)clock_tsc_khz * 1000;
+    serial_write(&hdr, sizeof(TraceHeader));
+    trace_sent = 0;
+    fs_trace_start();
+    printf("Tracing block requests to COM1\n");
+}
+
+void trace_stop() {
+    fs_trace_on = 0;
+    while (serial_present && fs_trace_peek()) trace_drain();
+    printf("Traced %d requests, %d dropped\n", fs_trace_head, fs_trace_dropped);
+}
+
+// Background work while the shell waits for a key.
+// Returns nonzero while defrag or the trace drain has more to do.
+int shell_idle() {
+    if (fs_defrag.active && !fs_defrag_step()) {
+        printf("\n");
+        fs_defrag_report();
+        printf(K_SHELL_SYMBOL);
+    }
+    trace_drain();
+    return fs_defrag.active || (serial_present && fs_trace_peek());
+}
+
 void shell_run() {
+    kernel_idle = shell_idle;
     printf(K_SHELL_SYMBOL);
     char *cmd = fgets_dcc(256);
     while (cmd != NULL) {
@@ -320,7 +476,18 @@ void shell_run() {
             printf("| cal - a simple calender       |\n");
             printf("| numgame - a simple game       |\n");
             printf("| pinfo - get informations      |\n");
-            printf("| ls - list files               |\n");
+            printf("| ls [dir] - list files         |\n");
+            printf("| mkdir <dir> - make a directory|\n");
+            printf("| cd <dir> - change directory   |\n");
+            printf("| pwd - print working directory |\n");
+            printf("| rastat - readahead statistics |\n");
+            printf("| sync - write pending changes  |\n");
+            printf("| diskbench - disk read speed   |\n");
+            printf("| fsbench - file system speed   |\n");
+            printf("| mount ram|disk - switch disks |\n");
+            printf("| scrub - verify all checksums  |\n");
+            printf("| defrag [status|stop] - defrag |\n");
+            printf("| trace [on|off] - serial trace |\n");
             printf("| cat <file> - print a file     |\n");
             printf("| touch <file> - create a file  |\n");
             printf("| rm <file> - removes a file    |\n");
@@ -332,7 +499,6 @@ void shell_run() {
         } else if (strcmp(cmd, "timer") == 0) {
             struct time_info prev = kernel_time();
             int running = 1;
-            uint64_t cps = get_cpu_speed();
             int minutes = 0;
             int seconds = 0;
             printf("Timer. Press 'q' to exit.\n");
@@ -359,7 +525,7 @@ void shell_run() {
                     running = 0;
                 }
     
-                kernel_delay(cps / 1000);
+                kernel_udelay(1000);
             }
         } else if (strcmp(cmd, "cal") == 0) {
             struct Day d = kernel_localtime(kernel_time().seconds);
@@ -378,7 +544,48 @@ void shell_run() {
                 set_keyboard_layout(0); // EN
             }
         } else if (strcmp(cmd, "ls") == 0) {
-            fs_list_files();
+            fs_list_files(".");
+        } else if (strncmp(cmd, "ls ", 3) == 0) {
+            fs_list_files(cmd + 3);
+        } else if (strncmp(cmd, "mkdir ", 6) == 0) {
+            fs_mkdir(cmd + 6);
+        } else if (strncmp(cmd, "cd ", 3) == 0) {
+            fs_chdir(cmd + 3);
+        } else if (strcmp(cmd, "rastat") == 0) {
+            fs_ra_report();
+        } else if (strcmp(cmd, "sync") == 0) {
+            fs_sync();
+        } else if (strcmp(cmd, "scrub") == 0) {
+            fs_scrub();
+        } else if (strcmp(cmd, "defrag") == 0) {
+            fs_frag_report();
+            if (fs_defrag_start() == 0) printf("Defragmenting in the background\n");
+        } else if (strcmp(cmd, "defrag status") == 0) {
+            fs_defrag_report();
+        } else if (strcmp(cmd, "defrag stop") == 0) {
+            fs_defrag_stop();
+            fs_defrag_report();
+        } else if (strcmp(cmd, "trace on") == 0) {
+            trace_start();
+        } else if (strcmp(cmd, "trace off") == 0) {
+            trace_stop();
+        } else if (strcmp(cmd, "trace") == 0) {
+            printf("Trace %s: %d requests, %d queued, %d dropped\n", fs_trace_on ? "on" : "off",
+                   fs_trace_head, fs_trace_head - fs_trace_tail, fs_trace_dropped);
+        } else if (strcmp(cmd, "diskbench") == 0) {
+            if (ata_present()) disk_bench(&ata_device);
+            if (virtio_blk_ready()) disk_bench(&virtio_blk_device);
+            if (ahci_ready()) disk_bench(&ahci_device);
+            if (stripe_ready()) disk_bench(&stripe_device);
+            disk_bench(&ramdisk_device);
+        } else if (strcmp(cmd, "fsbench") == 0) {
+            fs_bench();
+        } else if (strcmp(cmd, "mount ram") == 0) {
+            fs_mount(&ramdisk_device);
+        } else if (strcmp(cmd, "mount disk") == 0) {
+            fs_mount(disk_boot_dev);
+        } else if (strcmp(cmd, "pwd") == 0) {
+            printf("%s\n", fs_cwd_path);
         } else if (strncmp(cmd, "cat ", 4) == 0) {
             char *filename = cmd + 4;
             less_view_file(filename);
@@ -398,42 +605,68 @@ void shell_run() {
     }
 }
 
-struct multiboot_info {
-    uint32_t flags;
-    uint32_t mem_lower;
-    uint32_t mem_upper;
-    uint32_t framebuffer_addr;
-    uint32_t framebuffer_pitch;
-    uint32_t framebuffer_width;
-    uint32_t framebuffer_height;
-    uint8_t framebuffer_bpp;
-};
-
 volatile uint32_t* vga_buffer;
 int VGA_WIDTH;
 int VGA_HEIGHT;
 int VGA_PITCH;
 
+// Mounts the first boot module that is an initramfs at /initrd.
+void initrd_mount() {
+    for (uint32_t i = 0; i < boot_info.num_modules; i++) {
+        MultibootModule *mod = &boot_info.modules[i];
+        uint32_t size = mod->mod_end - mod->mod_start;
+        int entries = initrd_load((const uint8_t *)mod->mod_start, size);
+        if (entries >= 0) {
+            printf("initrd: %d entries, %d KB\n", entries, size >> 10);
+            return;
+        }
+    }
+}
+
+// "key=value" lines in /initrd/etc/zos.conf override config.h, so the
+// settings can change without rebuilding the kernel.
+void config_load() {
+    static char text[1024];
+    const char *path = FS_INITRD_MOUNT "/etc/zos.conf";
+    uint32_t size = fs_get_file_size(path);
+    if (size == 0 || size >= sizeof(text) || fs_read_file(path, (uint8_t *)text, &size) != 0) return;
+    text[size] = '\0';
+
+    for (char *line = text; *line;) {
+        char *end = line;
+        while (*end && *end != '\n') end++;
+        if (strncmp(line, "timezone=", 9) == 0) zconfig.timezone = atoi(line + 9);
+        else if (strncmp(line, "klayout=", 8) == 0) zconfig.klayout = atoi(line + 8);
+        line = *end ? end + 1 : end;
+    }
+}
+
 void kernel_main(unsigned int magic, unsigned int* mboot_info) {
-    (void) magic;
-    struct multiboot_info *mb = (struct multiboot_info *)mboot_info;
-    if (mb->flags & (1 << 12)) {
-        vga_buffer = (volatile uint32_t*)mb->framebuffer_addr;
-        VGA_WIDTH = mb->framebuffer_width;
-        VGA_HEIGHT = mb->framebuffer_height;
-        VGA_PITCH = mb->framebuffer_pitch;
+    int multiboot = multiboot_parse(magic, (const MultibootInfo *)mboot_info);
+    if (boot_info.framebuffer) {
+        vga_buffer = (volatile uint32_t*)boot_info.framebuffer;
+        VGA_WIDTH = boot_info.framebuffer_width;
+        VGA_HEIGHT = boot_info.framebuffer_height;
+        VGA_PITCH = boot_info.framebuffer_pitch;
     } else {
-        kernel_panic("No framebuffer info!");
+        kernel_panic(multiboot == 0 ? "No framebuffer info!" : "Not started by a multiboot loader!");
     }
 
     kernel_clear_screen();
+    initrd_mount();
+    config_load();
     kernel_timezone(zconfig.timezone);
     printf("ZOS %.1f\n", K_VERSION);
+    multiboot_report();
     init_idt();
     init_pic();
+    asm volatile("sti");                    // all IRQ lines stay masked until registered
+    clock_init();
     printf("%s\n", time_now());
     set_keyboard_layout(zconfig.klayout);
-    state.disk = fs_init();
+    keyboard_init();
+    disk_init();
+    state.disk = fs_mount(disk_dev);
     shell_run();
     kernel_clear_screen();
     printf("Infinite Loading\nIf you wanna shutdown click 'q'\n");
@@ -442,7 +675,7 @@ void kernel_main(unsigned int magic, unsigned int* mboot_info) {
             break;
         }
         kernel_display_spinner(10, VGA_WIDTH/2-1, i);
-        kernel_delay(get_cpu_speed() * 2);
+        kernel_udelay(100000);
     }
 
     kernel_shutdown();
@@ -0,0 +1,352 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "pci.h"
+
+// AHCI SATA controller (QEMU -machine q35, most real chipsets). The
+// first port with a SATA disk is driven with native command queuing
+// when the drive supports it, so up to 32 commands can be outstanding.
+#define AHCI_CAP                0x00
+#define AHCI_GHC                0x04
+#define AHCI_IS                 0x08
+#define AHCI_PI                 0x0C
+#define AHCI_CAP_NCS(cap)       ((((cap) >> 8) & 0x1F) + 1)
+#define AHCI_CAP_SNCQ           (1u << 30)
+#define AHCI_GHC_IE             (1u << 1)
+#define AHCI_GHC_AE             (1u << 31)
+
+#define AHCI_PORT_BASE          0x100
+#define AHCI_PORT_SIZE          0x80
+#define AHCI_PxCLB              0x00
+#define AHCI_PxCLBU             0x04
+#define AHCI_PxFB               0x08
+#define AHCI_PxFBU              0x0C
+#define AHCI_PxIS               0x10
+#define AHCI_PxIE               0x14
+#define AHCI_PxCMD              0x18
+#define AHCI_PxTFD              0x20
+#define AHCI_PxSIG              0x24
+#define AHCI_PxSSTS             0x28
+#define AHCI_PxSERR             0x30
+#define AHCI_PxSACT             0x34
+#define AHCI_PxCI               0x38
+
+#define AHCI_PxCMD_ST           (1u << 0)
+#define AHCI_PxCMD_FRE          (1u << 4)
+#define AHCI_PxCMD_FR           (1u << 14)
+#define AHCI_PxCMD_CR           (1u << 15)
+#define AHCI_PxIS_DHRS          (1u << 0)   // D2H register FIS: a DMA command finished
+#define AHCI_PxIS_PSS           (1u << 1)   // PIO setup FIS: IDENTIFY
+#define AHCI_PxIS_SDBS          (1u << 3)   // set device bits FIS: queued commands finished
+#define AHCI_PxIS_TFES          (1u << 30)
+#define AHCI_SIG_SATA           0x00000101
+
+#define FIS_TYPE_REG_H2D        0x27
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+#define ATA_CMD_FLUSH_EXT       0xEA
+#define ATA_CMD_IDENTIFY        0xEC
+
+#define AHCI_MAX_SLOTS          32
+#define AHCI_MAX_SECTORS        128     // per command
+#define AHCI_MAX_PRDS           (AHCI_MAX_SECTORS * 512 / 4096 + 1)
+#define AHCI_TIMEOUT            10000000    // polls
+#define AHCI_TIMEOUT_SLEEPS     1000        // 10 ms wakeups
+
+typedef struct {
+    uint16_t flags;         // FIS length in dwords, bit 6: write
+    uint16_t prdtl;
+    volatile uint32_t prdbc;
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} AhciCmdHeader;
+
+typedef struct {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;           // byte count - 1
+} AhciPrd;
+
+typedef struct {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    AhciPrd prdt[AHCI_MAX_PRDS];
+} __attribute__((aligned(128))) AhciCmdTable;
+
+AhciCmdHeader ahci_cmd_list[AHCI_MAX_SLOTS] __attribute__((aligned(1024)));
+uint8_t ahci_fis[256] __attribute__((aligned(256)));
+AhciCmdTable ahci_cmd_tables[AHCI_MAX_SLOTS];
+uint8_t ahci_bounce[AHCI_MAX_SECTORS * 512] __attribute__((aligned(4096)));
+volatile uint8_t *ahci_abar = NULL;
+volatile uint8_t *ahci_port = NULL;
+uint32_t ahci_port_bit = 0;
+uint8_t ahci_irq = PCI_NO_IRQ;
+static volatile int ahci_tfe = 0;  // task file error seen by the handler
+uint32_t ahci_slots = 0;
+uint32_t ahci_busy = 0;     // slots issued and not reaped yet
+int ahci_ncq = 0;
+uint64_t ahci_capacity = 0;
+uint32_t ahci_errors = 0;
+
+static inline volatile uint32_t *ahci_reg(uint32_t reg) {
+    return (volatile uint32_t *)(ahci_port + reg);
+}
+
+int ahci_ready() {
+    return ahci_port != NULL;
+}
+
+static int ahci_wait_clear(uint32_t reg, uint32_t bits) {
+    int timeout = AHCI_TIMEOUT;
+    while ((*ahci_reg(reg) & bits) && --timeout);
+    return timeout ? 0 : -1;
+}
+
+static void ahci_port_stop() {
+    *ahci_reg(AHCI_PxCMD) &= ~AHCI_PxCMD_ST;
+    ahci_wait_clear(AHCI_PxCMD, AHCI_PxCMD_CR);
+    *ahci_reg(AHCI_PxCMD) &= ~AHCI_PxCMD_FRE;
+    ahci_wait_clear(AHCI_PxCMD, AHCI_PxCMD_FR);
+}
+
+static void ahci_port_start() {
+    ahci_wait_clear(AHCI_PxTFD, 0x88);
+    *ahci_reg(AHCI_PxSERR) = 0xFFFFFFFF;
+    *ahci_reg(AHCI_PxIS) = 0xFFFFFFFF;
+    *ahci_reg(AHCI_PxCMD) |= AHCI_PxCMD_FRE;
+    *ahci_reg(AHCI_PxCMD) |= AHCI_PxCMD_ST;
+}
+
+static int ahci_free_slot() {
+    for (uint32_t slot = 0; slot < ahci_slots; slot++) {
+        if (!(ahci_busy & (1u << slot))) return slot;
+    }
+    return -1;
+}
+
+// Reaps finished commands. A task file error aborts everything
+// outstanding, so the port is restarted and those commands count as
+// failed.
+static void ahci_reap() {
+    if (ahci_tfe || (*ahci_reg(AHCI_PxIS) & AHCI_PxIS_TFES)) {
+        ahci_tfe = 0;
+        ahci_errors++;
+        ahci_port_stop();
+        ahci_busy = 0;
+        ahci_port_start();
+        return;
+    }
+    uint32_t pending = *ahci_reg(AHCI_PxCI) | *ahci_reg(AHCI_PxSACT);
+    ahci_busy &= pending;
+    __sync_synchronize();
+}
+
+// Acks the port and the HBA so the line drops. A task file error is
+// handed to ahci_reap, which restarts the port.
+static void ahci_irq_handler(InterruptFrame *frame) {
+    (void)frame;
+    uint32_t status = *ahci_reg(AHCI_PxIS);
+    if (status & AHCI_PxIS_TFES) ahci_tfe = 1;
+    *ahci_reg(AHCI_PxIS) = status;
+    *(volatile uint32_t *)(ahci_abar + AHCI_IS) = ahci_port_bit;
+}
+
+static int ahci_completed() {
+    return ahci_tfe || (ahci_busy & ~(*ahci_reg(AHCI_PxCI) | *ahci_reg(AHCI_PxSACT)));
+}
+
+// Waits for the slots in `mask`, halting between completions once the
+// port interrupt is set up.
+static int ahci_wait(uint32_t mask) {
+    uint32_t polls = 0, sleeps = 0;
+    ahci_reap();
+    while (ahci_busy & mask) {
+        if (ahci_irq != PCI_NO_IRQ && irq_wait(ahci_completed) == 0) {
+            sleeps++;
+        } else {
+            polls++;
+        }
+        if (polls == AHCI_TIMEOUT || sleeps == AHCI_TIMEOUT_SLEEPS) {
+            printf("ahci: command timed out\n");
+            return -1;
+        }
+        ahci_reap();
+    }
+    return 0;
+}
+
+// Builds and issues one command. Queued reads and writes carry the
+// sector count in the features field and the tag in the count field.
+static int ahci_issue(uint8_t cmd, uint32_t lba, uint8_t *buffer, uint32_t count, int write) {
+    int slot;
+    while ((slot = ahci_free_slot()) < 0) {
+        if (ahci_wait(ahci_busy) != 0) return -1;
+    }
+
+    AhciCmdTable *table = &ahci_cmd_tables[slot];
+    memset(table->cfis, 0, sizeof(table->cfis));
+    uint8_t *fis = table->cfis;
+    int queued = cmd == ATA_CMD_READ_FPDMA || cmd == ATA_CMD_WRITE_FPDMA;
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = 0x80;
+    fis[2] = cmd;
+    fis[4] = lba & 0xFF;
+    fis[5] = (lba >> 8) & 0xFF;
+    fis[6] = (lba >> 16) & 0xFF;
+    fis[7] = 0x40;
+    fis[8] = (lba >> 24) & 0xFF;
+    if (queued) {
+        fis[3] = count & 0xFF;
+        fis[11] = (count >> 8) & 0xFF;
+        fis[12] = slot << 3;
+    } else {
+        fis[12] = count & 0xFF;
+        fis[13] = (count >> 8) & 0xFF;
+    }
+
+    uint32_t prds = 0;
+    uint32_t addr = (uint32_t)buffer;
+    uint32_t end = addr + count * 512;
+    while (addr < end) {
+        uint32_t page_end = (addr & ~0xFFFu) + 0x1000;
+        uint32_t len = (page_end < end ? page_end : end) - addr;
+        table->prdt[prds].dba = addr;
+        table->prdt[prds].dbau = 0;
+        table->prdt[prds].reserved = 0;
+        table->prdt[prds].dbc = len - 1;
+        prds++;
+        addr += len;
+    }
+
+    AhciCmdHeader *header = &ahci_cmd_list[slot];
+    header->flags = 5 | (write ? (1 << 6) : 0);
+    header->prdtl = prds;
+    header->prdbc = 0;
+
+    __sync_synchronize();
+    ahci_busy |= 1u << slot;
+    if (queued) *ahci_reg(AHCI_PxSACT) = 1u << slot;
+    *ahci_reg(AHCI_PxCI) = 1u << slot;
+    return 0;
+}
+
+// Splits a transfer into commands that are all outstanding at once.
+// The HBA needs word-aligned buffers, so odd ones go through a bounce
+// buffer one command at a time.
+static int ahci_rw(int write, uint32_t lba, uint32_t count, uint8_t *buffer) {
+    uint8_t cmd = ahci_ncq ? (write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA)
+                           : (write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    int bounce = (uint32_t)buffer & 1;
+    uint32_t errors = ahci_errors;
+
+    while (count > 0) {
+        uint32_t n = count < AHCI_MAX_SECTORS ? count : AHCI_MAX_SECTORS;
+        if (bounce) {
+            if (write) memcpy(ahci_bounce, buffer, n * 512);
+            if (ahci_issue(cmd, lba, ahci_bounce, n, write) != 0 || ahci_wait(0xFFFFFFFF) != 0) return -1;
+            if (!write) memcpy(buffer, ahci_bounce, n * 512);
+        } else if (ahci_issue(cmd, lba, buffer, n, write) != 0) {
+            return -1;
+        }
+        lba += n;
+        buffer += n * 512;
+        count -= n;
+    }
+    if (ahci_wait(0xFFFFFFFF) != 0) return -1;
+    return ahci_errors == errors ? 0 : -1;
+}
+
+void ahci_read(uint32_t lba, uint32_t count, uint8_t *buffer) {
+    if (ahci_rw(0, lba, count, buffer) != 0) {
+        printf("ahci: read error at sector %d\n", lba);
+    }
+}
+
+void ahci_write(uint32_t lba, uint32_t count, const uint8_t *buffer) {
+    if (ahci_rw(1, lba, count, (uint8_t *)buffer) != 0) {
+        printf("ahci: write error at sector %d\n", lba);
+    }
+}
+
+// FLUSH CACHE EXT is not queued, so the queue drains first.
+void ahci_flush() {
+    uint32_t errors = ahci_errors;
+    if (ahci_wait(0xFFFFFFFF) == 0 && ahci_issue(ATA_CMD_FLUSH_EXT, 0, NULL, 0, 0) == 0 &&
+        ahci_wait(0xFFFFFFFF) == 0 && ahci_errors == errors) {
+        return;
+    }
+    printf("ahci: flush failed\n");
+}
+
+// Returns 0 when a SATA disk was found and set up.
+int ahci_init() {
+    PciDevice pci;
+    if (pci_find_class(0x01, 0x06, 0x01, &pci) != 0) return -1;
+    pci_enable(&pci);
+    volatile uint8_t *abar = (volatile uint8_t *)(pci_read32(&pci, PCI_BAR5) & ~0xFu);
+
+    *(volatile uint32_t *)(abar + AHCI_GHC) |= AHCI_GHC_AE;
+    uint32_t cap = *(volatile uint32_t *)(abar + AHCI_CAP);
+    uint32_t implemented = *(volatile uint32_t *)(abar + AHCI_PI);
+
+    for (uint32_t p = 0; p < 32 && ahci_port == NULL; p++) {
+        if (!(implemented & (1u << p))) continue;
+        volatile uint8_t *port = abar + AHCI_PORT_BASE + p * AHCI_PORT_SIZE;
+        uint32_t ssts = *(volatile uint32_t *)(port + AHCI_PxSSTS);
+        uint32_t sig = *(volatile uint32_t *)(port + AHCI_PxSIG);
+        if ((ssts & 0x0F) != 3 || sig != AHCI_SIG_SATA) continue;
+        ahci_port = port;
+        ahci_port_bit = 1u << p;
+        printf("AHCI: SATA disk on port %d\n", p);
+    }
+    if (ahci_port == NULL) return -1;
+    ahci_abar = abar;
+
+    ahci_port_stop();
+    memset(ahci_cmd_list, 0, sizeof(ahci_cmd_list));
+    memset(ahci_fis, 0, sizeof(ahci_fis));
+    memset(ahci_cmd_tables, 0, sizeof(ahci_cmd_tables));
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        ahci_cmd_list[slot].ctba = (uint32_t)&ahci_cmd_tables[slot];
+    }
+    *ahci_reg(AHCI_PxCLB) = (uint32_t)ahci_cmd_list;
+    *ahci_reg(AHCI_PxCLBU) = 0;
+    *ahci_reg(AHCI_PxFB) = (uint32_t)ahci_fis;
+    *ahci_reg(AHCI_PxFBU) = 0;
+    *ahci_reg(AHCI_PxIE) = 0;
+    ahci_port_start();
+    ahci_slots = AHCI_CAP_NCS(cap);
+
+    // IDENTIFY: word 76 bit 8 is NCQ support, words 100-103 the LBA48 size.
+    uint16_t *id = (uint16_t *)ahci_bounce;
+    if (ahci_issue(ATA_CMD_IDENTIFY, 0, ahci_bounce, 1, 0) != 0 || ahci_wait(0xFFFFFFFF) != 0 ||
+        ahci_errors != 0) {
+        ahci_port = NULL;
+        return -1;
+    }
+    ahci_ncq = (cap & AHCI_CAP_SNCQ) && (id[76] & (1 << 8));
+    ahci_capacity = id[100] | ((uint32_t)id[101] << 16) | ((uint64_t)id[102] << 32);
+    if (ahci_ncq) {
+        // The drive reports its queue depth - 1 in word 75.
+        uint32_t depth = (id[75] & 0x1F) + 1;
+        if (depth < ahci_slots) ahci_slots = depth;
+    }
+
+    // Completions interrupt from here on; IDENTIFY above was polled.
+    ahci_irq = pci_irq_line(&pci);
+    if (ahci_irq != PCI_NO_IRQ) {
+        *ahci_reg(AHCI_PxIS) = 0xFFFFFFFF;
+        *(volatile uint32_t *)(abar + AHCI_IS) = ahci_port_bit;
+        *ahci_reg(AHCI_PxIE) = AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_SDBS | AHCI_PxIS_TFES;
+        irq_register(ahci_irq, ahci_irq_handler);
+        *(volatile uint32_t *)(abar + AHCI_GHC) |= AHCI_GHC_IE;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef BLKTRACE_H
+#define BLKTRACE_H
+
+// Block I/O trace format, shared by the kernel (fs.h records it) and
+// disk_util (replays it). A trace is a TraceHeader followed by
+// TraceRecords, little endian, as they reach the block device. No
+// includes; the includer provides the stdint types.
+
+#define TRACE_MAGIC             "ZTRC"
+#define TRACE_VERSION           1
+
+#define TRACE_READ              0
+#define TRACE_WRITE             1
+#define TRACE_FLUSH             2
+#define TRACE_LOST              3       // `lba` records were dropped before this one
+
+// The file system call that issued a request.
+#define TRACE_CALL_OTHER        0
+#define TRACE_CALL_MOUNT        1
+#define TRACE_CALL_LOOKUP       2
+#define TRACE_CALL_OPEN         3
+#define TRACE_CALL_READ         4
+#define TRACE_CALL_WRITE        5
+#define TRACE_CALL_CREATE       6
+#define TRACE_CALL_DELETE       7
+#define TRACE_CALL_JOURNAL      8       // commit and checkpoint
+#define TRACE_CALL_SCRUB        9
+#define TRACE_CALL_DEFRAG       10
+#define TRACE_CALLS             11
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t tsc_hz;        // 0 when the clock was not calibrated
+} TraceHeader;
+
+typedef struct {
+    uint64_t tsc;
+    uint32_t lba;
+    uint32_t count;
+    uint32_t seq;           // number of the fs call, so requests group by call
+    uint8_t op;             // TRACE_READ ...
+    uint8_t call;           // TRACE_CALL_*
+    uint8_t reserved[2];
+} TraceRecord;
+
+static inline const char *trace_call_name(uint8_t call) {
+    static const char *names[TRACE_CALLS] = {
+        "other", "mount", "lookup", "open", "read", "write", "create", "delete", "journal", "scrub", "defrag",
+    };
+    return call < TRACE_CALLS ? names[call] : "?";
+}
+
+#endif
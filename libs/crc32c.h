@@ -0,0 +1,65 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when CPUID
+// reports it and slicing-by-8 tables otherwise. No includes so disk_util
+// can share it with the kernel; call crc32c_init once before use.
+
+#define CRC32C_POLY         0x82F63B78
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw = 0;
+
+void crc32c_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t c = crc32c_table[k - 1][n];
+            crc32c_table[k][n] = (c >> 8) ^ crc32c_table[0][c & 0xFF];
+        }
+    }
+
+    uint32_t a, b, c, d;
+    asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+    crc32c_hw = (c >> 20) & 1;
+}
+
+static inline uint32_t crc32c_load32(const uint8_t *p) {
+    uint32_t v;
+    __builtin_memcpy(&v, p, 4);
+    return v;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, uint32_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+
+    if (crc32c_hw) {
+        for (; len >= 4; p += 4, len -= 4) {
+            asm("crc32l %1, %0" : "+r"(crc) : "rm"(crc32c_load32(p)));
+        }
+        for (; len > 0; p++, len--) {
+            asm("crc32b %1, %0" : "+r"(crc) : "rm"(*p));
+        }
+        return ~crc;
+    }
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo = crc32c_load32(p) ^ crc;
+        uint32_t hi = crc32c_load32(p + 4);
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; len > 0; p++, len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xFF];
+    }
+    return ~crc;
+}
+
+#endif
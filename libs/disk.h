@@ -2,389 +2,420 @@
 #define DISK_H
 
 #include "../msstd.h"
+#include "fs.h"
+#include "virtio.h"
+#include "ahci.h"
 
-#define ATA_PRIMARY_DATA        0x1F0
-#define ATA_PRIMARY_ERR         0x1F1
-#define ATA_PRIMARY_SECCOUNT    0x1F2
-#define ATA_PRIMARY_SECNUM      0x1F3
-#define ATA_PRIMARY_CYLLOW      0x1F4
-#define ATA_PRIMARY_CYLHIGH     0x1F5
-#define ATA_PRIMARY_DRIVE       0x1F6
-#define ATA_PRIMARY_CMD         0x1F7
-#define ATA_PRIMARY_STATUS      0x1F7
+#define ATA_PRIMARY_IO          0x1F0
+#define ATA_SECONDARY_IO        0x170
+#define ATA_MAX_DRIVES          4
+
+// Register offsets from the command block base.
+#define ATA_REG_DATA            0
+#define ATA_REG_ERR             1
+#define ATA_REG_SECCOUNT        2
+#define ATA_REG_SECNUM          3
+#define ATA_REG_CYLLOW          4
+#define ATA_REG_CYLHIGH         5
+#define ATA_REG_DRIVE           6
+#define ATA_REG_CMD             7
+#define ATA_REG_STATUS          7
 
 #define ATA_CMD_READ_SECTORS    0x20
+#define ATA_CMD_READ_SECTORS_EXT 0x24
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
 #define ATA_CMD_WRITE_SECTORS   0x30
+#define ATA_CMD_WRITE_SECTORS_EXT 0x34
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE   0xC4
+#define ATA_CMD_WRITE_MULTIPLE  0xC5
+#define ATA_CMD_SET_MULTIPLE    0xC6
+#define ATA_CMD_FLUSH_CACHE     0xE7
 
-#define SECTOR_SIZE             512
-#define MAX_FILES               64
-#define MAX_FILENAME            64
-#define FIRST_DATA_SECTOR       10
+#define STRIPE_MAGIC            "ZSTR"
+#define STRIPE_MAX_MEMBERS      ATA_MAX_DRIVES
+#define STRIPE_DATA_SECTOR      1       // member sector 0 holds the label
 
-#define DISK_ERROR -1
-#define DISK_NOT_FOUND 0 
+#define RAMDISK_SECTORS         (16 * 1024 * 2)
 
-static inline void outb(uint16_t port, uint8_t value) {
-    asm volatile("outb %0, %1" : : "a"(value), "Nd"(port));
-}
+// One drive on one of the two legacy IDE channels.
+typedef struct {
+    uint16_t io;            // command block base
+    uint8_t slave;
+    uint8_t present;
+    uint8_t lba48;
+    uint32_t multiple;      // sectors per DRQ block, 0 = one
+    int udma;               // highest UDMA mode supported, -1 = none
+    int mwdma;              // highest multiword DMA mode supported, -1 = none
+    uint64_t capacity;
+} AtaDrive;
 
-static inline uint8_t __inb(uint16_t port) {
-    uint8_t value;
-    asm volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
-    return value;
-}
+AtaDrive ata_drives[ATA_MAX_DRIVES] = {
+    {.io = ATA_PRIMARY_IO, .slave = 0}, {.io = ATA_PRIMARY_IO, .slave = 1},
+    {.io = ATA_SECONDARY_IO, .slave = 0}, {.io = ATA_SECONDARY_IO, .slave = 1},
+};
 
-static inline uint16_t inw(uint16_t port) {
-    uint16_t value;
-    asm volatile("inw %1, %0" : "=a"(value) : "Nd"(port));
-    return value;
+static inline uint8_t ata_status(const AtaDrive *drive) {
+    return inb(drive->io + ATA_REG_STATUS);
 }
 
-static inline void outw(uint16_t port, uint16_t value) {
-    asm volatile("outw %0, %1" : : "a"(value), "Nd"(port));
+void ata_wait_ready(const AtaDrive *drive) {
+    int timeout = 100000;
+    while ((ata_status(drive) & 0x80) != 0 && --timeout);
+    timeout = 100000;
+    while ((ata_status(drive) & 0x40) == 0 && --timeout);
 }
 
-typedef struct {
-    char filename[MAX_FILENAME];
-    uint32_t size;
-    uint32_t first_sector;
-    uint32_t num_sectors;
-    uint8_t in_use;
-} FileEntry;
-
-typedef struct {
-    char magic[4];
-    uint32_t num_files;
-    FileEntry files[MAX_FILES];
-} FileTable;
-
-void ata_wait_ready() {
+static int ata_wait_drq(const AtaDrive *drive) {
     int timeout = 100000;
-    while ((inb(ATA_PRIMARY_STATUS) & 0x80) != 0 && --timeout);
+    uint8_t status;
+    while (((status = ata_status(drive)) & 0x80) != 0 && --timeout);
     timeout = 100000;
-    while ((inb(ATA_PRIMARY_STATUS) & 0x40) == 0 && --timeout);
+    while (!(status & 0x09) && --timeout) status = ata_status(drive);
+    return (status & 0x01) ? -1 : 0;
 }
 
-void disk_read_sector(uint32_t lba, uint8_t *buffer) {
-    ata_wait_ready();
-    
-    outb(ATA_PRIMARY_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_PRIMARY_ERR, 0x00);
-    outb(ATA_PRIMARY_SECCOUNT, 1);
-    outb(ATA_PRIMARY_SECNUM, lba & 0xFF);
-    outb(ATA_PRIMARY_CYLLOW, (lba >> 8) & 0xFF);
-    outb(ATA_PRIMARY_CYLHIGH, (lba >> 16) & 0xFF);
-    outb(ATA_PRIMARY_CMD, ATA_CMD_READ_SECTORS);
-    
-    ata_wait_ready();
-    
-    for (int i = 0; i < 256; i++) {
-        uint16_t data = inw(ATA_PRIMARY_DATA);
-        buffer[i*2] = data & 0xFF;
-        buffer[i*2+1] = (data >> 8) & 0xFF;
-    }
+// Status is only valid 400ns after selecting a drive or issuing a command.
+static void ata_delay(const AtaDrive *drive) {
+    for (int i = 0; i < 4; i++) ata_status(drive);
 }
 
-void disk_write_sector(uint32_t lba, const uint8_t *buffer) {
-    ata_wait_ready();
-    
-    outb(ATA_PRIMARY_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_PRIMARY_ERR, 0x00);
-    outb(ATA_PRIMARY_SECCOUNT, 1);
-    outb(ATA_PRIMARY_SECNUM, lba & 0xFF);
-    outb(ATA_PRIMARY_CYLLOW, (lba >> 8) & 0xFF);
-    outb(ATA_PRIMARY_CYLHIGH, (lba >> 16) & 0xFF);
-    outb(ATA_PRIMARY_CMD, ATA_CMD_WRITE_SECTORS);
-    
-    ata_wait_ready();
-    
-    for (int i = 0; i < 256; i++) {
-        outw(ATA_PRIMARY_DATA, buffer[i*2] | (buffer[i*2+1] << 8));
+// LBA48 writes the high-order bytes of each register first.
+static void ata_command(const AtaDrive *drive, uint8_t cmd, uint32_t lba, uint32_t count) {
+    uint16_t io = drive->io;
+    ata_wait_ready(drive);
+    
+    if (drive->lba48) {
+        outb(io + ATA_REG_DRIVE, 0x40 | (drive->slave << 4));
+        ata_delay(drive);
+        ata_wait_ready(drive);
+        outb(io + ATA_REG_SECCOUNT, (count >> 8) & 0xFF);
+        outb(io + ATA_REG_SECNUM, (lba >> 24) & 0xFF);
+        outb(io + ATA_REG_CYLLOW, 0);
+        outb(io + ATA_REG_CYLHIGH, 0);
+    } else {
+        outb(io + ATA_REG_DRIVE, 0xE0 | (drive->slave << 4) | ((lba >> 24) & 0x0F));
+        ata_delay(drive);
+        ata_wait_ready(drive);
     }
+    outb(io + ATA_REG_ERR, 0x00);
+    outb(io + ATA_REG_SECCOUNT, count & 0xFF);
+    outb(io + ATA_REG_SECNUM, lba & 0xFF);
+    outb(io + ATA_REG_CYLLOW, (lba >> 8) & 0xFF);
+    outb(io + ATA_REG_CYLHIGH, (lba >> 16) & 0xFF);
+    outb(io + ATA_REG_CMD, cmd);
+    ata_delay(drive);
 }
 
+// Returns 0 when a disk answered; ATAPI devices abort the command.
+int ata_identify(AtaDrive *drive) {
+    uint16_t id[256];
+    uint16_t io = drive->io;
 
-int fs_init() {
-    FileTable ft;
-    uint8_t buffer[SECTOR_SIZE];
-
-    disk_read_sector(1, buffer);
-    memcpy(&ft, buffer, sizeof(FileTable));
+    drive->udma = -1;
+    drive->mwdma = -1;
+    if (ata_status(drive) == 0xFF) return -1;
+    outb(io + ATA_REG_DRIVE, 0xA0 | (drive->slave << 4));
+    ata_delay(drive);
+    outb(io + ATA_REG_SECCOUNT, 0);
+    outb(io + ATA_REG_SECNUM, 0);
+    outb(io + ATA_REG_CYLLOW, 0);
+    outb(io + ATA_REG_CYLHIGH, 0);
+    outb(io + ATA_REG_CMD, ATA_CMD_IDENTIFY);
+    ata_delay(drive);
+    if (ata_status(drive) == 0 || ata_wait_drq(drive) != 0) return -1;
+    for (int i = 0; i < 256; i++) {
+        id[i] = inw(io + ATA_REG_DATA);
+    }
 
-    if (ft.num_files > MAX_FILES) {  
-        memset(&ft, 0, sizeof(FileTable));
-        ft.num_files = 0;
-        memcpy(buffer, &ft, sizeof(FileTable));
-        disk_write_sector(1, buffer);
-        return 1;
+    drive->lba48 = (id[83] & (1 << 10)) != 0;
+    if (drive->lba48) {
+        drive->capacity = id[100] | ((uint32_t)id[101] << 16) | ((uint64_t)id[102] << 32);
     } else {
-        return 0;
+        drive->capacity = id[60] | ((uint32_t)id[61] << 16);
     }
-}
-void fs_list_files() {
-    FileTable ft;
-    uint8_t buffer[SECTOR_SIZE];
-    
-    disk_read_sector(1, buffer);
-    memcpy(&ft, buffer, sizeof(FileTable));
-    
-    if (strncmp(ft.magic, K_MAGIC, 4) != 0) {
-        printf("Filesystem not initialized!\n");
-        return;
+    for (int mode = 2; mode >= 0 && drive->mwdma < 0; mode--) {
+        if (id[63] & (1 << mode)) drive->mwdma = mode;
     }
-    
-    printf("Files on disk: %d\n", ft.num_files);
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use) {
-            if (ft.files[i].filename[0] == '\0') break;
-            printf("%s - %d bytes\n", ft.files[i].filename, ft.files[i].size);
-        }
+    for (int mode = 6; mode >= 0 && drive->udma < 0 && (id[53] & (1 << 2)); mode--) {
+        if (id[88] & (1 << mode)) drive->udma = mode;
     }
-}
 
-uint32_t fs_find_free_sector() {
-    FileTable ft;
-    uint8_t buffer[SECTOR_SIZE];
-    uint32_t highest_sector = FIRST_DATA_SECTOR;
-    
-    disk_read_sector(1, buffer);
-    memcpy(&ft, buffer, sizeof(FileTable));
-    
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use) {
-            uint32_t last_sector = ft.files[i].first_sector + ft.files[i].num_sectors;
-            if (last_sector > highest_sector) {
-                highest_sector = last_sector;
-            }
-        }
+    // READ/WRITE MULTIPLE move a whole block per DRQ wait.
+    uint32_t multiple = id[47] & 0xFF;
+    if (multiple > 1) {
+        ata_wait_ready(drive);
+        outb(io + ATA_REG_SECCOUNT, multiple);
+        outb(io + ATA_REG_CMD, ATA_CMD_SET_MULTIPLE);
+        ata_delay(drive);
+        ata_wait_ready(drive);
+        if (!(ata_status(drive) & 0x01)) drive->multiple = multiple;
     }
-    
-    return highest_sector;
+    drive->present = 1;
+    return 0;
 }
 
-int fs_create_file(const char *filename, const uint8_t *data, uint32_t size) {
-    FileTable ft;
-    uint8_t buffer[SECTOR_SIZE];
-    
-    if (strlen(filename) >= MAX_FILENAME) {
-        printf("Filename too long\n");
-        return -1;
-    }
-    
-    disk_read_sector(1, buffer);
-    memcpy(&ft, buffer, sizeof(FileTable));
-    
-    int free_entry = -1;
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use && strcmp(ft.files[i].filename, filename) == 0) {
-            printf("File already exists\n");
-            return -1;
-        }
-        if (!ft.files[i].in_use && free_entry == -1) {
-            free_entry = i;
-        }
+static uint8_t ata_rw_command(const AtaDrive *drive, int write) {
+    if (drive->multiple) {
+        return drive->lba48 ? (write ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE_EXT)
+                            : (write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE);
     }
-    
-    if (free_entry == -1) {
-        printf("No free file entries\n");
-        return -1;
-    }
-    
-    uint32_t num_sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
-    uint32_t first_sector = fs_find_free_sector();
-    
-    strcpy(ft.files[free_entry].filename, filename);
-    ft.files[free_entry].size = size;
-    ft.files[free_entry].first_sector = first_sector;
-    ft.files[free_entry].num_sectors = num_sectors;
-    ft.files[free_entry].in_use = 1;
-    ft.num_files++;
-    
-    memcpy(buffer, &ft, sizeof(FileTable));
-    disk_write_sector(1, buffer);
-    
-    for (uint32_t i = 0; i < num_sectors; i++) {
-        uint32_t bytes_to_write = (i == num_sectors - 1) ? 
-                                  (size % SECTOR_SIZE ? size % SECTOR_SIZE : SECTOR_SIZE) : 
-                                  SECTOR_SIZE;
-        
-        memset(buffer, 0, SECTOR_SIZE);
-        memcpy(buffer, data + (i * SECTOR_SIZE), bytes_to_write);
-        disk_write_sector(first_sector + i, buffer);
+    return drive->lba48 ? (write ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_READ_SECTORS_EXT)
+                        : (write ? ATA_CMD_WRITE_SECTORS : ATA_CMD_READ_SECTORS);
+}
+
+// Moves one DRQ block of the command in flight.
+static void ata_pio_block(const AtaDrive *drive, int write, uint8_t *buffer, uint32_t sectors) {
+    uint16_t *data = (uint16_t *)buffer;
+    for (uint32_t i = 0; i < sectors * 256; i++) {
+        if (write) outw(drive->io + ATA_REG_DATA, data[i]);
+        else data[i] = inw(drive->io + ATA_REG_DATA);
     }
-    
-    return 0;
 }
 
-int fs_read_file(const char *filename, uint8_t *buffer, uint32_t *size) {
-    FileTable ft;
-    uint8_t sector_buffer[SECTOR_SIZE];
-    
-    disk_read_sector(1, sector_buffer);
-    memcpy(&ft, sector_buffer, sizeof(FileTable));
-    
-    int file_index = -1;
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use && strcmp(ft.files[i].filename, filename) == 0) {
-            file_index = i;
-            break;
+// One command per 256 sectors instead of one per sector.
+static void ata_transfer(const AtaDrive *drive, int write, uint32_t lba, uint32_t count, uint8_t *buffer) {
+    uint8_t cmd = ata_rw_command(drive, write);
+    uint32_t block = drive->multiple ? drive->multiple : 1;
+
+    while (count > 0) {
+        uint32_t n = count < 256 ? count : 256;
+        ata_command(drive, cmd, lba, n);
+        for (uint32_t s = 0; s < n; s += block) {
+            if (ata_wait_drq(drive) != 0) return;
+            ata_pio_block(drive, write, buffer + s * SECTOR_SIZE, n - s < block ? n - s : block);
         }
+        lba += n;
+        buffer += n * SECTOR_SIZE;
+        count -= n;
     }
-    
-    if (file_index == -1) {
-        printf("File not found\n");
-        return -1;
-    }
-    
-    *size = ft.files[file_index].size;
-    
-    for (uint32_t i = 0; i < ft.files[file_index].num_sectors; i++) {
-        disk_read_sector(ft.files[file_index].first_sector + i, sector_buffer);
-        
-        uint32_t bytes_to_copy = (i == ft.files[file_index].num_sectors - 1) ? 
-                               (ft.files[file_index].size % SECTOR_SIZE ? 
-                                ft.files[file_index].size % SECTOR_SIZE : SECTOR_SIZE) : 
-                               SECTOR_SIZE;
-        
-        memcpy(buffer + (i * SECTOR_SIZE), sector_buffer, bytes_to_copy);
-    }
-    
-    return 0;
 }
 
-int fs_delete_file(const char *filename) {
-    FileTable ft;
+// Waits until everything written so far is on the media.
+static void ata_drive_flush(const AtaDrive *drive) {
+    ata_wait_ready(drive);
+    outb(drive->io + ATA_REG_DRIVE, (drive->lba48 ? 0x40 : 0xE0) | (drive->slave << 4));
+    ata_delay(drive);
+    outb(drive->io + ATA_REG_CMD, drive->lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH_CACHE);
+    ata_delay(drive);
+    ata_wait_ready(drive);
+}
+
+// The plain ATA device is the primary master.
+void ata_read_sectors(uint32_t lba, uint32_t count, uint8_t *buffer) {
+    ata_transfer(&ata_drives[0], 0, lba, count, buffer);
+}
+
+void ata_write_sectors(uint32_t lba, uint32_t count, const uint8_t *buffer) {
+    ata_transfer(&ata_drives[0], 1, lba, count, (uint8_t *)buffer);
+}
+
+void ata_flush() {
+    ata_drive_flush(&ata_drives[0]);
+}
+
+int ata_present() {
+    return ata_drives[0].present;
+}
+
+// --------------- Striped volume -------------------
+// Chunks rotate across the members. Each member keeps a label in its
+// sector 0 and its share of the volume after it. The primary and the
+// secondary channel each run one command at a time, and both are kept
+// busy while a request spans members on both.
+
+typedef struct {
+    char magic[4];
+    uint32_t set_id;
+    uint32_t index;
+    uint32_t members;
+    uint32_t chunk_sectors;
+    uint32_t total_sectors;     // size of the volume
+} StripeLabel;
+
+// Per-channel progress through one request.
+typedef struct {
+    uint32_t chunk;             // next chunk to look at
+    const AtaDrive *drive;      // member with a command in flight, or NULL
+    uint8_t *buffer;
+    uint32_t left;              // sectors still to move for that command
+} StripeChannel;
+
+const AtaDrive *stripe_members[STRIPE_MAX_MEMBERS];
+uint32_t stripe_count = 0;
+uint32_t stripe_chunk = 0;
+uint32_t stripe_sectors = 0;
+
+int stripe_ready() {
+    return stripe_count != 0;
+}
+
+// Returns 0 when every member of a set was found on the ATA channels.
+int stripe_init() {
     uint8_t buffer[SECTOR_SIZE];
-    
-    disk_read_sector(1, buffer);
-    memcpy(&ft, buffer, sizeof(FileTable));
-    
-    int file_index = -1;
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use && strcmp(ft.files[i].filename, filename) == 0) {
-            file_index = i;
-            break;
-        }
+    StripeLabel *label = (StripeLabel *)buffer;
+    StripeLabel set;
+    uint32_t found = 0;
+
+    memset(stripe_members, 0, sizeof(stripe_members));
+    for (uint32_t i = 0; i < ATA_MAX_DRIVES; i++) {
+        if (!ata_drives[i].present) continue;
+        ata_transfer(&ata_drives[i], 0, 0, 1, buffer);
+        if (strncmp(label->magic, STRIPE_MAGIC, 4) != 0) continue;
+        if (found == 0) memcpy(&set, label, sizeof(StripeLabel));
+        if (label->set_id != set.set_id || label->index >= set.members || set.members > STRIPE_MAX_MEMBERS ||
+            stripe_members[label->index]) continue;
+        stripe_members[label->index] = &ata_drives[i];
+        found++;
     }
-    
-    if (file_index == -1) {
-        printf("File not found\n");
+    if (found == 0) return -1;
+    if (found != set.members || set.chunk_sectors == 0 || set.chunk_sectors > 256) {
+        printf("stripe: found %d of %d members\n", found, set.members);
         return -1;
     }
-    
-    ft.files[file_index].in_use = 0;
-    ft.num_files--;
-    
-    memcpy(buffer, &ft, sizeof(FileTable));
-    disk_write_sector(1, buffer);
-    
+    stripe_count = set.members;
+    stripe_chunk = set.chunk_sectors;
+    stripe_sectors = set.total_sectors;
     return 0;
 }
 
-uint32_t fs_get_file_size(const char *filename) {
-    FileTable ft;
-    uint8_t buffer[SECTOR_SIZE];
-    
-    disk_read_sector(1, buffer);
-    memcpy(&ft, buffer, sizeof(FileTable));
-    
-    if (strncmp(ft.magic, K_MAGIC, 4) != 0) {
-        kernel_panic("Filesystem not initialized!\n");
-        return DISK_ERROR;
-    }
-    
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use) {
-            if (strcmp(filename, ft.files[i].filename) == 0) {
-                return ft.files[i].size;
+static int stripe_rw(int write, uint32_t lba, uint32_t count, uint8_t *buffer) {
+    StripeChannel channels[2];
+    uint32_t last = (lba + count - 1) / stripe_chunk;
+    uint32_t pending = last - lba / stripe_chunk + 1;
+    int timeout = 10000000;
+
+    memset(channels, 0, sizeof(channels));
+    channels[0].chunk = channels[1].chunk = lba / stripe_chunk;
+    while (pending > 0) {
+        if (--timeout == 0) {
+            printf("stripe: request timed out\n");
+            return -1;
+        }
+        for (int c = 0; c < 2; c++) {
+            StripeChannel *ch = &channels[c];
+            if (!ch->drive) {
+                while (ch->chunk <= last &&
+                       (stripe_members[ch->chunk % stripe_count]->io == ATA_PRIMARY_IO) != (c == 0)) {
+                    ch->chunk++;
+                }
+                if (ch->chunk > last) continue;
+                uint32_t start = ch->chunk * stripe_chunk;
+                uint32_t end = start + stripe_chunk;
+                if (start < lba) start = lba;
+                if (end > lba + count) end = lba + count;
+                ch->drive = stripe_members[ch->chunk % stripe_count];
+                ch->buffer = buffer + (start - lba) * SECTOR_SIZE;
+                ch->left = end - start;
+                ata_command(ch->drive, ata_rw_command(ch->drive, write),
+                            STRIPE_DATA_SECTOR + (ch->chunk / stripe_count) * stripe_chunk +
+                            start % stripe_chunk, ch->left);
+                ch->chunk++;
+                continue;
+            }
+            uint8_t status = ata_status(ch->drive);
+            if (status & 0x80) continue;
+            if (status & 0x01) {
+                printf("stripe: error on member at 0x%x\n", ch->drive->io);
+                return -1;
             }
+            if (!(status & 0x08)) continue;
+            uint32_t block = ch->drive->multiple ? ch->drive->multiple : 1;
+            uint32_t n = ch->left < block ? ch->left : block;
+            ata_pio_block(ch->drive, write, ch->buffer, n);
+            ch->buffer += n * SECTOR_SIZE;
+            ch->left -= n;
+            if (ch->left == 0) {
+                ch->drive = NULL;
+                pending--;
+            }
+            timeout = 10000000;
         }
     }
-    return DISK_NOT_FOUND;
+    return 0;
 }
 
-int fs_file_exists(const char *filename) {
-    FileTable ft;
-    uint8_t buffer[SECTOR_SIZE];
-    disk_read_sector(1, buffer);
-    memcpy(&ft, buffer, sizeof(FileTable));
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use && strcmp(ft.files[i].filename, filename) == 0) {
-            return 1;
-        }
+void stripe_read(uint32_t lba, uint32_t count, uint8_t *buffer) {
+    if (stripe_rw(0, lba, count, buffer) != 0) {
+        printf("stripe: read error at sector %d\n", lba);
     }
-    return 0;
 }
 
-
-int fs_edit_file(const char *filename, const uint8_t *data, uint32_t new_size) {
-    FileTable ft;
-    uint8_t buffer[SECTOR_SIZE];
-    disk_read_sector(1, buffer);
-    memcpy(&ft, buffer, sizeof(FileTable));
-    int file_index = -1;
-    for (uint32_t i = 0; i < MAX_FILES; i++) {
-        if (ft.files[i].in_use && strcmp(ft.files[i].filename, filename) == 0) {
-            file_index = i;
-            break;
-        }
+void stripe_write(uint32_t lba, uint32_t count, const uint8_t *buffer) {
+    if (stripe_rw(1, lba, count, (uint8_t *)buffer) != 0) {
+        printf("stripe: write error at sector %d\n", lba);
     }
-    if (file_index == -1) {
-        printf("File not found\n");
-        return -1;
+}
+
+void stripe_flush() {
+    for (uint32_t i = 0; i < stripe_count; i++) {
+        ata_drive_flush(stripe_members[i]);
     }
-    uint32_t current_allocated_bytes = ft.files[file_index].num_sectors * SECTOR_SIZE;
-    uint32_t new_num_sectors = (new_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
-    if (new_size <= current_allocated_bytes) {
-        for (uint32_t i = 0; i < ft.files[file_index].num_sectors; i++) {
-            uint32_t offset = i * SECTOR_SIZE;
-            uint32_t bytes_to_write;
-            if (i == ft.files[file_index].num_sectors - 1) {
-                bytes_to_write = (new_size - offset < SECTOR_SIZE)? (new_size - offset) : SECTOR_SIZE;
-            } else {
-                bytes_to_write = SECTOR_SIZE;
-            }
-            memset(buffer, 0, SECTOR_SIZE);
-            if (offset < new_size) {
-                memcpy(buffer, data + offset, bytes_to_write);
-            }
-            disk_write_sector(ft.files[file_index].first_sector + i, buffer);
-        }
-        ft.files[file_index].size = new_size;
-        for (uint32_t i = new_num_sectors; i < ft.files[file_index].num_sectors; i++) {
-            memset(buffer, 0, SECTOR_SIZE);
-            disk_write_sector(ft.files[file_index].first_sector + i, buffer);
-        }
-        ft.files[file_index].num_sectors = new_num_sectors;
-    } else {
-        uint32_t free_sectors = fs_find_free_sector() - ft.files[file_index].first_sector - ft.files[file_index].num_sectors;
-        if (new_num_sectors > free_sectors) {
-            printf("Not enough free space\n");
-            return -1;
-        }
-        uint32_t new_first_sector = ft.files[file_index].first_sector;
-        for (uint32_t i = 0; i < new_num_sectors; i++) {
-            uint32_t offset = i * SECTOR_SIZE;
-            uint32_t bytes_to_write;
-            if (i == new_num_sectors - 1) {
-                bytes_to_write = (new_size - offset < SECTOR_SIZE)? (new_size - offset) : SECTOR_SIZE;
-            } else {
-                bytes_to_write = SECTOR_SIZE;
-            }
-            memset(buffer, 0, SECTOR_SIZE);
-            if (offset < new_size) {
-                memcpy(buffer, data + offset, bytes_to_write);
-            }
-            disk_write_sector(new_first_sector + i, buffer);
-        }
-        ft.files[file_index].first_sector = new_first_sector;
-        ft.files[file_index].num_sectors = new_num_sectors;
-        ft.files[file_index].size = new_size;
+}
+
+// --------------- RAM disk -------------------------
+// A block device in memory. It has no driver cost, so fsbench on it
+// measures the file system alone, and it stands in for a missing disk.
+
+uint8_t ramdisk[RAMDISK_SECTORS * SECTOR_SIZE];
+
+static int ramdisk_check(uint32_t lba, uint32_t count) {
+    if (lba < RAMDISK_SECTORS && count <= RAMDISK_SECTORS - lba) return 0;
+    printf("ramdisk: access past the end at sector %d\n", lba);
+    return -1;
+}
+
+void ramdisk_read(uint32_t lba, uint32_t count, uint8_t *buffer) {
+    if (ramdisk_check(lba, count) == 0) memcpy(buffer, ramdisk + lba * SECTOR_SIZE, count * SECTOR_SIZE);
+}
+
+void ramdisk_write(uint32_t lba, uint32_t count, const uint8_t *buffer) {
+    if (ramdisk_check(lba, count) == 0) memcpy(ramdisk + lba * SECTOR_SIZE, buffer, count * SECTOR_SIZE);
+}
+
+void ramdisk_flush() {
+}
+
+// --------------- Block devices --------------------
+// The file system only talks to disk_dev. disk_init prefers virtio-blk,
+// then an AHCI SATA disk, then a striped ATA set, then the ATA primary
+// master, and falls back to the RAM disk.
+
+BlockDevice ata_device = {"ata", 0, ata_read_sectors, ata_write_sectors, ata_flush, 0};
+BlockDevice virtio_blk_device = {"virtio-blk", 0, virtio_blk_read, virtio_blk_write, virtio_blk_flush, 0};
+BlockDevice ahci_device = {"ahci", 0, ahci_read, ahci_write, ahci_flush, 0};
+BlockDevice stripe_device = {"stripe", 0, stripe_read, stripe_write, stripe_flush, 0};
+BlockDevice ramdisk_device = {"ramdisk", RAMDISK_SECTORS, ramdisk_read, ramdisk_write, ramdisk_flush, 1};
+BlockDevice *disk_boot_dev = &ata_device;   // what disk_init picked
+
+void disk_init() {
+    disk_dev = &ata_device;
+    for (uint32_t i = 0; i < ATA_MAX_DRIVES; i++) {
+        AtaDrive *drive = &ata_drives[i];
+        if (ata_identify(drive) != 0) continue;
+        printf("ATA %d: %d MB, %s, %d sectors per block, UDMA %d, MWDMA %d\n", i,
+               (uint32_t)(drive->capacity >> 11), drive->lba48 ? "LBA48" : "LBA28",
+               drive->multiple ? drive->multiple : 1, drive->udma, drive->mwdma);
     }
-    memcpy(buffer, &ft, sizeof(FileTable));
-    disk_write_sector(1, buffer);
+    ata_device.sectors = ata_drives[0].capacity;
 
-    return 0;
+    if (virtio_blk_init() == 0) {
+        disk_dev = &virtio_blk_device;
+        disk_dev->sectors = virtio_blk_capacity;
+    } else if (ahci_init() == 0) {
+        disk_dev = &ahci_device;
+        disk_dev->sectors = ahci_capacity;
+    } else if (stripe_init() == 0) {
+        disk_dev = &stripe_device;
+        disk_dev->sectors = stripe_sectors;
+        printf("Stripe: %d members, %d KB chunks\n", stripe_count, stripe_chunk / 2);
+    } else if (!ata_present()) {
+        disk_dev = &ramdisk_device;
+        printf("No disk found, files are kept in RAM\n");
+    }
+    disk_boot_dev = disk_dev;
+    printf("Disk: %s, %d MB\n", disk_dev->name, (uint32_t)(disk_dev->sectors >> 11));
+    tmpfs_init();
 }
 
 #endif
@@ -0,0 +1,3112 @@
+#ifndef FS_H
+#define FS_H
+
+// The ZOS file system, independent of any hardware: everything below
+// reaches the media through disk_dev. The kernel gets it from disk.h;
+// host tools include it directly and provide a BlockDevice backed by an
+// image file. The includer provides the stdint types, printf,
+// kernel_panic and the string functions.
+
+#include "fs_format.h"
+#include "blktrace.h"
+#include "lz4.h"
+#include "crc32c.h"
+#include "tmpfs.h"
+#include "initrd.h"
+
+#define FS_DEFAULT_SECTORS      (64 * 1024 * 2)
+#define FS_BITMAP_MAX_SECTORS   8192    // bitmap kept in memory, 16GB of disk
+#define FS_MAX_SECTORS          (FS_BITMAP_MAX_SECTORS * FS_BITS_PER_SECTOR)
+#define FS_CACHE_SLOTS          64
+#define FS_DATA_CACHE_SLOTS     128
+#define FS_CSUM_CACHE_SLOTS     8
+#define FS_RA_MIN_WINDOW        4
+#define FS_RA_MAX_WINDOW        64
+#define FS_RA_TRIGGER           2
+#define FS_DCACHE_SIZE          256
+#define FS_MAX_OPEN             16
+#define FS_FIRST_FD             3
+#define FS_TMP_MOUNT            "/tmp"
+#define FS_INITRD_MOUNT         "/initrd"
+#define FS_ON_DISK              0
+#define FS_TMP_ROOT             1       // /tmp itself
+#define FS_TMP_FILE             2
+#define FS_INITRD               3       // anything at or below /initrd
+#define FS_JOURNAL_MAX_FREES    64
+#define FS_JOURNAL_MAX_ALLOCS   32
+#define FS_JOURNAL_RESERVE      32      // logged sectors any operation may need
+#define FS_JOURNAL_BATCH        32
+#define FS_GROW_MAX_SLACK       2048    // sectors reserved past a growing file
+#define FS_WRITE_STEP           (16 * SECTOR_SIZE)  // bytes written per journal step
+#define FS_TRACE_SLOTS          16384
+
+#define O_RDONLY                0x000
+#define O_WRONLY                0x001
+#define O_RDWR                  0x002
+#define O_ACCMODE               0x003
+#define O_CREAT                 0x040
+#define O_TRUNC                 0x200
+#define O_APPEND                0x400
+
+#define SEEK_SET                0
+#define SEEK_CUR                1
+#define SEEK_END                2
+
+#define DISK_ERROR -1
+#define DISK_NOT_FOUND 0 
+
+// --------------- Block device ---------------------
+
+typedef struct {
+    const char *name;
+    uint64_t sectors;       // 0 when the driver could not tell
+    void (*read)(uint32_t lba, uint32_t count, uint8_t *buffer);
+    void (*write)(uint32_t lba, uint32_t count, const uint8_t *buffer);
+    void (*flush)();
+    uint8_t ram;            // contents are lost at reboot, fs_mount formats it
+} BlockDevice;
+
+BlockDevice *disk_dev;
+
+// --------------- Block trace ----------------------
+// While fs_trace_on is set, every request to disk_dev is queued in a
+// ring for the kernel (or a host tool) to stream out; see blktrace.h.
+// When the reader falls behind, new records are dropped and counted,
+// and a TRACE_LOST record marks the gap. Public fs calls set
+// fs_trace_call on entry, so each request names the call behind it.
+
+TraceRecord fs_trace_ring[FS_TRACE_SLOTS];
+uint32_t fs_trace_head = 0;         // records queued since fs_trace_start
+uint32_t fs_trace_tail = 0;         // records taken by the reader
+uint32_t fs_trace_lost = 0;         // dropped since the last TRACE_LOST
+uint32_t fs_trace_dropped = 0;
+uint8_t fs_trace_on = 0;
+uint8_t fs_trace_call = TRACE_CALL_OTHER;
+uint32_t fs_trace_seq = 0;
+
+static inline void fs_trace_enter(uint8_t call) {
+    fs_trace_call = call;
+    fs_trace_seq++;
+}
+
+static inline uint64_t fs_trace_clock() {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void fs_trace_push(uint8_t op, uint32_t lba, uint32_t count) {
+    uint32_t room = FS_TRACE_SLOTS - (fs_trace_head - fs_trace_tail);
+    if (room < (fs_trace_lost ? 2u : 1u)) {
+        fs_trace_lost++;
+        fs_trace_dropped++;
+        return;
+    }
+    uint64_t now = fs_trace_clock();
+    if (fs_trace_lost) {
+        TraceRecord *gap = &fs_trace_ring[fs_trace_head++ % FS_TRACE_SLOTS];
+        gap->tsc = now;
+        gap->lba = fs_trace_lost;
+        gap->count = 0;
+        gap->seq = fs_trace_seq;
+        gap->op = TRACE_LOST;
+        gap->call = fs_trace_call;
+        gap->reserved[0] = gap->reserved[1] = 0;
+        fs_trace_lost = 0;
+    }
+    TraceRecord *rec = &fs_trace_ring[fs_trace_head++ % FS_TRACE_SLOTS];
+    rec->tsc = now;
+    rec->lba = lba;
+    rec->count = count;
+    rec->seq = fs_trace_seq;
+    rec->op = op;
+    rec->call = fs_trace_call;
+    rec->reserved[0] = rec->reserved[1] = 0;
+}
+
+static inline void fs_trace(uint8_t op, uint32_t lba, uint32_t count) {
+    if (fs_trace_on) fs_trace_push(op, lba, count);
+}
+
+void fs_trace_start() {
+    fs_trace_head = fs_trace_tail = 0;
+    fs_trace_lost = fs_trace_dropped = 0;
+    fs_trace_on = 1;
+}
+
+// The oldest queued record, or NULL; fs_trace_next releases it.
+TraceRecord *fs_trace_peek() {
+    return fs_trace_tail == fs_trace_head ? NULL : &fs_trace_ring[fs_trace_tail % FS_TRACE_SLOTS];
+}
+
+void fs_trace_next() {
+    fs_trace_tail++;
+}
+
+void disk_read_sector(uint32_t lba, uint8_t *buffer) {
+    fs_trace(TRACE_READ, lba, 1);
+    disk_dev->read(lba, 1, buffer);
+}
+
+void disk_read_sectors(uint32_t lba, uint32_t count, uint8_t *buffer) {
+    fs_trace(TRACE_READ, lba, count);
+    disk_dev->read(lba, count, buffer);
+}
+
+void disk_write_sector(uint32_t lba, const uint8_t *buffer) {
+    fs_trace(TRACE_WRITE, lba, 1);
+    disk_dev->write(lba, 1, buffer);
+}
+
+void disk_write_sectors(uint32_t lba, uint32_t count, const uint8_t *buffer) {
+    fs_trace(TRACE_WRITE, lba, count);
+    disk_dev->write(lba, count, buffer);
+}
+
+void disk_flush() {
+    fs_trace(TRACE_FLUSH, 0, 0);
+    disk_dev->flush();
+}
+
+SuperBlock fs_sb;
+FsLayout fs_layout;
+uint32_t fs_cwd = FS_ROOT_INODE;
+char fs_cwd_path[FS_MAX_PATH] = "/";
+
+// --------------- Journal --------------------------
+// Metadata sectors are not written in place. They collect in the
+// running transaction, which is written to the journal, committed and
+// only then copied to their home locations. File data is written
+// directly and always before the metadata that points at it, and
+// freed extents stay allocated until the transaction that freed them
+// commits, so a crash never exposes garbage or reused sectors. Data
+// sectors overwritten in place are the exception: they are logged like
+// metadata, so each lands together with its checksum.
+//
+// A transaction never commits halfway through an operation. Each one
+// reserves what it will log before it logs anything (fs_journal_reserve),
+// and operations whose cost grows with their size either reserve it up
+// front or run in steps that are each consistent on their own
+// (fs_journal_step).
+
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} JournalExtent;
+
+uint32_t fs_journal_lbas[FS_JOURNAL_MAX_BLOCKS];
+uint8_t fs_journal_data[FS_JOURNAL_MAX_BLOCKS][SECTOR_SIZE];
+uint32_t fs_journal_count = 0;
+JournalExtent fs_journal_frees[FS_JOURNAL_MAX_FREES];
+uint32_t fs_journal_nfrees = 0;
+JournalExtent fs_journal_allocs[FS_JOURNAL_MAX_ALLOCS];
+uint32_t fs_journal_nallocs = 0;
+uint32_t fs_journal_seq = 1;
+uint32_t fs_journal_depth = 0;
+uint32_t fs_journal_ops = 0;
+uint8_t fs_journal_logged = 0;      // the current step has logged something
+
+static void fs_csum_writeback();
+
+static void fs_journal_clear(uint32_t seq) {
+    uint8_t buffer[SECTOR_SIZE];
+    JournalHeader hdr;
+    memset(&hdr, 0, sizeof(JournalHeader));
+    memcpy(hdr.magic, FS_JOURNAL_MAGIC, 4);
+    hdr.seq = seq;
+    memset(buffer, 0, SECTOR_SIZE);
+    memcpy(buffer, &hdr, sizeof(JournalHeader));
+    disk_write_sector(fs_layout.journal, buffer);
+}
+
+uint8_t *fs_journal_find(uint32_t lba) {
+    for (uint32_t i = 0; i < fs_journal_count; i++) {
+        if (fs_journal_lbas[i] == lba) return fs_journal_data[i];
+    }
+    return NULL;
+}
+
+// Notes an extent allocated by the running transaction. Nothing
+// committed points at it, so checksums that only cover such sectors can
+// skip the journal (see fs_csum_update).
+static void fs_journal_fresh(uint32_t first, uint32_t count) {
+    JournalExtent *last = fs_journal_nallocs ? &fs_journal_allocs[fs_journal_nallocs - 1] : NULL;
+    if (last && last->first + last->count == first) {
+        last->count += count;
+    } else if (fs_journal_nallocs < FS_JOURNAL_MAX_ALLOCS) {
+        fs_journal_allocs[fs_journal_nallocs].first = first;
+        fs_journal_allocs[fs_journal_nallocs].count = count;
+        fs_journal_nallocs++;
+    }
+}
+
+static int fs_journal_is_fresh(uint32_t first, uint32_t count) {
+    for (uint32_t i = 0; i < fs_journal_nallocs; i++) {
+        JournalExtent *a = &fs_journal_allocs[i];
+        if (first >= a->first && first + count <= a->first + a->count) return 1;
+    }
+    return 0;
+}
+
+// Writes the running transaction to the journal, commits it and
+// checkpoints it. The commit record is written only after the logged
+// sectors are on the media.
+static void fs_journal_write() {
+    fs_csum_writeback();
+    fs_journal_nallocs = 0;
+    if (fs_journal_count == 0) return;
+    uint8_t buffer[SECTOR_SIZE];
+    uint8_t call = fs_trace_call;
+    fs_trace_call = TRACE_CALL_JOURNAL;
+
+    JournalHeader hdr;
+    memset(&hdr, 0, sizeof(JournalHeader));
+    memcpy(hdr.magic, FS_JOURNAL_MAGIC, 4);
+    hdr.seq = fs_journal_seq;
+    hdr.count = fs_journal_count;
+    memcpy(hdr.lbas, fs_journal_lbas, fs_journal_count * 4);
+    memset(buffer, 0, SECTOR_SIZE);
+    memcpy(buffer, &hdr, sizeof(JournalHeader));
+    disk_write_sector(fs_layout.journal, buffer);
+    disk_write_sectors(fs_layout.journal + 1, fs_journal_count, fs_journal_data[0]);
+    disk_flush();
+
+    JournalCommit commit;
+    memcpy(commit.magic, FS_JOURNAL_MAGIC, 4);
+    commit.seq = fs_journal_seq;
+    commit.count = fs_journal_count;
+    commit.checksum = fs_journal_checksum(fs_journal_lbas, fs_journal_data[0], fs_journal_count);
+    memset(buffer, 0, SECTOR_SIZE);
+    memcpy(buffer, &commit, sizeof(JournalCommit));
+    disk_write_sector(fs_layout.journal + 1 + fs_journal_count, buffer);
+    disk_flush();
+
+    for (uint32_t i = 0; i < fs_journal_count; i++) {
+        disk_write_sector(fs_journal_lbas[i], fs_journal_data[i]);
+    }
+    disk_flush();
+    fs_journal_clear(fs_journal_seq++);
+    fs_journal_count = 0;
+    fs_trace_call = call;
+}
+
+// Logs the new contents of a metadata sector. Rewrites of a sector
+// already in the transaction replace the logged copy. Running out of
+// room here means an operation logged more than it reserved.
+void fs_journal_add(uint32_t lba, const void *data) {
+    uint8_t *copy = fs_journal_find(lba);
+    if (!copy) {
+        if (fs_journal_count == FS_JOURNAL_MAX_BLOCKS) kernel_panic("Journal transaction overflow\n");
+        fs_journal_lbas[fs_journal_count] = lba;
+        copy = fs_journal_data[fs_journal_count++];
+    }
+    memcpy(copy, data, SECTOR_SIZE);
+    fs_journal_logged = 1;
+}
+
+// Redoes a committed transaction that was not fully checkpointed. A
+// transaction without a valid commit record is discarded.
+int fs_journal_replay() {
+    uint8_t buffer[SECTOR_SIZE];
+    JournalHeader hdr;
+    JournalCommit commit;
+
+    disk_read_sector(fs_layout.journal, buffer);
+    memcpy(&hdr, buffer, sizeof(JournalHeader));
+    if (strncmp(hdr.magic, FS_JOURNAL_MAGIC, 4) != 0) return 0;
+    fs_journal_seq = hdr.seq + 1;
+    if (hdr.count == 0 || hdr.count > FS_JOURNAL_MAX_BLOCKS) return 0;
+
+    disk_read_sector(fs_layout.journal + 1 + hdr.count, buffer);
+    memcpy(&commit, buffer, sizeof(JournalCommit));
+    int valid = strncmp(commit.magic, FS_JOURNAL_MAGIC, 4) == 0 &&
+                commit.seq == hdr.seq && commit.count == hdr.count;
+    if (valid) {
+        disk_read_sectors(fs_layout.journal + 1, hdr.count, fs_journal_data[0]);
+        valid = commit.checksum == fs_journal_checksum(hdr.lbas, fs_journal_data[0], hdr.count);
+    }
+    if (valid) {
+        for (uint32_t i = 0; i < hdr.count; i++) {
+            disk_write_sector(hdr.lbas[i], fs_journal_data[i]);
+        }
+        disk_flush();
+    }
+    fs_journal_clear(hdr.seq);
+    return valid ? hdr.count : 0;
+}
+
+// --------------- Block caches ---------------------
+// LRU caches of single sectors: one for the superblock, FileEntry and
+// directory sectors, whose writes go to the journal, and a write-through
+// one for file data. A returned pointer stays valid until the next miss
+// in the same cache.
+
+typedef struct {
+    uint32_t lba;
+    uint32_t last_used;
+    uint8_t valid;
+    uint8_t prefetched;     // filled by readahead and not read yet
+    uint8_t dirty;          // csum sector to write back before the commit
+    uint8_t data[SECTOR_SIZE] __attribute__((aligned(4)));  // csum sectors are read as uint32_t
+} CacheSlot;
+
+typedef struct {
+    CacheSlot *slots;
+    uint32_t count;
+    uint32_t tick;
+} BlockCache;
+
+typedef struct {
+    uint32_t hits;          // reads served from a prefetched sector
+    uint32_t misses;        // reads that had to wait for the disk
+    uint32_t prefetched;    // sectors read ahead of the reader
+    uint32_t wasted;        // prefetched sectors evicted unread
+    uint32_t random;        // reads that broke a sequential stream
+} ReadAheadStats;
+
+CacheSlot fs_meta_slots[FS_CACHE_SLOTS];
+CacheSlot fs_data_slots[FS_DATA_CACHE_SLOTS];
+BlockCache fs_meta_cache = {fs_meta_slots, FS_CACHE_SLOTS, 0};
+BlockCache fs_data_cache = {fs_data_slots, FS_DATA_CACHE_SLOTS, 0};
+ReadAheadStats fs_ra_stats;
+
+static CacheSlot *bcache_find(BlockCache *cache, uint32_t lba) {
+    for (uint32_t i = 0; i < cache->count; i++) {
+        CacheSlot *slot = &cache->slots[i];
+        if (slot->valid && slot->lba == lba) {
+            slot->last_used = ++cache->tick;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static CacheSlot *bcache_slot(BlockCache *cache, uint32_t lba, int *hit) {
+    CacheSlot *victim = &cache->slots[0];
+    for (uint32_t i = 0; i < cache->count; i++) {
+        CacheSlot *slot = &cache->slots[i];
+        if (slot->valid && slot->lba == lba) {
+            *hit = 1;
+            slot->last_used = ++cache->tick;
+            return slot;
+        }
+        if (!slot->valid) {
+            if (victim->valid) victim = slot;
+        } else if (victim->valid && slot->last_used < victim->last_used) {
+            victim = slot;
+        }
+    }
+    *hit = 0;
+    if (victim->valid && victim->prefetched) fs_ra_stats.wasted++;
+    if (victim->valid && victim->dirty) disk_write_sector(victim->lba, victim->data);
+    victim->lba = lba;
+    victim->valid = 1;
+    victim->prefetched = 0;
+    victim->dirty = 0;
+    victim->last_used = ++cache->tick;
+    return victim;
+}
+
+static void bcache_invalidate(BlockCache *cache, uint32_t first, uint32_t count) {
+    for (uint32_t i = 0; i < cache->count; i++) {
+        CacheSlot *slot = &cache->slots[i];
+        if (slot->valid && slot->lba >= first && slot->lba < first + count) {
+            slot->valid = 0;
+        }
+    }
+}
+
+// --------------- Checksums ------------------------
+// Every data sector has a CRC32C in the checksum table, updated through
+// the journal with each write and checked whenever the sector comes
+// from the disk. The table has its own cache so a check never evicts
+// the sector being checked. A table sector that only covers sectors
+// allocated in the running transaction is written back directly instead,
+// before the commit, so filling a new extent logs two of them at most.
+
+CacheSlot fs_csum_slots[FS_CSUM_CACHE_SLOTS];
+BlockCache fs_csum_cache = {fs_csum_slots, FS_CSUM_CACHE_SLOTS, 0};
+uint32_t fs_csum_errors = 0;
+
+// Returns the cached table sector that holds the checksum of `lba`.
+static CacheSlot *fs_csum_slot(uint32_t lba) {
+    uint32_t sector = fs_layout.csum + lba / FS_CSUMS_PER_SECTOR;
+    int hit;
+    CacheSlot *slot = bcache_slot(&fs_csum_cache, sector, &hit);
+    if (!hit) {
+        uint8_t *logged = fs_journal_find(sector);
+        if (logged) memcpy(slot->data, logged, SECTOR_SIZE);
+        else disk_read_sector(sector, slot->data);
+    }
+    return slot;
+}
+
+static inline uint32_t *fs_csum_table(uint32_t lba) {
+    return (uint32_t *)fs_csum_slot(lba)->data;
+}
+
+static void fs_csum_log(CacheSlot *slot) {
+    fs_journal_add(slot->lba, slot->data);
+    slot->dirty = 0;
+}
+
+static void fs_csum_update(uint32_t lba, const uint8_t *data) {
+    if (lba < fs_layout.data) return;
+    CacheSlot *slot = fs_csum_slot(lba);
+    ((uint32_t *)slot->data)[lba % FS_CSUMS_PER_SECTOR] = crc32c(0, data, SECTOR_SIZE);
+    uint32_t base = lba - lba % FS_CSUMS_PER_SECTOR;
+    if (!fs_journal_find(slot->lba) && fs_journal_is_fresh(base, FS_CSUMS_PER_SECTOR)) slot->dirty = 1;
+    else fs_csum_log(slot);
+}
+
+static void fs_csum_writeback() {
+    for (uint32_t i = 0; i < FS_CSUM_CACHE_SLOTS; i++) {
+        CacheSlot *slot = &fs_csum_slots[i];
+        if (slot->valid && slot->dirty) disk_write_sector(slot->lba, slot->data);
+        slot->dirty = 0;
+    }
+}
+
+// Gives `to` the checksum recorded for `from`, so a sector that was bad
+// before a move is still caught after it.
+static void fs_csum_copy(uint32_t from, uint32_t to) {
+    uint32_t csum = fs_csum_table(from)[from % FS_CSUMS_PER_SECTOR];
+    CacheSlot *slot = fs_csum_slot(to);
+    ((uint32_t *)slot->data)[to % FS_CSUMS_PER_SECTOR] = csum;
+    fs_csum_log(slot);
+}
+
+// Returns 0 when `data` matches the checksum recorded for `lba`.
+static int fs_csum_verify(uint32_t lba, const uint8_t *data) {
+    if (lba < fs_layout.data) return 0;
+    if (crc32c(0, data, SECTOR_SIZE) == fs_csum_table(lba)[lba % FS_CSUMS_PER_SECTOR]) return 0;
+    fs_csum_errors++;
+    printf("Checksum mismatch at sector %d\n", lba);
+    return -1;
+}
+
+uint8_t *fs_cache_read(uint32_t lba) {
+    int hit;
+    CacheSlot *slot = bcache_slot(&fs_meta_cache, lba, &hit);
+    if (!hit) {
+        uint8_t *logged = fs_journal_find(lba);
+        if (logged) {
+            memcpy(slot->data, logged, SECTOR_SIZE);
+        } else {
+            disk_read_sector(lba, slot->data);
+            fs_csum_verify(lba, slot->data);
+        }
+    }
+    return slot->data;
+}
+
+// Like fs_cache_read, but leaves the cache alone.
+void fs_cache_peek(uint32_t lba, void *buffer) {
+    CacheSlot *slot = bcache_find(&fs_meta_cache, lba);
+    uint8_t *logged = fs_journal_find(lba);
+    if (slot) memcpy(buffer, slot->data, SECTOR_SIZE);
+    else if (logged) memcpy(buffer, logged, SECTOR_SIZE);
+    else {
+        disk_read_sector(lba, buffer);
+        fs_csum_verify(lba, buffer);
+    }
+}
+
+void fs_cache_write(uint32_t lba, const void *data) {
+    int hit;
+    CacheSlot *slot = bcache_slot(&fs_meta_cache, lba, &hit);
+    if (slot->data != data) memcpy(slot->data, data, SECTOR_SIZE);
+    fs_journal_add(lba, slot->data);
+    fs_csum_update(lba, slot->data);
+}
+
+// For metadata sectors allocated in the running transaction: nothing
+// committed points at them yet, so they can skip the journal.
+void fs_cache_write_new(uint32_t lba, const void *data) {
+    int hit;
+    CacheSlot *slot = bcache_slot(&fs_meta_cache, lba, &hit);
+    if (slot->data != data) memcpy(slot->data, data, SECTOR_SIZE);
+    if (fs_journal_find(lba)) fs_journal_add(lba, slot->data);
+    else disk_write_sector(lba, slot->data);
+    fs_csum_update(lba, slot->data);
+}
+
+void fs_cache_invalidate(uint32_t first, uint32_t count) {
+    bcache_invalidate(&fs_meta_cache, first, count);
+    bcache_invalidate(&fs_data_cache, first, count);
+}
+
+// The background defrag (see Defragmentation) copies one extent at a
+// time; a write into its source makes the copy stale.
+typedef struct {
+    uint8_t active;
+    uint32_t cursor;        // no hole is left below this sector
+    uint32_t ino;           // extent being copied, valid while count > 0
+    uint32_t from;
+    uint32_t to;
+    uint32_t count;
+    uint32_t done;          // sectors copied so far
+    uint8_t stale;
+    uint32_t moved;
+    uint32_t moved_sectors;
+    uint32_t restarts;
+} Defrag;
+
+Defrag fs_defrag;
+
+// File data writes update a cached copy so readers never see stale data.
+void fs_data_write(uint32_t lba, const uint8_t *data) {
+    if (lba - fs_defrag.from < fs_defrag.count) fs_defrag.stale = 1;
+    CacheSlot *slot = bcache_find(&fs_data_cache, lba);
+    if (slot) memcpy(slot->data, data, SECTOR_SIZE);
+    disk_write_sector(lba, data);
+    fs_csum_update(lba, data);
+}
+
+// Writes `count` sectors in one command, like fs_data_write for each.
+static void fs_data_write_run(uint32_t lba, uint32_t count, const uint8_t *data) {
+    if (fs_defrag.count && (lba - fs_defrag.from < fs_defrag.count || fs_defrag.from - lba < count)) {
+        fs_defrag.stale = 1;
+    }
+    disk_write_sectors(lba, count, data);
+    for (uint32_t i = 0; i < count; i++) {
+        CacheSlot *slot = bcache_find(&fs_data_cache, lba + i);
+        if (slot) memcpy(slot->data, data + i * SECTOR_SIZE, SECTOR_SIZE);
+        fs_csum_update(lba + i, data + i * SECTOR_SIZE);
+    }
+}
+
+// For data sectors that committed metadata already points at. Written
+// in place directly, a crash before the commit would leave new data
+// under the old checksum, so the sector is logged instead, in the same
+// transaction as its checksum.
+void fs_data_overwrite(uint32_t lba, const uint8_t *data) {
+    if (lba - fs_defrag.from < fs_defrag.count) fs_defrag.stale = 1;
+    CacheSlot *slot = bcache_find(&fs_data_cache, lba);
+    if (slot) memcpy(slot->data, data, SECTOR_SIZE);
+    fs_journal_add(lba, data);
+    fs_csum_update(lba, data);
+}
+
+// Reads data sectors from the disk, or from the running transaction for
+// sectors still logged there, and checks what came from the disk.
+static void fs_data_fetch(uint32_t lba, uint32_t count, uint8_t *buffer) {
+    if (count == 1) disk_read_sector(lba, buffer);
+    else disk_read_sectors(lba, count, buffer);
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t *logged = fs_journal_find(lba + i);
+        if (logged) memcpy(buffer + i * SECTOR_SIZE, logged, SECTOR_SIZE);
+        else fs_csum_verify(lba + i, buffer + i * SECTOR_SIZE);
+    }
+}
+
+// --------------- Readahead ------------------------
+// Each reader keeps a window. A sequential miss fetches a whole window
+// in one command, and the next window is fetched once the reader is
+// halfway through the current one. The window doubles while access
+// stays sequential and halves on a jump. PIO cannot overlap with the
+// CPU, so prefetching is synchronous but batched.
+
+typedef struct {
+    uint32_t next_lba;      // sector a sequential reader asks for next
+    uint32_t ra_lba;        // first sector not prefetched yet
+    uint32_t window;
+    uint32_t run;           // sectors read in order since the last jump
+} ReadAhead;
+
+uint8_t fs_ra_buffer[FS_RA_MAX_WINDOW * SECTOR_SIZE];
+
+static void fs_readahead(ReadAhead *ra, uint32_t from, uint32_t end_lba) {
+    uint32_t count = end_lba - from < ra->window ? end_lba - from : ra->window;
+    uint32_t lba = from;
+
+    while (lba < from + count) {
+        if (bcache_find(&fs_data_cache, lba)) {
+            lba++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (lba + run < from + count && !bcache_find(&fs_data_cache, lba + run)) run++;
+
+        fs_data_fetch(lba, run, fs_ra_buffer);
+        for (uint32_t i = 0; i < run; i++) {
+            int hit;
+            CacheSlot *slot = bcache_slot(&fs_data_cache, lba + i, &hit);
+            memcpy(slot->data, fs_ra_buffer + i * SECTOR_SIZE, SECTOR_SIZE);
+            slot->prefetched = 1;
+        }
+        fs_ra_stats.prefetched += run;
+        lba += run;
+    }
+
+    ra->ra_lba = from + count;
+    if (ra->window < FS_RA_MAX_WINDOW) ra->window *= 2;
+}
+
+// Reads one data sector of an extent ending at `end_lba`.
+static void fs_data_read(ReadAhead *ra, uint32_t lba, uint32_t end_lba, uint8_t *buffer) {
+    if (ra->window == 0) ra->window = FS_RA_MIN_WINDOW;
+
+    CacheSlot *slot;
+    int hit;
+
+    // Small reads hit the same sector several times in a row.
+    if (lba + 1 == ra->next_lba) {
+        slot = bcache_slot(&fs_data_cache, lba, &hit);
+        if (!hit) fs_data_fetch(lba, 1, slot->data);
+        memcpy(buffer, slot->data, SECTOR_SIZE);
+        return;
+    }
+
+    // A read at the start of a file counts as a stream right away; after
+    // a jump it takes FS_RA_TRIGGER sectors in order before prefetching.
+    int fresh = (ra->next_lba == 0);
+    int sequential = fresh || lba == ra->next_lba;
+    ra->next_lba = lba + 1;
+    if (!sequential) {
+        fs_ra_stats.random++;
+        ra->window = ra->window / 2 < FS_RA_MIN_WINDOW ? FS_RA_MIN_WINDOW : ra->window / 2;
+        ra->ra_lba = lba + 1;
+        ra->run = 0;
+    } else {
+        ra->run = fresh ? FS_RA_TRIGGER : ra->run + 1;
+    }
+    int streaming = sequential && ra->run >= FS_RA_TRIGGER;
+
+    slot = bcache_find(&fs_data_cache, lba);
+    if (slot && slot->prefetched) {
+        fs_ra_stats.hits++;
+        slot->prefetched = 0;
+    } else if (!slot) {
+        fs_ra_stats.misses++;
+        if (!streaming) {
+            slot = bcache_slot(&fs_data_cache, lba, &hit);
+            fs_data_fetch(lba, 1, slot->data);
+            memcpy(buffer, slot->data, SECTOR_SIZE);
+            return;
+        }
+        fs_readahead(ra, lba, end_lba);
+        slot = bcache_find(&fs_data_cache, lba);
+        slot->prefetched = 0;
+        fs_ra_stats.prefetched--;
+    }
+    memcpy(buffer, slot->data, SECTOR_SIZE);
+
+    if (sequential) {
+        // Drop-behind: a sequential reader is done with the previous
+        // sector, so let it go before the prefetched ones ahead of it.
+        CacheSlot *prev = bcache_find(&fs_data_cache, lba - 1);
+        if (prev) prev->last_used = 0;
+        if (ra->ra_lba <= lba) ra->ra_lba = lba + 1;
+        if (streaming && ra->ra_lba < end_lba && ra->ra_lba - lba <= ra->window / 2) {
+            fs_readahead(ra, ra->ra_lba, end_lba);
+        }
+    }
+}
+
+void fs_ra_report() {
+    uint32_t reads = fs_ra_stats.hits + fs_ra_stats.misses;
+    printf("Readahead: %d reads, %d hits (%d%%), %d misses\n", reads, fs_ra_stats.hits,
+           reads ? fs_ra_stats.hits * 100 / reads : 0, fs_ra_stats.misses);
+    printf("Prefetched %d sectors, %d wasted, %d random jumps\n",
+           fs_ra_stats.prefetched, fs_ra_stats.wasted, fs_ra_stats.random);
+}
+
+// --------------- Free-space bitmap ----------------
+// One bit per sector (1 = in use), kept in memory and logged sector by
+// sector whenever an allocation or free touches it.
+
+uint8_t fs_bitmap[FS_BITMAP_MAX_SECTORS * SECTOR_SIZE];
+uint32_t fs_total_sectors = 0;
+
+// A file that keeps growing would move, copying all it holds, whenever
+// a neighbour took the sectors after it. An open file that grows gets
+// up to as much again (FS_GROW_MAX_SLACK at most) reserved right after
+// its extent. Reserved sectors are marked in fs_bitmap so nothing else
+// allocates them, but they are never logged: after a crash they are
+// simply free. A reservation ends when the file is closed. One held by
+// FS_NO_INODE (disk_util's import) is taken from the front by every new
+// extent that fits, so a batch of files lands side by side.
+typedef struct {
+    uint32_t ino;
+    uint32_t first;
+    uint32_t count;         // 0 when the slot is unused
+} Reservation;
+
+Reservation fs_reservations[FS_MAX_OPEN];
+
+static inline int fs_bitmap_test(uint32_t lba) {
+    return fs_bitmap[lba >> 3] & (1 << (lba & 7));
+}
+
+static inline void fs_bitmap_set(uint32_t lba) {
+    fs_bitmap[lba >> 3] |= (1 << (lba & 7));
+}
+
+static inline void fs_bitmap_clear(uint32_t lba) {
+    fs_bitmap[lba >> 3] &= ~(1 << (lba & 7));
+}
+
+// Clears [first, first + count) in `buffer`, bitmap sector `s`.
+static const uint8_t *fs_bitmap_mask(uint32_t s, const uint8_t *bits, uint8_t *buffer,
+                                     uint32_t first, uint32_t count) {
+    uint32_t lo = s * SECTOR_SIZE * 8, hi = lo + SECTOR_SIZE * 8;
+    if (count == 0 || first >= hi || first + count <= lo) return bits;
+    if (bits != buffer) bits = memcpy(buffer, bits, SECTOR_SIZE);
+    uint32_t end = first + count < hi ? first + count : hi;
+    for (uint32_t lba = first > lo ? first : lo; lba < end; lba++) {
+        buffer[(lba - lo) >> 3] &= ~(1 << (lba & 7));
+    }
+    return bits;
+}
+
+// Bitmap sector `s` as it is logged, which is how it reads once the
+// transaction commits: reserved sectors and the extents the transaction
+// frees read as free.
+static const uint8_t *fs_bitmap_logged(uint32_t s, uint8_t *buffer) {
+    const uint8_t *bits = fs_bitmap + s * SECTOR_SIZE;
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        bits = fs_bitmap_mask(s, bits, buffer, fs_reservations[i].first, fs_reservations[i].count);
+    }
+    for (uint32_t i = 0; i < fs_journal_nfrees; i++) {
+        bits = fs_bitmap_mask(s, bits, buffer, fs_journal_frees[i].first, fs_journal_frees[i].count);
+    }
+    return bits;
+}
+
+void fs_bitmap_flush(uint32_t first, uint32_t count) {
+    if (count == 0) return;
+    uint8_t buffer[SECTOR_SIZE];
+    uint32_t bits_per_sector = SECTOR_SIZE * 8;
+    uint32_t last = (first + count - 1) / bits_per_sector;
+    for (uint32_t s = first / bits_per_sector; s <= last; s++) {
+        fs_journal_add(FS_BITMAP_SECTOR + s, fs_bitmap_logged(s, buffer));
+    }
+}
+
+// Reserves up to `count` free sectors from `first` on for `ino`.
+static void fs_reserve(uint32_t ino, uint32_t first, uint32_t count) {
+    Reservation *r = NULL;
+    for (int i = 0; i < FS_MAX_OPEN && !r; i++) {
+        if (fs_reservations[i].count == 0) r = &fs_reservations[i];
+    }
+    uint32_t n = 0;
+    while (n < count && first + n < fs_total_sectors && !fs_bitmap_test(first + n)) n++;
+    if (!r || n == 0) return;
+    for (uint32_t lba = first; lba < first + n; lba++) {
+        fs_bitmap_set(lba);
+    }
+    r->ino = ino;
+    r->first = first;
+    r->count = n;
+}
+
+// Hands the sectors reserved for `ino` back. Returns how many there were.
+static uint32_t fs_reserve_drop(uint32_t ino) {
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        Reservation *r = &fs_reservations[i];
+        if (r->count == 0 || r->ino != ino) continue;
+        for (uint32_t lba = r->first; lba < r->first + r->count; lba++) {
+            fs_bitmap_clear(lba);
+        }
+        uint32_t count = r->count;
+        r->count = 0;
+        return count;
+    }
+    return 0;
+}
+
+// Hands the `count` sectors reserved for `ino` from `first` on over to
+// it, when that is where its reservation starts.
+static int fs_reserve_take(uint32_t ino, uint32_t first, uint32_t count) {
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        Reservation *r = &fs_reservations[i];
+        if (r->count == 0 || r->ino != ino) continue;
+        if (r->first != first || r->count < count) return 0;
+        r->first += count;
+        r->count -= count;
+        fs_journal_fresh(first, count);
+        fs_bitmap_flush(first, count);
+        return 1;
+    }
+    return 0;
+}
+
+static uint32_t fs_reserve_drop_all() {
+    uint32_t count = 0;
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        if (fs_reservations[i].count) count += fs_reserve_drop(fs_reservations[i].ino);
+    }
+    return count;
+}
+
+// Takes `count` sectors from the front of the FS_NO_INODE reservation.
+// Returns 0 when there is none or it is too short.
+static uint32_t fs_reserve_front(uint32_t count) {
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        Reservation *r = &fs_reservations[i];
+        if (r->count < count || r->ino != FS_NO_INODE) continue;
+        uint32_t first = r->first;
+        fs_reserve_take(FS_NO_INODE, first, count);
+        return first;
+    }
+    return 0;
+}
+
+void fs_bitmap_load(uint32_t total_sectors) {
+    if (total_sectors > FS_MAX_SECTORS) total_sectors = FS_MAX_SECTORS;
+    fs_total_sectors = total_sectors;
+    for (uint32_t s = 0; s < fs_layout.bitmap_sectors; s++) {
+        disk_read_sector(FS_BITMAP_SECTOR + s, fs_bitmap + s * SECTOR_SIZE);
+    }
+}
+
+// Commits the running transaction and releases the extents it freed;
+// the logged bitmap already has them free.
+void fs_journal_commit() {
+    fs_journal_write();
+    for (uint32_t i = 0; i < fs_journal_nfrees; i++) {
+        JournalExtent *f = &fs_journal_frees[i];
+        for (uint32_t lba = f->first; lba < f->first + f->count; lba++) {
+            fs_bitmap_clear(lba);
+        }
+    }
+    fs_journal_nfrees = 0;
+    fs_journal_ops = 0;
+}
+
+// Logged sectors an allocation or a free of `count` sectors can touch.
+static inline uint32_t fs_bitmap_blocks(uint32_t count) {
+    return count / (SECTOR_SIZE * 8) + 2;
+}
+
+static inline int fs_journal_fits(uint32_t blocks) {
+    return fs_journal_count + blocks <= FS_JOURNAL_MAX_BLOCKS &&
+           fs_journal_nfrees + FS_JOURNAL_RESERVE / 4 <= FS_JOURNAL_MAX_FREES;
+}
+
+// Whether one operation can move an extent of `count` sectors.
+static inline int fs_journal_can_move(uint32_t count) {
+    return 2 * fs_bitmap_blocks(count) + FS_JOURNAL_RESERVE <= FS_JOURNAL_MAX_BLOCKS;
+}
+
+// Makes room for `blocks` more logged sectors, committing the running
+// transaction first if the current step has logged nothing yet. Returns
+// -1 when the step cannot fit.
+static int fs_journal_reserve(uint32_t blocks) {
+    if (fs_journal_fits(blocks)) return 0;
+    if (!fs_journal_logged) {
+        fs_journal_commit();
+        if (fs_journal_fits(blocks)) return 0;
+    }
+    printf("Too large for one transaction\n");
+    return -1;
+}
+
+// Marks a point where the operation so far leaves the file system
+// consistent, so the transaction may commit there, and reserves room for
+// the step that follows. Inside a nested operation it only reserves.
+static int fs_journal_step(uint32_t blocks) {
+    if (fs_journal_depth == 1) fs_journal_logged = 0;
+    return fs_journal_reserve(blocks);
+}
+
+// Brackets one file system operation so that it lands in a single
+// transaction. Operations are grouped until FS_JOURNAL_BATCH of them
+// are pending or the transaction runs short of room.
+void fs_journal_begin() {
+    if (fs_journal_depth++ > 0) return;
+    fs_journal_logged = 0;
+    if (!fs_journal_fits(FS_JOURNAL_RESERVE)) fs_journal_commit();
+}
+
+void fs_journal_end() {
+    if (--fs_journal_depth > 0) return;
+    if (++fs_journal_ops >= FS_JOURNAL_BATCH) fs_journal_commit();
+}
+
+void fs_sync() {
+    if (fs_journal_depth == 0) fs_journal_commit();
+}
+
+// Best-fit: the smallest free run that still holds `count` sectors, so
+// large holes are kept for large files. Returns 0 when nothing fits.
+static uint32_t fs_find_extent(uint32_t count) {
+    uint32_t best_start = 0, best_len = 0;
+    uint32_t run_start = 0, run_len = 0;
+
+    for (uint32_t lba = fs_layout.data; lba <= fs_total_sectors; lba++) {
+        if (lba < fs_total_sectors && !fs_bitmap_test(lba)) {
+            if (run_len == 0) run_start = lba;
+            run_len++;
+            continue;
+        }
+        if (run_len >= count && (best_len == 0 || run_len < best_len)) {
+            best_start = run_start;
+            best_len = run_len;
+            if (run_len == count) break;
+        }
+        run_len = 0;
+        while ((lba & 7) == 7 && lba + 8 < fs_total_sectors && fs_bitmap[(lba + 1) >> 3] == 0xFF) {
+            lba += 8;
+        }
+    }
+    return best_start;
+}
+
+// Marks a free run in use.
+static void fs_take_extent(uint32_t first, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        fs_bitmap_set(first + i);
+    }
+    fs_journal_fresh(first, count);
+    fs_bitmap_flush(first, count);
+}
+
+// Like fs_find_extent, but takes reservations back when nothing fits
+// and, before the current step has logged anything, commits so space
+// freed by the running transaction becomes usable.
+static uint32_t fs_find_free(uint32_t count) {
+    uint32_t first = fs_find_extent(count);
+    if (first == 0 && fs_reserve_drop_all()) first = fs_find_extent(count);
+    if (first == 0 && fs_journal_nfrees && !fs_journal_logged) {
+        fs_journal_commit();
+        first = fs_find_extent(count);
+    }
+    return first;
+}
+
+uint32_t fs_alloc_extent(uint32_t count) {
+    if (count == 0) return 0;
+    uint32_t first = fs_reserve_front(count);
+    if (first) return first;
+    first = fs_find_free(count);
+    if (first) fs_take_extent(first, count);
+    return first;
+}
+
+// The sectors stay marked in use until the transaction commits, but are
+// logged free right away, so the commit itself logs nothing.
+void fs_free_extent(uint32_t first, uint32_t count) {
+    if (count == 0) return;
+    if (fs_journal_nfrees == FS_JOURNAL_MAX_FREES) kernel_panic("Journal transaction overflow\n");
+    fs_journal_frees[fs_journal_nfrees].first = first;
+    fs_journal_frees[fs_journal_nfrees].count = count;
+    fs_journal_nfrees++;
+    fs_bitmap_flush(first, count);
+    fs_cache_invalidate(first, count);
+}
+
+// Grows an extent in place when the sectors right after it are free.
+int fs_extend_extent(uint32_t first, uint32_t count, uint32_t new_count) {
+    if (count == 0 || first + new_count > fs_total_sectors) return 0;
+    for (uint32_t lba = first + count; lba < first + new_count; lba++) {
+        if (fs_bitmap_test(lba)) return 0;
+    }
+    for (uint32_t lba = first + count; lba < first + new_count; lba++) {
+        fs_bitmap_set(lba);
+    }
+    fs_journal_fresh(first + count, new_count - count);
+    fs_bitmap_flush(first + count, new_count - count);
+    return 1;
+}
+
+uint32_t fs_free_sectors() {
+    uint32_t free_sectors = 0;
+    for (uint32_t lba = fs_layout.data; lba < fs_total_sectors; lba++) {
+        if (!fs_bitmap_test(lba)) free_sectors++;
+    }
+    return free_sectors;
+}
+
+// --------------- FileEntry table ------------------
+
+uint8_t fs_inode_bitmap[FS_INODE_BITMAP_SECTORS * SECTOR_SIZE];
+uint32_t fs_inode_hint = 0;
+
+void fs_inode_read(uint32_t ino, FileEntry *fe) {
+    uint8_t *sector = fs_cache_read(fs_layout.table + ino / FS_ENTRIES_PER_SECTOR);
+    memcpy(fe, sector + (ino % FS_ENTRIES_PER_SECTOR) * sizeof(FileEntry), sizeof(FileEntry));
+}
+
+void fs_inode_write(uint32_t ino, const FileEntry *fe) {
+    uint32_t lba = fs_layout.table + ino / FS_ENTRIES_PER_SECTOR;
+    uint8_t *sector = fs_cache_read(lba);
+    memcpy(sector + (ino % FS_ENTRIES_PER_SECTOR) * sizeof(FileEntry), fe, sizeof(FileEntry));
+    fs_cache_write(lba, sector);
+}
+
+static void fs_inode_bitmap_flush(uint32_t ino) {
+    uint32_t s = ino / (SECTOR_SIZE * 8);
+    fs_journal_add(FS_INODE_BITMAP_SECTOR + s, fs_inode_bitmap + s * SECTOR_SIZE);
+}
+
+uint32_t fs_inode_alloc() {
+    for (uint32_t n = 0; n < fs_sb.max_files; n++) {
+        uint32_t ino = (fs_inode_hint + n) % fs_sb.max_files;
+        if (!(fs_inode_bitmap[ino >> 3] & (1 << (ino & 7)))) {
+            fs_inode_bitmap[ino >> 3] |= (1 << (ino & 7));
+            fs_inode_bitmap_flush(ino);
+            fs_inode_hint = ino + 1;
+            return ino;
+        }
+    }
+    return FS_NO_INODE;
+}
+
+void fs_inode_free(uint32_t ino) {
+    fs_inode_bitmap[ino >> 3] &= ~(1 << (ino & 7));
+    fs_inode_bitmap_flush(ino);
+    if (ino < fs_inode_hint) fs_inode_hint = ino;
+}
+
+static void fs_sb_flush() {
+    uint8_t buffer[SECTOR_SIZE];
+    memset(buffer, 0, SECTOR_SIZE);
+    memcpy(buffer, &fs_sb, sizeof(SuperBlock));
+    fs_cache_write(FS_SUPERBLOCK_SECTOR, buffer);
+}
+
+// --------------- Directories ----------------------
+
+static uint32_t fs_dir_bucket(const FileEntry *dir, const char *name, uint32_t len) {
+    return dir->first_sector + (fs_name_hash(name, len) & (dir->num_sectors - 1));
+}
+
+static uint32_t fs_dir_find(const FileEntry *dir, const char *name) {
+    uint32_t len = strlen(name);
+    DirBlock *blk = (DirBlock *)fs_cache_read(fs_dir_bucket(dir, name, len));
+    for (uint32_t off = 0; off < blk->used; off += dir_record_size(blk->records + off)) {
+        if (dir_record_matches(blk->records + off, name, len)) {
+            return dir_record_inode(blk->records + off);
+        }
+    }
+    return FS_NO_INODE;
+}
+
+// Doubles the bucket count: every record of bucket b moves to b or b + n.
+// The buckets always move to a fresh extent, so only the FileEntry goes
+// through the journal however large the directory is.
+static int fs_dir_grow(uint32_t dir_ino, FileEntry *dir) {
+    uint32_t buckets = dir->num_sectors;
+    if (buckets * 2 > FS_DIR_MAX_BUCKETS) return -1;
+
+    uint32_t old_first = dir->first_sector;
+    uint32_t new_first = fs_alloc_extent(buckets * 2);
+    if (new_first == 0) return -1;
+
+    DirBlock old, lo, hi;
+    for (uint32_t b = 0; b < buckets; b++) {
+        memcpy(&old, fs_cache_read(old_first + b), SECTOR_SIZE);
+        memset(&lo, 0, SECTOR_SIZE);
+        memset(&hi, 0, SECTOR_SIZE);
+        for (uint32_t off = 0; off < old.used; off += dir_record_size(old.records + off)) {
+            uint8_t *rec = old.records + off;
+            const char *name = (const char *)rec + DIR_RECORD_HEADER;
+            uint32_t bucket = fs_name_hash(name, rec[4]) & (buckets * 2 - 1);
+            dir_block_append(bucket == b ? &lo : &hi, dir_record_inode(rec), name, rec[4]);
+        }
+        fs_cache_write_new(new_first + b, &lo);
+        fs_cache_write_new(new_first + b + buckets, &hi);
+    }
+
+    dir->first_sector = new_first;
+    dir->num_sectors = buckets * 2;
+    fs_inode_write(dir_ino, dir);
+    fs_free_extent(old_first, buckets);
+    return 0;
+}
+
+static int fs_dir_add(uint32_t dir_ino, FileEntry *dir, const char *name, uint32_t ino) {
+    uint32_t len = strlen(name);
+    DirBlock blk;
+    for (;;) {
+        uint32_t lba = fs_dir_bucket(dir, name, len);
+        memcpy(&blk, fs_cache_read(lba), SECTOR_SIZE);
+        if (dir_block_append(&blk, ino, name, len)) {
+            fs_cache_write(lba, &blk);
+            break;
+        }
+        if (fs_dir_grow(dir_ino, dir) != 0) {
+            printf("Directory full\n");
+            return -1;
+        }
+    }
+    dir->size++;
+    fs_inode_write(dir_ino, dir);
+    return 0;
+}
+
+static void fs_dir_remove(uint32_t dir_ino, FileEntry *dir, const char *name) {
+    uint32_t len = strlen(name);
+    uint32_t lba = fs_dir_bucket(dir, name, len);
+    DirBlock blk;
+    memcpy(&blk, fs_cache_read(lba), SECTOR_SIZE);
+    for (uint32_t off = 0; off < blk.used; off += dir_record_size(blk.records + off)) {
+        uint8_t *rec = blk.records + off;
+        if (dir_record_matches(rec, name, len)) {
+            uint32_t rec_size = dir_record_size(rec);
+            memmove(rec, rec + rec_size, blk.used - off - rec_size);
+            blk.used -= rec_size;
+            blk.count--;
+            fs_cache_write(lba, &blk);
+            dir->size--;
+            fs_inode_write(dir_ino, dir);
+            return;
+        }
+    }
+}
+
+// --------------- Path resolution ------------------
+
+typedef struct {
+    uint8_t valid;
+    uint32_t parent;
+    uint32_t inode;
+    char name[MAX_FILENAME];
+} Dentry;
+
+Dentry fs_dcache[FS_DCACHE_SIZE];
+
+static Dentry *fs_dcache_slot(uint32_t parent, const char *name) {
+    uint32_t hash = fs_name_hash(name, strlen(name)) ^ (parent * 2654435761u);
+    return &fs_dcache[hash % FS_DCACHE_SIZE];
+}
+
+static void fs_dcache_forget(uint32_t parent, const char *name) {
+    Dentry *d = fs_dcache_slot(parent, name);
+    if (d->valid && d->parent == parent && strcmp(d->name, name) == 0) d->valid = 0;
+}
+
+uint32_t fs_lookup(uint32_t dir_ino, const char *name) {
+    if (strcmp(name, ".") == 0) return dir_ino;
+
+    FileEntry dir;
+    fs_inode_read(dir_ino, &dir);
+    if (strcmp(name, "..") == 0) return dir.parent;
+
+    Dentry *d = fs_dcache_slot(dir_ino, name);
+    if (d->valid && d->parent == dir_ino && strcmp(d->name, name) == 0) {
+        return d->inode;
+    }
+
+    uint32_t ino = fs_dir_find(&dir, name);
+    if (ino != FS_NO_INODE) {
+        d->valid = 1;
+        d->parent = dir_ino;
+        d->inode = ino;
+        strcpy(d->name, name);
+    }
+    return ino;
+}
+
+// Walks `path` component by component, starting at / or the working
+// directory. Every component but the last must be a directory.
+uint32_t fs_resolve(const char *path) {
+    if (fs_total_sectors == 0) {
+        printf("Filesystem not initialized!\n");
+        return FS_NO_INODE;
+    }
+
+    uint32_t ino = (path[0] == '/') ? FS_ROOT_INODE : fs_cwd;
+    char name[MAX_FILENAME];
+    FileEntry fe;
+
+    while (*path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+
+        uint32_t len = 0;
+        while (path[len] && path[len] != '/') len++;
+        if (len >= MAX_FILENAME) return FS_NO_INODE;
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+
+        fs_inode_read(ino, &fe);
+        if (fe.type != FS_TYPE_DIR) return FS_NO_INODE;
+        ino = fs_lookup(ino, name);
+        if (ino == FS_NO_INODE) return FS_NO_INODE;
+    }
+    return ino;
+}
+
+// Resolves everything before the last component of `path` and copies
+// that component into `leaf`.
+static uint32_t fs_resolve_parent(const char *path, char *leaf) {
+    char dir_path[FS_MAX_PATH];
+    uint32_t len = strlen(path);
+
+    while (len > 1 && path[len - 1] == '/') len--;
+    if (len >= FS_MAX_PATH) return FS_NO_INODE;
+
+    uint32_t start = len;
+    while (start > 0 && path[start - 1] != '/') start--;
+    if (len - start == 0 || len - start >= MAX_FILENAME) return FS_NO_INODE;
+
+    memcpy(leaf, path + start, len - start);
+    leaf[len - start] = '\0';
+    if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) return FS_NO_INODE;
+
+    memcpy(dir_path, path, start);
+    dir_path[start] = '\0';
+
+    uint32_t dir_ino = fs_resolve(dir_path);
+    if (dir_ino == FS_NO_INODE) return FS_NO_INODE;
+
+    FileEntry dir;
+    fs_inode_read(dir_ino, &dir);
+    return dir.type == FS_TYPE_DIR ? dir_ino : FS_NO_INODE;
+}
+
+// --------------- File descriptors -----------------
+// Descriptors 0-2 are the console; fs descriptors start at FS_FIRST_FD.
+// Every call re-reads the FileEntry, so edits made by path are seen.
+
+typedef struct {
+    uint8_t in_use;
+    uint8_t mount;          // FS_ON_DISK, or FS_TMP_FILE / FS_INITRD with a file index as inode
+    uint32_t flags;
+    uint32_t inode;
+    uint32_t offset;
+    ReadAhead ra;
+} OpenFile;
+
+OpenFile fs_open_files[FS_MAX_OPEN];
+
+static OpenFile *fs_fd(int fd) {
+    if (fd < FS_FIRST_FD || fd >= FS_FIRST_FD + FS_MAX_OPEN) return NULL;
+    OpenFile *of = &fs_open_files[fd - FS_FIRST_FD];
+    return of->in_use ? of : NULL;
+}
+
+static int fs_is_open(uint32_t ino) {
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        if (fs_open_files[i].in_use && fs_open_files[i].mount == FS_ON_DISK && fs_open_files[i].inode == ino) return 1;
+    }
+    return 0;
+}
+
+// --------------- Mounts ---------------------------
+// tmpfs is mounted at /tmp and the boot initramfs, read-only, at
+// /initrd, over whatever the disk has there. Paths are made absolute
+// lexically before they are matched. tmpfs has no subdirectories.
+
+// Lexically applies `path` to the absolute path in `base`, which is
+// enough since there are no links.
+static void fs_path_apply(char *base, const char *path) {
+    if (path[0] == '/') strcpy(base, "/");
+    while (*path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+        uint32_t len = 0;
+        while (path[len] && path[len] != '/') len++;
+
+        if (len == 2 && path[0] == '.' && path[1] == '.') {
+            char *slash = strrchr(base, '/');
+            if (slash == base) base[1] = '\0';
+            else *slash = '\0';
+        } else if (!(len == 1 && path[0] == '.')) {
+            uint32_t cur = strlen(base);
+            if (cur + len + 2 > FS_MAX_PATH) return;
+            if (cur > 1) base[cur++] = '/';
+            memcpy(base + cur, path, len);
+            base[cur + len] = '\0';
+        }
+        path += len;
+    }
+}
+
+// Copies what follows `mount` in the absolute path `full` into `leaf`.
+// Returns 0 when `full` is neither `mount` nor below it.
+static int fs_path_below(const char *full, const char *mount, char *leaf) {
+    uint32_t n = strlen(mount);
+    if (strncmp(full, mount, n) != 0 || (full[n] != '\0' && full[n] != '/')) return 0;
+    strcpy(leaf, full[n] ? full + n + 1 : "");
+    return 1;
+}
+
+// Says where `path` lives. For FS_TMP_FILE `leaf` is the tmpfs name,
+// for FS_INITRD the path inside the archive ("" for its root).
+static int fs_mount_path(const char *path, char *leaf) {
+    char full[FS_MAX_PATH];
+    strcpy(full, fs_cwd_path);
+    fs_path_apply(full, path);
+
+    if (initrd_mounted && fs_path_below(full, FS_INITRD_MOUNT, leaf)) return FS_INITRD;
+    if (!fs_path_below(full, FS_TMP_MOUNT, leaf)) return FS_ON_DISK;
+    return leaf[0] ? FS_TMP_FILE : FS_TMP_ROOT;
+}
+
+// FS_TYPE_FILE or FS_TYPE_DIR for a path inside the initramfs, 0 when
+// there is nothing there.
+static int fs_initrd_type(const char *leaf) {
+    if (leaf[0] == '\0') return FS_TYPE_DIR;
+    const InitrdFile *f = initrd_find(leaf);
+    if (!f) return 0;
+    return initrd_is_dir(f) ? FS_TYPE_DIR : FS_TYPE_FILE;
+}
+
+// Looks up a tmpfs file by name and complains when there is none.
+static int fs_tmp_find(const char *leaf) {
+    int index = tmpfs_find(leaf);
+    if (index == -1) printf("File not found\n");
+    return index;
+}
+
+static int fs_tmp_create(const char *leaf, const uint8_t *data, uint32_t size) {
+    int index = tmpfs_create(leaf);
+    if (index == -1) return -1;
+    if (size > 0 && tmpfs_write_at(tmpfs_file(index), 0, data, size) < 0) {
+        tmpfs_delete(index);
+        return -1;
+    }
+    return 0;
+}
+
+static int fs_tmp_delete(const char *leaf) {
+    int index = fs_tmp_find(leaf);
+    if (index == -1) return -1;
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        if (fs_open_files[i].in_use && fs_open_files[i].mount == FS_TMP_FILE && fs_open_files[i].inode == (uint32_t)index) {
+            printf("File is open\n");
+            return -1;
+        }
+    }
+    tmpfs_delete(index);
+    return 0;
+}
+
+static int fs_tmp_edit(const char *leaf, const uint8_t *data, uint32_t new_size) {
+    TmpFile *f = tmpfs_file(fs_tmp_find(leaf));
+    if (!f || tmpfs_truncate(f, new_size) != 0) return -1;
+    return tmpfs_write_at(f, 0, data, new_size) < 0 ? -1 : 0;
+}
+
+// Size of the file behind an open descriptor.
+static uint32_t fs_fd_size(OpenFile *of) {
+    if (of->mount == FS_TMP_FILE) return tmpfs_files[of->inode].size;
+    if (of->mount == FS_INITRD) return initrd_files[of->inode].size;
+    FileEntry fe;
+    fs_inode_read(of->inode, &fe);
+    return fe.size;
+}
+
+// --------------- Compression ----------------------
+// A compressed file holds an index of chunk end offsets (bytes from the
+// end of the index), then the LZ4-packed chunks back to back. A chunk
+// that does not shrink is stored as is, so its stored length equals its
+// raw length. Files are only compressed when written whole and that
+// saves sectors; edits never change a file's representation.
+
+uint8_t fs_cz_raw[FS_CZ_CHUNK];
+uint8_t fs_cz_packed[FS_CZ_CHUNK];
+// fs_cz_raw holds a chunk of the file with inode fs_cz_cached_ino and
+// extent start fs_cz_cached_file; 0 there means nothing is cached.
+uint32_t fs_cz_cached_file = 0;
+uint32_t fs_cz_cached_ino;
+uint32_t fs_cz_cached_chunk;
+
+static inline int fs_cz_is_cached(uint32_t ino, const FileEntry *fe, uint32_t chunk) {
+    return fs_cz_cached_file == fe->first_sector && fs_cz_cached_ino == ino && fs_cz_cached_chunk == chunk;
+}
+
+static inline uint32_t fs_cz_chunks(uint32_t size) {
+    return (size + FS_CZ_CHUNK - 1) / FS_CZ_CHUNK;
+}
+
+static inline uint32_t fs_cz_index_sectors(uint32_t size) {
+    return (fs_cz_chunks(size) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+static inline uint32_t fs_cz_chunk_size(uint32_t size, uint32_t chunk) {
+    uint32_t left = size - chunk * FS_CZ_CHUNK;
+    return left < FS_CZ_CHUNK ? left : FS_CZ_CHUNK;
+}
+
+// Returns the bytes to store for a raw chunk, packed or raw.
+static const uint8_t *fs_cz_pack_raw(const uint8_t *raw, uint32_t raw_len, uint32_t *len) {
+    *len = lz4_compress(raw, raw_len, fs_cz_packed, raw_len - 1);
+    if (*len == 0) {
+        *len = raw_len;
+        return raw;
+    }
+    return fs_cz_packed;
+}
+
+static const uint8_t *fs_cz_pack(const uint8_t *data, uint32_t size, uint32_t chunk, uint32_t *len) {
+    return fs_cz_pack_raw(data + chunk * FS_CZ_CHUNK, fs_cz_chunk_size(size, chunk), len);
+}
+
+// Packed bytes on their way to disk, a sector at a time. Sectors in
+// [live, live + live_count) belong to the committed file and are
+// overwritten through the journal.
+typedef struct {
+    uint32_t lba;
+    uint32_t used;
+    uint32_t live;
+    uint32_t live_count;
+    uint8_t sector[SECTOR_SIZE];
+} CzStream;
+
+static void fs_cz_put(const CzStream *out, uint32_t lba, const uint8_t *data) {
+    if (lba - out->live < out->live_count) fs_data_overwrite(lba, data);
+    else fs_data_write(lba, data);
+}
+
+static void fs_cz_emit(CzStream *out, const uint8_t *bytes, uint32_t len) {
+    for (uint32_t done = 0; done < len;) {
+        uint32_t n = SECTOR_SIZE - out->used < len - done ? SECTOR_SIZE - out->used : len - done;
+        memcpy(out->sector + out->used, bytes + done, n);
+        out->used += n;
+        done += n;
+        if (out->used == SECTOR_SIZE) {
+            fs_cz_put(out, out->lba++, out->sector);
+            out->used = 0;
+        }
+    }
+}
+
+static void fs_cz_emit_end(CzStream *out) {
+    if (out->used == 0) return;
+    memset(out->sector + out->used, 0, SECTOR_SIZE - out->used);
+    fs_cz_put(out, out->lba, out->sector);
+    out->used = 0;
+}
+
+// Stores `data` compressed in a new extent. Returns 1 without writing
+// anything when compression would not save a sector.
+static int fs_cz_write(FileEntry *fe, const uint8_t *data, uint32_t size) {
+    uint8_t index[SECTOR_SIZE];
+    uint32_t chunks = fs_cz_chunks(size);
+    uint32_t index_sectors = fs_cz_index_sectors(size);
+
+    // Sizing pass: CPU is cheap next to PIO, so this beats writing
+    // incompressible data twice.
+    uint32_t total = 0, len;
+    for (uint32_t i = 0; i < chunks; i++) {
+        fs_cz_pack(data, size, i, &len);
+        total += len;
+    }
+    uint32_t num_sectors = index_sectors + (total + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (num_sectors >= (size + SECTOR_SIZE - 1) / SECTOR_SIZE) return 1;
+    uint32_t first = fs_alloc_extent(num_sectors);
+    if (first == 0) return 1;
+
+    uint32_t *entries = (uint32_t *)index;
+    CzStream out = { first + index_sectors, 0, 0, 0, {0} };
+    total = 0;
+    memset(index, 0, SECTOR_SIZE);
+    for (uint32_t i = 0; i < chunks; i++) {
+        const uint8_t *packed = fs_cz_pack(data, size, i, &len);
+        fs_cz_emit(&out, packed, len);
+        total += len;
+        entries[i % (SECTOR_SIZE / 4)] = total;
+        if ((i + 1) % (SECTOR_SIZE / 4) == 0 || i + 1 == chunks) {
+            fs_data_write(first + i / (SECTOR_SIZE / 4), index);
+            memset(index, 0, SECTOR_SIZE);
+        }
+    }
+    fs_cz_emit_end(&out);
+
+    fe->first_sector = first;
+    fe->num_sectors = num_sectors;
+    fe->size = size;
+    fe->flags |= FS_FILE_COMPRESSED;
+    fs_cz_cached_file = 0;
+    return 0;
+}
+
+// Unpacks `chunk`, stored at [start, end) past the index, into
+// fs_cz_raw and returns its length, or -1.
+static int fs_cz_load_at(ReadAhead *ra, uint32_t ino, const FileEntry *fe, uint32_t chunk,
+                         uint32_t start, uint32_t end) {
+    uint8_t sector_buffer[SECTOR_SIZE];
+    uint32_t raw_len = fs_cz_chunk_size(fe->size, chunk);
+    if (fs_cz_is_cached(ino, fe, chunk)) return raw_len;
+    if (end < start || end - start > raw_len) return -1;
+
+    uint8_t *dst = end - start == raw_len ? fs_cz_raw : fs_cz_packed;
+    uint32_t index_end = fe->first_sector + fs_cz_index_sectors(fe->size);
+    uint32_t file_end = fe->first_sector + fe->num_sectors;
+    for (uint32_t pos = start; pos < end;) {
+        uint32_t in_sector = pos % SECTOR_SIZE;
+        uint32_t n = SECTOR_SIZE - in_sector < end - pos ? SECTOR_SIZE - in_sector : end - pos;
+        fs_data_read(ra, index_end + pos / SECTOR_SIZE, file_end, sector_buffer);
+        memcpy(dst + pos - start, sector_buffer + in_sector, n);
+        pos += n;
+    }
+    if (dst == fs_cz_packed && lz4_decompress(fs_cz_packed, end - start, fs_cz_raw, raw_len) != (int)raw_len) {
+        return -1;
+    }
+    fs_cz_cached_file = fe->first_sector;
+    fs_cz_cached_ino = ino;
+    fs_cz_cached_chunk = chunk;
+    return raw_len;
+}
+
+// Chunk end offsets of a file's index, read a sector at a time.
+typedef struct {
+    const FileEntry *fe;
+    ReadAhead ra;
+    uint32_t sector;        // index sector held in `entries`
+    uint32_t entries[SECTOR_SIZE / 4];
+} CzIndex;
+
+static uint32_t fs_cz_end(CzIndex *ix, uint32_t chunk) {
+    uint32_t sector = chunk / (SECTOR_SIZE / 4);
+    if (sector != ix->sector) {
+        const FileEntry *fe = ix->fe;
+        fs_data_read(&ix->ra, fe->first_sector + sector, fe->first_sector + fs_cz_index_sectors(fe->size),
+                     (uint8_t *)ix->entries);
+        ix->sector = sector;
+    }
+    return ix->entries[chunk % (SECTOR_SIZE / 4)];
+}
+
+static inline uint32_t fs_cz_start(CzIndex *ix, uint32_t chunk) {
+    return chunk ? fs_cz_end(ix, chunk - 1) : 0;
+}
+
+static int fs_cz_load(ReadAhead *ra, uint32_t ino, const FileEntry *fe, uint32_t chunk) {
+    if (fs_cz_is_cached(ino, fe, chunk)) return fs_cz_chunk_size(fe->size, chunk);
+    CzIndex ix = { fe, {0}, 0xFFFFFFFF, {0} };
+    return fs_cz_load_at(ra, ino, fe, chunk, fs_cz_start(&ix, chunk), fs_cz_end(&ix, chunk));
+}
+
+static uint32_t fs_cz_read_at(ReadAhead *ra, uint32_t ino, const FileEntry *fe, uint32_t offset, uint8_t *buffer, uint32_t count) {
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pos = offset + done;
+        uint32_t chunk = pos / FS_CZ_CHUNK;
+        uint32_t in_chunk = pos % FS_CZ_CHUNK;
+        int len = fs_cz_load(ra, ino, fe, chunk);
+        if (len < 0) {
+            printf("Corrupt compressed chunk %d\n", chunk);
+            break;
+        }
+        uint32_t n = len - in_chunk < count - done ? len - in_chunk : count - done;
+        memcpy(buffer + done, fs_cz_raw + in_chunk, n);
+        done += n;
+    }
+    return done;
+}
+
+// New contents of a compressed file: the old ones with `data` laid over
+// them at `offset`, then cut or zero-filled to `size`.
+typedef struct {
+    uint32_t offset;
+    const uint8_t *data;
+    uint32_t count;
+    uint32_t size;
+} CzPatch;
+
+uint8_t fs_cz_new[FS_CZ_CHUNK];
+
+// Builds `chunk` of the patched file in fs_cz_new and returns its
+// length, or -1 when the old chunk, stored at [start, end), is corrupt.
+// With `same`, also reports whether the chunk is unchanged.
+static int fs_cz_patch_chunk(ReadAhead *ra, uint32_t ino, const FileEntry *fe, const CzPatch *p, uint32_t chunk,
+                             uint32_t start, uint32_t end, int *same) {
+    uint32_t base = chunk * FS_CZ_CHUNK;
+    uint32_t len = fs_cz_chunk_size(p->size, chunk);
+    int covered = p->offset <= base && p->offset + p->count >= base + len;
+    int old_len = 0;
+    if (base < fe->size && (same || !covered)) {
+        old_len = fs_cz_load_at(ra, ino, fe, chunk, start, end);
+        if (old_len < 0) return -1;
+    }
+
+    memset(fs_cz_new, 0, len);
+    memcpy(fs_cz_new, fs_cz_raw, (uint32_t)old_len < len ? (uint32_t)old_len : len);
+    uint32_t from = p->offset > base ? p->offset : base;
+    uint32_t to = p->offset + p->count < base + len ? p->offset + p->count : base + len;
+    if (from < to) memcpy(fs_cz_new + from - base, p->data + from - p->offset, to - from);
+    if (same) *same = (uint32_t)old_len == len && memcmp(fs_cz_new, fs_cz_raw, len) == 0;
+    return len;
+}
+
+// Applies `p` to a compressed file, which stays compressed. Only chunks
+// whose contents change are repacked; the packed bytes before them stay
+// where they are and those after them are copied. That happens in place
+// when the extent can hold the result and no chunk grows over packed
+// bytes still to be read, and into a new extent otherwise.
+static int fs_cz_update(uint32_t ino, FileEntry *fe, const CzPatch *p) {
+    const uint32_t per_sector = SECTOR_SIZE / 4;
+    uint8_t sector_buffer[SECTOR_SIZE];
+    uint32_t index[SECTOR_SIZE / 4];
+
+    if (p->size == 0) {
+        if (fs_journal_reserve(fs_bitmap_blocks(fe->num_sectors) + FS_JOURNAL_RESERVE) != 0) return -1;
+        fs_free_extent(fe->first_sector, fe->num_sectors);
+        fe->first_sector = 0;
+        fe->num_sectors = 0;
+        fe->size = 0;
+        fe->flags &= ~FS_FILE_COMPRESSED;
+        fs_inode_write(ino, fe);
+        fs_cz_cached_file = 0;
+        return 0;
+    }
+
+    uint32_t old_chunks = fs_cz_chunks(fe->size);
+    uint32_t new_chunks = fs_cz_chunks(p->size);
+    uint32_t old_index = fs_cz_index_sectors(fe->size);
+    uint32_t new_index = fs_cz_index_sectors(p->size);
+    CzIndex ix = { fe, {0}, 0xFFFFFFFF, {0} };
+    ReadAhead ra = {0};
+    int same, len;
+
+    // Narrow [k, m) down to the chunks whose contents change.
+    uint32_t low = p->offset < fe->size ? p->offset : fe->size;
+    if (p->size < low) low = p->size;
+    uint32_t high = p->offset + p->count < p->size ? p->offset + p->count : p->size;
+    if (p->size != fe->size) high = p->size;
+    uint32_t k = low / FS_CZ_CHUNK;
+    uint32_t m = high ? (high - 1) / FS_CZ_CHUNK + 1 : 0;
+    while (k < m) {
+        uint32_t start = k < old_chunks ? fs_cz_start(&ix, k) : 0;
+        uint32_t end = k < old_chunks ? fs_cz_end(&ix, k) : 0;
+        if ((len = fs_cz_patch_chunk(&ra, ino, fe, p, k, start, end, &same)) < 0) goto corrupt;
+        if (!same) break;
+        k++;
+    }
+    while (m > k) {
+        uint32_t start = m - 1 < old_chunks ? fs_cz_start(&ix, m - 1) : 0;
+        uint32_t end = m - 1 < old_chunks ? fs_cz_end(&ix, m - 1) : 0;
+        if ((len = fs_cz_patch_chunk(&ra, ino, fe, p, m - 1, start, end, &same)) < 0) goto corrupt;
+        if (!same) break;
+        m--;
+    }
+    if (k == m) {
+        if (p->size == fe->size) return 0;
+        k = m = new_chunks;         // only chunks past the new end go
+    }
+
+    // Sizing pass.
+    uint32_t start = k ? fs_cz_end(&ix, k - 1) : 0;
+    uint32_t pos = start, packed_len;
+    int in_place = new_index == old_index;
+    for (uint32_t i = k; i < m; i++) {
+        uint32_t old_start = i < old_chunks ? fs_cz_start(&ix, i) : 0;
+        uint32_t old_end = i < old_chunks ? fs_cz_end(&ix, i) : 0;
+        if ((len = fs_cz_patch_chunk(&ra, ino, fe, p, i, old_start, old_end, NULL)) < 0) goto corrupt;
+        fs_cz_pack_raw(fs_cz_new, len, &packed_len);
+        pos += packed_len;
+        if (i + 1 < old_chunks && pos > old_end) in_place = 0;
+    }
+    uint32_t total = pos;
+    if (m < new_chunks) total += fs_cz_end(&ix, new_chunks - 1) - fs_cz_end(&ix, m - 1);
+    uint32_t num_sectors = new_index + (total + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+    // In place, every live sector from chunk k on is logged. When that
+    // cannot fit one transaction the file moves instead.
+    uint32_t need = fs_bitmap_blocks(num_sectors) + fs_bitmap_blocks(fe->num_sectors) + FS_JOURNAL_RESERVE;
+    if (in_place) {
+        uint32_t live = fe->num_sectors - k / per_sector - start / SECTOR_SIZE;
+        if (need + live + live / FS_CSUMS_PER_SECTOR <= FS_JOURNAL_MAX_BLOCKS) need += live + live / FS_CSUMS_PER_SECTOR;
+        else in_place = 0;
+    }
+    if (fs_journal_reserve(need) != 0) return -1;
+
+    uint32_t first = fe->first_sector;
+    if (in_place && num_sectors > fe->num_sectors && !fs_extend_extent(first, fe->num_sectors, num_sectors)) {
+        in_place = 0;
+    }
+    if (!in_place) {
+        first = fs_alloc_extent(num_sectors);
+        if (first == 0) {
+            printf("Not enough free space\n");
+            return -1;
+        }
+    }
+
+    // Index sectors and packed bytes ahead of chunk k are already right
+    // in place, and copied as they are otherwise.
+    uint32_t old_data = fe->first_sector + old_index;
+    uint32_t old_data_end = fe->first_sector + fe->num_sectors;
+    CzStream out = { first + new_index + start / SECTOR_SIZE, 0, 0, 0, {0} };
+    if (in_place) {
+        out.live = fe->first_sector;
+        out.live_count = fe->num_sectors;
+    }
+    if (!in_place) {
+        for (uint32_t i = 0; i < k / per_sector; i++) {
+            fs_data_read(&ra, fe->first_sector + i, old_data, sector_buffer);
+            fs_data_write(first + i, sector_buffer);
+        }
+        for (uint32_t i = 0; i < start / SECTOR_SIZE; i++) {
+            fs_data_read(&ra, old_data + i, old_data_end, sector_buffer);
+            fs_data_write(first + new_index + i, sector_buffer);
+        }
+    }
+    if (start % SECTOR_SIZE) {
+        fs_data_read(&ra, old_data + start / SECTOR_SIZE, old_data_end, out.sector);
+        out.used = start % SECTOR_SIZE;
+    }
+
+    // Each index sector is rewritten once its chunks are out, so its old
+    // entries are still there to say where the old chunks are.
+    memset(index, 0, SECTOR_SIZE);
+    if (k / per_sector < old_index) {
+        fs_data_read(&ra, fe->first_sector + k / per_sector, old_data, (uint8_t *)index);
+    }
+    uint32_t old_start = start;
+    pos = start;
+    for (uint32_t i = k; i < new_chunks; i++) {
+        uint32_t old_end = i < old_chunks ? index[i % per_sector] : 0;
+        if (i < m) {
+            if ((len = fs_cz_patch_chunk(&ra, ino, fe, p, i, old_start, old_end, NULL)) < 0) {
+                if (!in_place) fs_free_extent(first, num_sectors);
+                goto corrupt;
+            }
+            const uint8_t *packed = fs_cz_pack_raw(fs_cz_new, len, &packed_len);
+            fs_cz_emit(&out, packed, packed_len);
+            pos += packed_len;
+        } else {
+            for (uint32_t at = old_start; at < old_end;) {
+                uint32_t in_sector = at % SECTOR_SIZE;
+                uint32_t n = SECTOR_SIZE - in_sector < old_end - at ? SECTOR_SIZE - in_sector : old_end - at;
+                fs_data_read(&ra, old_data + at / SECTOR_SIZE, old_data_end, sector_buffer);
+                fs_cz_emit(&out, sector_buffer + in_sector, n);
+                at += n;
+            }
+            pos += old_end - old_start;
+        }
+        index[i % per_sector] = pos;
+        old_start = old_end;
+
+        if ((i + 1) % per_sector == 0 || i + 1 == new_chunks) {
+            if (i + 1 == new_chunks) {
+                memset(index + new_chunks % per_sector, 0, (per_sector - 1 - i % per_sector) * 4);
+            }
+            fs_cz_put(&out, first + i / per_sector, (uint8_t *)index);
+            memset(index, 0, SECTOR_SIZE);
+            if ((i + 1) / per_sector < old_index) {
+                fs_data_read(&ra, fe->first_sector + (i + 1) / per_sector, old_data, (uint8_t *)index);
+            }
+        }
+    }
+    if (k < new_chunks) fs_cz_emit_end(&out);
+
+    if (!in_place) {
+        fs_free_extent(fe->first_sector, fe->num_sectors);
+    } else if (num_sectors < fe->num_sectors) {
+        fs_free_extent(first + num_sectors, fe->num_sectors - num_sectors);
+    }
+    fe->first_sector = first;
+    fe->num_sectors = num_sectors;
+    fe->size = p->size;
+    fs_inode_write(ino, fe);
+    fs_cz_cached_file = 0;
+    return 0;
+
+corrupt:
+    printf("Corrupt compressed file\n");
+    return -1;
+}
+
+// --------------- Defragmentation ------------------
+// Files are single extents, so fragmentation means free space split
+// into holes between extents. fs_defrag_step closes the first hole with
+// the extent right after it, or with the largest later extent that
+// fits; when none fits, the extent after the hole moves out of the way
+// to grow it. Each call does a bounded amount of work, so it can run
+// while the shell waits for keys. File data is copied FS_RA_MAX_WINDOW
+// sectors per step to sectors reserved in memory only; the FileEntry,
+// the reservation and the free of the old extent then commit together.
+// Until then a crash leaves the file where it was, and an aborted copy
+// just drops its reservation.
+
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+    uint32_t ino;
+} DefragExtent;
+
+DefragExtent fs_defrag_index[MAX_FILES];
+uint32_t fs_defrag_extents = 0;
+
+static void fs_defrag_index_build() {
+    FileEntry entries[FS_ENTRIES_PER_SECTOR];
+    fs_defrag_extents = 0;
+    for (uint32_t s = 0; s < FS_TABLE_SECTORS; s++) {
+        uint32_t base = s * FS_ENTRIES_PER_SECTOR;
+        int used = 0;
+        for (uint32_t i = 0; i < FS_ENTRIES_PER_SECTOR; i++) {
+            used |= fs_inode_bitmap[(base + i) >> 3] & (1 << ((base + i) & 7));
+        }
+        if (!used) continue;
+        fs_cache_peek(fs_layout.table + s, entries);
+        for (uint32_t i = 0; i < FS_ENTRIES_PER_SECTOR; i++) {
+            FileEntry *fe = &entries[i];
+            if (!fe->in_use || fe->num_sectors == 0 || (fe->flags & FS_FILE_INLINE)) continue;
+            DefragExtent *e = &fs_defrag_index[fs_defrag_extents++];
+            e->first = fe->first_sector;
+            e->count = fe->num_sectors;
+            e->ino = base + i;
+        }
+    }
+}
+
+static int fs_defrag_valid(const DefragExtent *e) {
+    FileEntry fe;
+    fs_inode_read(e->ino, &fe);
+    return fe.in_use && !(fe.flags & FS_FILE_INLINE) && fe.first_sector == e->first && fe.num_sectors == e->count;
+}
+
+static DefragExtent *fs_defrag_find(uint32_t first) {
+    for (uint32_t i = 0; i < fs_defrag_extents; i++) {
+        if (fs_defrag_index[i].first == first) return &fs_defrag_index[i];
+    }
+    return NULL;
+}
+
+// The extent starting at `next` when it fits the hole before it, else
+// the largest later extent that does. Extents too large to move in one
+// transaction stay where they are.
+static DefragExtent *fs_defrag_pick(uint32_t hole, uint32_t next) {
+    DefragExtent *best = NULL;
+    for (uint32_t i = 0; i < fs_defrag_extents; i++) {
+        DefragExtent *e = &fs_defrag_index[i];
+        if (e->first < next || e->count > next - hole || !fs_journal_can_move(e->count)) continue;
+        if (e->first == next) return e;
+        if (!best || e->count > best->count) best = e;
+    }
+    return best;
+}
+
+static void fs_defrag_abort() {
+    fs_journal_begin();
+    fs_journal_reserve(fs_bitmap_blocks(fs_defrag.count));
+    for (uint32_t lba = fs_defrag.to; lba < fs_defrag.to + fs_defrag.count; lba++) {
+        fs_bitmap_clear(lba);
+    }
+    // Another transaction may have logged the reserved bits meanwhile.
+    fs_bitmap_flush(fs_defrag.to, fs_defrag.count);
+    fs_journal_end();
+    fs_defrag.count = 0;
+    fs_defrag.restarts++;
+}
+
+// Points the FileEntry at the copy, unless the file changed under it.
+static void fs_defrag_finish() {
+    FileEntry fe;
+    fs_inode_read(fs_defrag.ino, &fe);
+    if (fs_defrag.stale || !fe.in_use || (fe.flags & FS_FILE_INLINE) ||
+        fe.first_sector != fs_defrag.from || fe.num_sectors != fs_defrag.count) {
+        fs_defrag_abort();
+        return;
+    }
+    fs_journal_begin();
+    fs_journal_reserve(2 * fs_bitmap_blocks(fs_defrag.count) + FS_JOURNAL_RESERVE);  // see fs_defrag_pick
+    fe.first_sector = fs_defrag.to;
+    fs_inode_write(fs_defrag.ino, &fe);
+    fs_bitmap_flush(fs_defrag.to, fs_defrag.count);
+    fs_free_extent(fs_defrag.from, fs_defrag.count);
+    fs_journal_end();
+
+    if (fs_cz_cached_file == fs_defrag.from || fs_cz_cached_file == fs_defrag.to) fs_cz_cached_file = 0;
+    DefragExtent *e = fs_defrag_find(fs_defrag.from);
+    if (e && e->ino == fs_defrag.ino) e->first = fs_defrag.to;
+    fs_defrag.moved++;
+    fs_defrag.count = 0;
+}
+
+static void fs_defrag_copy() {
+    if (fs_defrag.stale) {
+        fs_defrag_abort();
+        return;
+    }
+    uint32_t n = fs_defrag.count - fs_defrag.done;
+    if (n > FS_RA_MAX_WINDOW) n = FS_RA_MAX_WINDOW;
+    uint32_t from = fs_defrag.from + fs_defrag.done;
+    uint32_t to = fs_defrag.to + fs_defrag.done;
+
+    disk_read_sectors(from, n, fs_ra_buffer);
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t *logged = fs_journal_find(from + i);
+        if (logged) memcpy(fs_ra_buffer + i * SECTOR_SIZE, logged, SECTOR_SIZE);
+    }
+    fs_journal_begin();
+    disk_write_sectors(to, n, fs_ra_buffer);
+    for (uint32_t i = 0; i < n; i++) {
+        fs_csum_copy(from + i, to + i);
+    }
+    fs_journal_end();
+    fs_cache_invalidate(to, n);
+    fs_defrag.done += n;
+    fs_defrag.moved_sectors += n;
+    if (fs_defrag.done == fs_defrag.count) fs_defrag_finish();
+}
+
+static void fs_defrag_begin(const DefragExtent *e, uint32_t to) {
+    FileEntry fe;
+    fs_inode_read(e->ino, &fe);
+    for (uint32_t lba = to; lba < to + e->count; lba++) {
+        fs_bitmap_set(lba);
+    }
+    fs_defrag.ino = e->ino;
+    fs_defrag.from = e->first;
+    fs_defrag.to = to;
+    fs_defrag.count = e->count;
+    fs_defrag.done = 0;
+    fs_defrag.stale = 0;
+    if (fe.type != FS_TYPE_DIR) return;
+
+    // Buckets change through the journal, not fs_data_write, so a
+    // directory moves in one go.
+    uint8_t buffer[SECTOR_SIZE];
+    fs_journal_begin();
+    fs_journal_reserve(e->count / FS_CSUMS_PER_SECTOR + 2 * fs_bitmap_blocks(e->count) + FS_JOURNAL_RESERVE);
+    for (uint32_t b = 0; b < e->count; b++) {
+        memcpy(buffer, fs_cache_read(fs_defrag.from + b), SECTOR_SIZE);
+        fs_cache_write_new(to + b, buffer);
+    }
+    fs_defrag.done = fs_defrag.count;
+    fs_defrag.moved_sectors += fs_defrag.count;
+    fs_defrag_finish();
+    fs_journal_end();
+}
+
+// Prints how the free space is split: holes are free runs with
+// allocated sectors after them.
+void fs_frag_report() {
+    uint32_t holes = 0, hole_sectors = 0, largest = 0, free_sectors = 0, run = 0;
+    fs_sync();
+    for (uint32_t lba = fs_layout.data; lba < fs_total_sectors; lba++) {
+        if (!fs_bitmap_test(lba)) {
+            run++;
+            free_sectors++;
+            continue;
+        }
+        if (run) {
+            holes++;
+            hole_sectors += run;
+            if (run > largest) largest = run;
+        }
+        run = 0;
+    }
+    if (run > largest) largest = run;
+    printf("Fragmentation: %d holes (%d sectors) between extents, largest free run %d of %d free sectors\n",
+           holes, hole_sectors, largest, free_sectors);
+}
+
+int fs_defrag_start() {
+    if (fs_total_sectors == 0) {
+        printf("No file system mounted\n");
+        return -1;
+    }
+    if (fs_defrag.active) {
+        printf("Defrag is already running\n");
+        return -1;
+    }
+    fs_sync();
+    fs_defrag_index_build();
+    memset(&fs_defrag, 0, sizeof(Defrag));
+    fs_defrag.active = 1;
+    fs_defrag.cursor = fs_layout.data;
+    return 0;
+}
+
+void fs_defrag_stop() {
+    if (fs_defrag.count) fs_defrag_abort();
+    fs_defrag.active = 0;
+}
+
+// Does one bounded piece of work; returns 0 once there is none left.
+int fs_defrag_step() {
+    fs_trace_enter(TRACE_CALL_DEFRAG);
+    if (!fs_defrag.active) return 0;
+    if (fs_defrag.count) {
+        fs_defrag_copy();
+        return 1;
+    }
+    // Extents freed by earlier moves only become holes at commit.
+    if (fs_journal_nfrees) fs_sync();
+
+    uint32_t hole = fs_defrag.cursor;
+    while (hole < fs_total_sectors && fs_bitmap_test(hole)) hole++;
+    uint32_t next = hole;
+    while (next < fs_total_sectors && !fs_bitmap_test(next)) next++;
+    if (next >= fs_total_sectors) {
+        fs_defrag.active = 0;
+        return 0;
+    }
+    fs_defrag.cursor = hole;
+
+    DefragExtent *e = fs_defrag_pick(hole, next);
+    DefragExtent *after = fs_defrag_find(next);
+    if (e ? !fs_defrag_valid(e) : !after || !fs_defrag_valid(after)) {
+        // Files changed since the index was built.
+        fs_defrag_index_build();
+        e = fs_defrag_pick(hole, next);
+        after = fs_defrag_find(next);
+    }
+    if (e) {
+        fs_defrag_begin(e, hole);
+        return 1;
+    }
+    uint32_t to = after && fs_journal_can_move(after->count) ? fs_find_extent(after->count) : 0;
+    if (to) fs_defrag_begin(after, to);
+    else fs_defrag.cursor = next;
+    return 1;
+}
+
+void fs_defrag_report() {
+    printf("Defrag %s: %d extents moved (%d sectors copied), %d restarted\n",
+           fs_defrag.active ? "running" : "idle", fs_defrag.moved, fs_defrag.moved_sectors,
+           fs_defrag.restarts);
+    fs_frag_report();
+}
+
+// --------------- File system ----------------------
+
+// Drops everything cached from the device, including the running
+// transaction.
+static void fs_forget() {
+    memset(fs_meta_slots, 0, sizeof(fs_meta_slots));
+    memset(fs_data_slots, 0, sizeof(fs_data_slots));
+    memset(fs_csum_slots, 0, sizeof(fs_csum_slots));
+    memset(fs_dcache, 0, sizeof(fs_dcache));
+    memset(fs_reservations, 0, sizeof(fs_reservations));
+    fs_cz_cached_file = 0;
+    fs_journal_count = 0;
+    fs_journal_nfrees = 0;
+    fs_journal_nallocs = 0;
+}
+
+void fs_format(uint32_t total_sectors) {
+    if (total_sectors > FS_MAX_SECTORS) total_sectors = FS_MAX_SECTORS;
+
+    fs_forget();
+    memset(&fs_sb, 0, sizeof(SuperBlock));
+    memcpy(fs_sb.magic, FS_MAGIC, 4);
+    fs_sb.version = FS_VERSION;
+    fs_layout_size(&fs_sb, total_sectors);
+    if (fs_layout_load(&fs_sb, &fs_layout) != 0) {
+        printf("Disk too small for a file system\n");
+        fs_total_sectors = 0;
+        return;
+    }
+    fs_journal_clear(fs_journal_seq);
+
+    memset(fs_bitmap, 0, sizeof(fs_bitmap));
+    for (uint32_t lba = 0; lba < fs_layout.data; lba++) {
+        fs_bitmap_set(lba);
+    }
+    fs_total_sectors = total_sectors;
+    for (uint32_t s = 0; s < fs_layout.bitmap_sectors; s++) {
+        disk_write_sector(FS_BITMAP_SECTOR + s, fs_bitmap + s * SECTOR_SIZE);
+    }
+
+    memset(fs_inode_bitmap, 0, sizeof(fs_inode_bitmap));
+    for (uint32_t s = 0; s < FS_INODE_BITMAP_SECTORS; s++) {
+        disk_write_sector(FS_INODE_BITMAP_SECTOR + s, fs_inode_bitmap + s * SECTOR_SIZE);
+    }
+    fs_inode_hint = 0;
+
+    fs_sb.max_files = MAX_FILES;
+    fs_sb.root = fs_inode_alloc();
+
+    DirBlock empty;
+    memset(&empty, 0, SECTOR_SIZE);
+    FileEntry root;
+    memset(&root, 0, sizeof(FileEntry));
+    root.first_sector = fs_alloc_extent(1);
+    root.num_sectors = 1;
+    root.parent = fs_sb.root;
+    root.in_use = 1;
+    root.type = FS_TYPE_DIR;
+    fs_cache_write_new(root.first_sector, &empty);
+    fs_inode_write(fs_sb.root, &root);
+
+    fs_sb.num_files = 1;
+    fs_sb_flush();
+    fs_journal_commit();
+    fs_cwd = FS_ROOT_INODE;
+    strcpy(fs_cwd_path, "/");
+}
+
+int fs_init() {
+    uint8_t buffer[SECTOR_SIZE];
+    crc32c_init();
+
+    // The journal sits after the bitmap, so the superblock comes first.
+    // Replay can rewrite it, hence the second read.
+    int check = -1;
+    for (int pass = 0; pass < 2; pass++) {
+        disk_read_sector(FS_SUPERBLOCK_SECTOR, buffer);
+        memcpy(&fs_sb, buffer, sizeof(SuperBlock));
+        check = fs_sb_check(&fs_sb);
+        if (check != 0) break;
+        if (fs_layout_load(&fs_sb, &fs_layout) != 0) {
+            printf("File system layout does not cover its %d sectors, not mounted\n", fs_sb.total_sectors);
+            return 0;
+        }
+        if (fs_layout.bitmap_sectors > FS_BITMAP_MAX_SECTORS) {
+            printf("File system of %d sectors is too large, not mounted\n", fs_sb.total_sectors);
+            return 0;
+        }
+        if (pass > 0 || fs_journal_replay() == 0) break;
+        printf("Replayed journal\n");
+    }
+
+    // The bitmap covers at most FS_MAX_SECTORS, whatever the disk size.
+    uint32_t capacity = disk_dev->sectors > FS_MAX_SECTORS ? FS_MAX_SECTORS : disk_dev->sectors;
+    if (check == -2) {
+        printf("File system version %d is newer than %d, not mounted\n", fs_sb.version, FS_VERSION);
+        return 0;
+    }
+    if (fs_sb.num_files > MAX_FILES) {  
+        fs_format(capacity ? capacity : FS_DEFAULT_SECTORS);
+        return 1;
+    }
+    if (check == 0) {
+        // fs_layout_load filled in the sizes an older superblock left
+        // out; the next superblock write records them.
+        fs_sb.version = FS_VERSION;
+        uint32_t total = fs_sb.total_sectors;
+        if (capacity && total > capacity) {
+            printf("File system is larger than the disk, using %d sectors\n", capacity);
+            total = capacity;
+        }
+        fs_bitmap_load(total);
+        for (uint32_t s = 0; s < FS_INODE_BITMAP_SECTORS; s++) {
+            disk_read_sector(FS_INODE_BITMAP_SECTOR + s, fs_inode_bitmap + s * SECTOR_SIZE);
+        }
+    }
+    return 0;
+}
+
+// Moves the file system to another block device, writing back the old
+// one first. A RAM disk without a file system gets a fresh one. /tmp and
+// /initrd are not affected.
+int fs_mount(BlockDevice *dev) {
+    fs_trace_enter(TRACE_CALL_MOUNT);
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        if (fs_open_files[i].in_use && fs_open_files[i].mount == FS_ON_DISK) {
+            printf("Close all files first\n");
+            return -1;
+        }
+    }
+    if (fs_total_sectors != 0) {
+        fs_defrag_stop();
+        fs_sync();
+        disk_flush();
+    }
+
+    fs_forget();
+    fs_total_sectors = 0;
+    fs_inode_hint = 0;
+    fs_cwd = FS_ROOT_INODE;
+    strcpy(fs_cwd_path, "/");
+    disk_dev = dev;
+
+    int ret = fs_init();
+    if (fs_total_sectors == 0 && dev->ram) {
+        fs_format(dev->sectors);
+        ret = 1;
+    }
+    printf("Mounted %s%s\n", dev->name, fs_total_sectors ? "" : " (no file system)");
+    return ret;
+}
+
+// Streams one bucket at a time, so memory use does not grow with the
+// size of the directory.
+void fs_list_files(const char *path) {
+    fs_trace_enter(TRACE_CALL_LOOKUP);
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(path, leaf);
+    if (mount == FS_TMP_ROOT) {
+        tmpfs_list();
+        return;
+    }
+    if (mount == FS_TMP_FILE) {
+        printf(tmpfs_find(leaf) == -1 ? "Directory not found\n" : "Not a directory\n");
+        return;
+    }
+    if (mount == FS_INITRD) {
+        int type = fs_initrd_type(leaf);
+        if (type == FS_TYPE_DIR) initrd_list(leaf);
+        else printf(type ? "Not a directory\n" : "Directory not found\n");
+        return;
+    }
+
+    uint32_t dir_ino = fs_resolve(path);
+    if (dir_ino == FS_NO_INODE) {
+        printf("Directory not found\n");
+        return;
+    }
+
+    FileEntry dir, fe;
+    fs_inode_read(dir_ino, &dir);
+    if (dir.type != FS_TYPE_DIR) {
+        printf("Not a directory\n");
+        return;
+    }
+
+    printf("Entries: %d\n", dir.size);
+    DirBlock blk;
+    char name[MAX_FILENAME];
+    for (uint32_t b = 0; b < dir.num_sectors; b++) {
+        fs_cache_peek(dir.first_sector + b, &blk);
+        for (uint32_t off = 0; off < blk.used; off += dir_record_size(blk.records + off)) {
+            uint8_t *rec = blk.records + off;
+            memcpy(name, rec + DIR_RECORD_HEADER, rec[4]);
+            name[rec[4]] = '\0';
+            fs_inode_read(dir_record_inode(rec), &fe);
+            if (fe.type == FS_TYPE_DIR) {
+                printf("%s/\n", name);
+            } else if (fe.flags & FS_FILE_COMPRESSED) {
+                printf("%s - %d bytes (%d sectors, lz4)\n", name, fe.size, fe.num_sectors);
+            } else {
+                printf("%s - %d bytes\n", name, fe.size);
+            }
+        }
+    }
+    if (dir_ino == FS_ROOT_INODE) {
+        printf("tmp/ (tmpfs)\n");
+        if (initrd_mounted) printf("initrd/ (read-only)\n");
+    }
+    printf("Free: %d of %d sectors\n", fs_free_sectors(), fs_total_sectors - fs_layout.data);
+}
+
+static void fs_write_data(uint32_t first_sector, uint32_t num_sectors, const uint8_t *data, uint32_t size) {
+    uint8_t buffer[SECTOR_SIZE];
+    for (uint32_t i = 0; i < num_sectors; i++) {
+        uint32_t offset = i * SECTOR_SIZE;
+        uint32_t bytes_to_write = (size - offset < SECTOR_SIZE) ? (size - offset) : SECTOR_SIZE;
+
+        memset(buffer, 0, SECTOR_SIZE);
+        memcpy(buffer, data + offset, bytes_to_write);
+        fs_data_write(first_sector + i, buffer);
+    }
+}
+
+static int fs_create_entry(const char *path, uint8_t type, const uint8_t *data, uint32_t size) {
+    char leaf[MAX_FILENAME];
+    uint32_t dir_ino = fs_resolve_parent(path, leaf);
+    if (dir_ino == FS_NO_INODE) {
+        printf("Invalid path\n");
+        return -1;
+    }
+    if (fs_lookup(dir_ino, leaf) != FS_NO_INODE) {
+        printf("File already exists\n");
+        return -1;
+    }
+    uint32_t data_sectors = size > FS_INLINE_MAX ? (size + SECTOR_SIZE - 1) / SECTOR_SIZE : 1;
+    if (fs_journal_reserve(fs_bitmap_blocks(data_sectors) + FS_JOURNAL_RESERVE) != 0) return -1;
+
+    // The extent comes first: until something is logged, an allocation
+    // that does not fit can still commit the running transaction.
+    FileEntry fe;
+    memset(&fe, 0, sizeof(FileEntry));
+    fe.in_use = 1;
+    fe.type = type;
+    fe.parent = dir_ino;
+
+    int stored = 1;
+    if (type == FS_TYPE_DIR) {
+        fe.num_sectors = 1;
+    } else if (size <= FS_INLINE_MAX) {
+        fe.size = size;
+        fe.flags = FS_FILE_INLINE;
+        if (size > 0) memcpy(fe.data, data, size);
+        stored = 0;
+    } else {
+        fe.size = size;
+        fe.num_sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        stored = fs_cz_write(&fe, data, size);
+    }
+    if (stored != 0) {
+        fe.first_sector = fs_alloc_extent(fe.num_sectors);
+        if (fe.num_sectors > 0 && fe.first_sector == 0) {
+            printf("Not enough free space\n");
+            return -1;
+        }
+    }
+    uint32_t ino = fs_inode_alloc();
+    if (ino == FS_NO_INODE) {
+        printf("No free file entries\n");
+        fs_free_extent(fe.first_sector, fe.num_sectors);
+        return -1;
+    }
+
+    if (type == FS_TYPE_DIR) {
+        DirBlock empty;
+        memset(&empty, 0, SECTOR_SIZE);
+        fs_cache_write_new(fe.first_sector, &empty);
+    } else if (stored != 0) {
+        fs_write_data(fe.first_sector, fe.num_sectors, data, size);
+    }
+
+    // The entry goes in use only once it has a name, so a full directory
+    // cannot leave an in_use entry pointing at freed sectors.
+    FileEntry dir;
+    fs_inode_read(dir_ino, &dir);
+    if (fs_dir_add(dir_ino, &dir, leaf, ino) != 0) {
+        fs_free_extent(fe.first_sector, fe.num_sectors);
+        fs_inode_free(ino);
+        return -1;
+    }
+    fs_inode_write(ino, &fe);
+
+    fs_sb.num_files++;
+    fs_sb_flush();
+    return 0;
+}
+
+int fs_create_file(const char *filename, const uint8_t *data, uint32_t size) {
+    fs_trace_enter(TRACE_CALL_CREATE);
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(filename, leaf);
+    if (mount == FS_TMP_FILE) return fs_tmp_create(leaf, data, size);
+    if (mount == FS_TMP_ROOT) {
+        printf("File already exists\n");
+        return -1;
+    }
+    if (mount == FS_INITRD) {
+        printf("Read-only file system\n");
+        return -1;
+    }
+
+    fs_journal_begin();
+    int ret = fs_create_entry(filename, FS_TYPE_FILE, data, size);
+    fs_journal_end();
+    return ret;
+}
+
+int fs_mkdir(const char *path) {
+    fs_trace_enter(TRACE_CALL_CREATE);
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(path, leaf);
+    if (mount == FS_INITRD) {
+        printf("Read-only file system\n");
+        return -1;
+    }
+    if (mount != FS_ON_DISK) {
+        printf(mount == FS_TMP_ROOT ? "File already exists\n" : "tmpfs has no subdirectories\n");
+        return -1;
+    }
+
+    fs_journal_begin();
+    int ret = fs_create_entry(path, FS_TYPE_DIR, NULL, 0);
+    fs_journal_end();
+    return ret;
+}
+
+int fs_chdir(const char *path) {
+    fs_trace_enter(TRACE_CALL_LOOKUP);
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(path, leaf);
+    if (mount == FS_TMP_FILE || (mount == FS_INITRD && fs_initrd_type(leaf) != FS_TYPE_DIR)) {
+        int found = mount == FS_TMP_FILE ? tmpfs_find(leaf) != -1 : fs_initrd_type(leaf) != 0;
+        printf(found ? "Not a directory\n" : "Directory not found\n");
+        return -1;
+    }
+    if (mount != FS_ON_DISK) {
+        fs_cwd = FS_ROOT_INODE;
+        fs_path_apply(fs_cwd_path, path);
+        return 0;
+    }
+
+    uint32_t ino = fs_resolve(path);
+    if (ino == FS_NO_INODE) {
+        printf("Directory not found\n");
+        return -1;
+    }
+    FileEntry fe;
+    fs_inode_read(ino, &fe);
+    if (fe.type != FS_TYPE_DIR) {
+        printf("Not a directory\n");
+        return -1;
+    }
+    fs_cwd = ino;
+    fs_path_apply(fs_cwd_path, path);
+    return 0;
+}
+
+// Resolves `path` to a regular file.
+static uint32_t fs_open_file(const char *path, FileEntry *fe) {
+    uint32_t ino = fs_resolve(path);
+    if (ino == FS_NO_INODE) {
+        printf("File not found\n");
+        return FS_NO_INODE;
+    }
+    fs_inode_read(ino, fe);
+    if (fe->type != FS_TYPE_FILE) {
+        printf("Is a directory\n");
+        return FS_NO_INODE;
+    }
+    return ino;
+}
+
+// Copies `count` bytes starting at `offset`; only the sectors that
+// overlap the range are read.
+static uint32_t fs_file_read_at(ReadAhead *ra, uint32_t ino, const FileEntry *fe, uint32_t offset, uint8_t *buffer, uint32_t count) {
+    uint8_t sector_buffer[SECTOR_SIZE];
+
+    if (offset >= fe->size) return 0;
+    if (count > fe->size - offset) count = fe->size - offset;
+    if (fe->flags & FS_FILE_INLINE) {
+        memcpy(buffer, fe->data + offset, count);
+        return count;
+    }
+    if (fe->flags & FS_FILE_COMPRESSED) return fs_cz_read_at(ra, ino, fe, offset, buffer, count);
+
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pos = offset + done;
+        uint32_t lba = fe->first_sector + pos / SECTOR_SIZE;
+        uint32_t end_lba = fe->first_sector + fe->num_sectors;
+        uint32_t in_sector = pos % SECTOR_SIZE;
+        uint32_t chunk = SECTOR_SIZE - in_sector;
+        if (chunk > count - done) chunk = count - done;
+
+        if (chunk == SECTOR_SIZE) {
+            fs_data_read(ra, lba, end_lba, buffer + done);
+        } else {
+            fs_data_read(ra, lba, end_lba, sector_buffer);
+            memcpy(buffer + done, sector_buffer + in_sector, chunk);
+        }
+        done += chunk;
+    }
+    return count;
+}
+
+int fs_read_file(const char *filename, uint8_t *buffer, uint32_t *size) {
+    fs_trace_enter(TRACE_CALL_READ);
+    FileEntry fe;
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(filename, leaf);
+    if (mount == FS_TMP_ROOT) {
+        printf("Is a directory\n");
+        return -1;
+    }
+    if (mount == FS_TMP_FILE) {
+        TmpFile *f = tmpfs_file(fs_tmp_find(leaf));
+        if (!f) return -1;
+        *size = tmpfs_read_at(f, 0, buffer, f->size);
+        return 0;
+    }
+    if (mount == FS_INITRD) {
+        const InitrdFile *f = initrd_find(leaf);
+        if (!f || initrd_is_dir(f)) {
+            printf(f ? "Is a directory\n" : "File not found\n");
+            return -1;
+        }
+        memcpy(buffer, f->data, f->size);
+        *size = f->size;
+        return 0;
+    }
+    
+    uint32_t ino = fs_open_file(filename, &fe);
+    if (ino == FS_NO_INODE) {
+        return -1;
+    }
+    
+    ReadAhead ra = {0};
+    uint32_t errors = fs_csum_errors;
+    *size = fs_file_read_at(&ra, ino, &fe, 0, buffer, fe.size);
+    return fs_csum_errors == errors ? 0 : -1;
+}
+
+static int fs_delete_entry(const char *filename) {
+    char leaf[MAX_FILENAME];
+    uint32_t dir_ino = fs_resolve_parent(filename, leaf);
+    uint32_t ino = (dir_ino == FS_NO_INODE) ? FS_NO_INODE : fs_lookup(dir_ino, leaf);
+    if (ino == FS_NO_INODE) {
+        printf("File not found\n");
+        return -1;
+    }
+    
+    FileEntry fe, dir;
+    fs_inode_read(ino, &fe);
+    if (fe.type == FS_TYPE_DIR && fe.size > 0) {
+        printf("Directory not empty\n");
+        return -1;
+    }
+    if (ino == fs_cwd) {
+        printf("Cannot remove the working directory\n");
+        return -1;
+    }
+    if (fs_is_open(ino)) {
+        printf("File is open\n");
+        return -1;
+    }
+    if (fs_journal_reserve(fs_bitmap_blocks(fe.num_sectors) + FS_JOURNAL_RESERVE) != 0) return -1;
+    
+    fs_inode_read(dir_ino, &dir);
+    fs_dir_remove(dir_ino, &dir, leaf);
+    fs_dcache_forget(dir_ino, leaf);
+
+    fe.in_use = 0;
+    fs_inode_write(ino, &fe);
+    fs_free_extent(fe.first_sector, fe.num_sectors);
+    fs_inode_free(ino);
+    if (fs_cz_cached_ino == ino) fs_cz_cached_file = 0;
+
+    fs_sb.num_files--;
+    fs_sb_flush();
+    
+    return 0;
+}
+
+int fs_delete_file(const char *filename) {
+    fs_trace_enter(TRACE_CALL_DELETE);
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(filename, leaf);
+    if (mount == FS_TMP_FILE) return fs_tmp_delete(leaf);
+    if (mount == FS_TMP_ROOT) {
+        printf("Cannot remove a mount point\n");
+        return -1;
+    }
+    if (mount == FS_INITRD) {
+        printf("Read-only file system\n");
+        return -1;
+    }
+
+    fs_journal_begin();
+    int ret = fs_delete_entry(filename);
+    fs_journal_end();
+    return ret;
+}
+
+// Checks every allocated data sector against its checksum, reading
+// straight from the disk so cached copies cannot hide bad media.
+uint32_t fs_scrub() {
+    fs_trace_enter(TRACE_CALL_SCRUB);
+    uint32_t checked = 0;
+    uint32_t errors = fs_csum_errors;
+
+    // Reserved sectors hold no data yet.
+    fs_reserve_drop_all();
+    fs_sync();
+    for (uint32_t lba = fs_layout.data; lba < fs_total_sectors;) {
+        if (!fs_bitmap_test(lba)) {
+            lba++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (run < FS_RA_MAX_WINDOW && lba + run < fs_total_sectors && fs_bitmap_test(lba + run)) run++;
+        disk_read_sectors(lba, run, fs_ra_buffer);
+        for (uint32_t i = 0; i < run; i++) {
+            fs_csum_verify(lba + i, fs_ra_buffer + i * SECTOR_SIZE);
+        }
+        checked += run;
+        lba += run;
+    }
+    printf("Scrub: %d sectors checked, %d bad (CRC32C %s)\n", checked, fs_csum_errors - errors,
+           crc32c_hw ? "sse4.2" : "table");
+    return fs_csum_errors - errors;
+}
+
+uint32_t fs_get_file_size(const char *filename) {
+    fs_trace_enter(TRACE_CALL_LOOKUP);
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(filename, leaf);
+    if (mount == FS_TMP_FILE) {
+        TmpFile *f = tmpfs_file(tmpfs_find(leaf));
+        return f ? f->size : DISK_NOT_FOUND;
+    }
+    if (mount == FS_INITRD) {
+        const InitrdFile *f = initrd_find(leaf);
+        return f && !initrd_is_dir(f) ? f->size : DISK_NOT_FOUND;
+    }
+    if (mount == FS_TMP_ROOT) return DISK_NOT_FOUND;
+
+    if (fs_total_sectors == 0) {
+        kernel_panic("Filesystem not initialized!\n");
+        return DISK_ERROR;
+    }
+    
+    uint32_t ino = fs_resolve(filename);
+    if (ino == FS_NO_INODE) return DISK_NOT_FOUND;
+
+    FileEntry fe;
+    fs_inode_read(ino, &fe);
+    return fe.type == FS_TYPE_FILE ? fe.size : DISK_NOT_FOUND;
+}
+
+int fs_file_exists(const char *filename) {
+    fs_trace_enter(TRACE_CALL_LOOKUP);
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(filename, leaf);
+    if (mount == FS_TMP_FILE) return tmpfs_find(leaf) != -1;
+    if (mount == FS_INITRD) return fs_initrd_type(leaf) != 0;
+    if (mount == FS_TMP_ROOT) return 1;
+    return fs_resolve(filename) != FS_NO_INODE;
+}
+
+
+
+// --------------- Streaming I/O --------------------
+
+// Moves the file to a free run of `room` sectors, or of `min_room` when
+// no run is that long, and reserves the run past the copy for it. The
+// copy, the new FileEntry and the free of the old extent are a journal
+// step of their own, so however large the file, the step that grows it
+// only logs the bitmap of the growth.
+static int fs_file_move(uint32_t ino, FileEntry *fe, uint32_t room, uint32_t min_room) {
+    uint32_t count = fe->num_sectors;
+    if (count && fs_journal_reserve(2 * fs_bitmap_blocks(count) + FS_JOURNAL_RESERVE) != 0) return -1;
+    uint32_t first = fs_find_free(room);
+    if (first == 0 && room > min_room) first = fs_find_free(room = min_room);
+    if (first == 0) return -1;
+
+    if (count) fs_take_extent(first, count);
+    for (uint32_t i = 0; i < count; i += FS_RA_MAX_WINDOW) {
+        uint32_t run = count - i < FS_RA_MAX_WINDOW ? count - i : FS_RA_MAX_WINDOW;
+        fs_data_fetch(fe->first_sector + i, run, fs_ra_buffer);
+        fs_data_write_run(first + i, run, fs_ra_buffer);
+    }
+    fs_free_extent(fe->first_sector, count);
+    fe->first_sector = first;
+    fs_reserve(ino, first + count, room - count);
+    if (count == 0) return 0;
+    fs_inode_write(ino, fe);
+    return fs_journal_step(fs_bitmap_blocks(room - count) + FS_JOURNAL_RESERVE);
+}
+
+// Makes room for `num_sectors` sectors and keeps `extra` more reserved
+// past them for the rest of the write: in place when the sectors after
+// the file are free or reserved for it, otherwise by moving it. An open
+// file is also given slack (see Reservation), so a stream of appends
+// moves it a logarithmic number of times rather than every time a
+// neighbour is in the way.
+static int fs_file_grow(uint32_t ino, FileEntry *fe, uint32_t num_sectors, uint32_t extra) {
+    uint32_t end = fe->first_sector + fe->num_sectors;
+    if (fe->num_sectors && fs_reserve_take(ino, end, num_sectors - fe->num_sectors)) {
+        fe->num_sectors = num_sectors;
+        return 0;
+    }
+
+    uint32_t slack = 0;
+    if (fs_is_open(ino)) slack = num_sectors < FS_GROW_MAX_SLACK ? num_sectors : FS_GROW_MAX_SLACK;
+    fs_reserve_drop(ino);
+    if (fs_extend_extent(fe->first_sector, fe->num_sectors, num_sectors)) {
+        fe->num_sectors = num_sectors;
+        fs_reserve(ino, fe->first_sector + num_sectors, extra + slack);
+        return 0;
+    }
+    if (fs_file_move(ino, fe, num_sectors + extra + slack, num_sectors) != 0) return -1;
+    end = fe->first_sector + fe->num_sectors;
+    if (!fs_reserve_take(ino, end, num_sectors - fe->num_sectors)) fs_take_extent(end, num_sectors - fe->num_sectors);
+    fe->num_sectors = num_sectors;
+    return 0;
+}
+
+// Zeroes the file from `from` up to the sector holding `to`: the rest of
+// the sector at `from`, which a truncate may have left dirty, then whole
+// sectors in runs. Sectors past the old end are fresh, so they are
+// written directly.
+static void fs_file_zero(FileEntry *fe, uint32_t from, uint32_t to) {
+    uint32_t lba = fe->first_sector + from / SECTOR_SIZE;
+    if (from % SECTOR_SIZE) {
+        uint8_t buffer[SECTOR_SIZE];
+        fs_data_fetch(lba, 1, buffer);
+        memset(buffer + from % SECTOR_SIZE, 0, SECTOR_SIZE - from % SECTOR_SIZE);
+        fs_data_overwrite(lba, buffer);
+        lba++;
+    }
+    uint32_t end = fe->first_sector + to / SECTOR_SIZE;
+    if (lba >= end) return;
+    memset(fs_ra_buffer, 0, sizeof(fs_ra_buffer));
+    while (lba < end) {
+        uint32_t run = end - lba < FS_RA_MAX_WINDOW ? end - lba : FS_RA_MAX_WINDOW;
+        fs_data_write_run(lba, run, fs_ra_buffer);
+        lba += run;
+    }
+}
+
+// Moves inline contents out to a data sector once they outgrow the entry.
+static int fs_inline_spill(uint32_t ino, FileEntry *fe) {
+    uint8_t buffer[SECTOR_SIZE];
+    uint32_t first = 0;
+    if (fe->size > 0) {
+        first = fs_alloc_extent(1);
+        if (first == 0) {
+            printf("Not enough free space\n");
+            return -1;
+        }
+        memset(buffer, 0, SECTOR_SIZE);
+        memcpy(buffer, fe->data, fe->size);
+        fs_data_write(first, buffer);
+    }
+    memset(fe->data, 0, FS_INLINE_MAX);
+    fe->flags &= ~FS_FILE_INLINE;
+    fe->first_sector = first;
+    fe->num_sectors = first ? 1 : 0;
+    fs_inode_write(ino, fe);
+    return 0;
+}
+
+// Writes in steps of up to FS_WRITE_STEP bytes, each consistent on its
+// own once its FileEntry is written, so no write needs more of the
+// journal than one step and the growth under it. Returns how much was
+// written, or -1 when nothing was.
+static int fs_file_write_at(uint32_t ino, FileEntry *fe, uint32_t offset, const uint8_t *data, uint32_t count) {
+    uint8_t sector_buffer[SECTOR_SIZE];
+
+    if (count == 0) return 0;
+
+    if (fe->flags & FS_FILE_INLINE) {
+        if (offset + count <= FS_INLINE_MAX) {
+            if (offset > fe->size) memset(fe->data + fe->size, 0, offset - fe->size);
+            memcpy(fe->data + offset, data, count);
+            if (offset + count > fe->size) fe->size = offset + count;
+            fs_inode_write(ino, fe);
+            return count;
+        }
+        if (fs_inline_spill(ino, fe) != 0) return -1;
+    }
+
+    uint32_t final = (offset + count + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pos = offset + done;
+        uint32_t step = FS_WRITE_STEP - pos % FS_WRITE_STEP;
+        if (step > count - done) step = count - done;
+        uint32_t needed = (pos + step + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        uint32_t grow = needed > fe->num_sectors ? needed - fe->num_sectors : 0;
+        if (fs_journal_step(fs_bitmap_blocks(grow) + FS_JOURNAL_RESERVE) != 0) break;
+        if (grow && fs_file_grow(ino, fe, needed, final - needed) != 0) {
+            printf("Not enough free space\n");
+            break;
+        }
+
+        // Writing past the end leaves a hole that must read back as zeros.
+        if (pos > fe->size) fs_file_zero(fe, fe->size, pos);
+
+        for (uint32_t at = pos; at < pos + step;) {
+            uint32_t lba = fe->first_sector + at / SECTOR_SIZE;
+            uint32_t in_sector = at % SECTOR_SIZE;
+            uint32_t chunk = SECTOR_SIZE - in_sector;
+            if (chunk > pos + step - at) chunk = pos + step - at;
+
+            // Sectors that already hold file data are overwritten in place.
+            int existing = at - in_sector < fe->size;
+            const uint8_t *sector = data + (at - offset);
+            if (chunk != SECTOR_SIZE) {
+                if (existing) fs_data_fetch(lba, 1, sector_buffer);
+                else memset(sector_buffer, 0, SECTOR_SIZE);
+                memcpy(sector_buffer + in_sector, data + (at - offset), chunk);
+                sector = sector_buffer;
+            }
+            if (existing) fs_data_overwrite(lba, sector);
+            else fs_data_write(lba, sector);
+            at += chunk;
+        }
+
+        if (pos + step > fe->size) fe->size = pos + step;
+        fs_inode_write(ino, fe);
+        done += step;
+    }
+    // What is left of the room kept for the write goes back.
+    if (!fs_is_open(ino)) fs_reserve_drop(ino);
+    return done ? (int)done : -1;
+}
+
+// Frees the sectors past the new end. Growing writes the last byte, so
+// the file grows once and the hole before it reads back as zeros.
+static int fs_file_truncate(uint32_t ino, FileEntry *fe, uint32_t size) {
+    if (fe->size < size) {
+        uint8_t zero = 0;
+        return fs_file_write_at(ino, fe, size - 1, &zero, 1) < 0 ? -1 : 0;
+    }
+    if (fe->size == size) return 0;
+    if (fe->flags & FS_FILE_INLINE) memset(fe->data + size, 0, fe->size - size);
+
+    uint32_t num_sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (num_sectors < fe->num_sectors) {
+        if (fs_journal_step(fs_bitmap_blocks(fe->num_sectors - num_sectors) + FS_JOURNAL_RESERVE) != 0) return -1;
+        fs_free_extent(fe->first_sector + num_sectors, fe->num_sectors - num_sectors);
+        fe->num_sectors = num_sectors;
+        if (num_sectors == 0) fe->first_sector = 0;
+    }
+    fe->size = size;
+    fs_inode_write(ino, fe);
+    return 0;
+}
+
+static int fs_edit_entry(const char *filename, const uint8_t *data, uint32_t new_size) {
+    uint8_t sector_buffer[SECTOR_SIZE];
+    FileEntry fe;
+    uint32_t ino = fs_open_file(filename, &fe);
+    if (ino == FS_NO_INODE) {
+        return -1;
+    }
+
+    if (new_size <= FS_INLINE_MAX) {
+        if (fs_journal_reserve(fs_bitmap_blocks(fe.num_sectors) + FS_JOURNAL_RESERVE) != 0) return -1;
+        fs_free_extent(fe.first_sector, fe.num_sectors);
+        fe.first_sector = 0;
+        fe.num_sectors = 0;
+        fe.flags = (fe.flags & ~FS_FILE_COMPRESSED) | FS_FILE_INLINE;
+        memset(fe.data, 0, FS_INLINE_MAX);
+        memcpy(fe.data, data, new_size);
+        fe.size = new_size;
+        fs_inode_write(ino, &fe);
+        return 0;
+    }
+    // A file keeps its representation, so an edit costs only what it
+    // changes: a compressed file repacks the chunks that differ, any
+    // other file rewrites the sectors that differ. Only contents that are
+    // written whole anyway, past an inline or empty file, are compressed.
+    if (fe.flags & FS_FILE_COMPRESSED) {
+        CzPatch patch = { 0, data, new_size, new_size };
+        return fs_cz_update(ino, &fe, &patch);
+    }
+    if (fe.flags & FS_FILE_INLINE) {
+        fe.flags &= ~FS_FILE_INLINE;
+        memset(fe.data, 0, FS_INLINE_MAX);
+        fe.size = 0;
+    }
+    if (fe.num_sectors == 0) {
+        FileEntry packed = fe;
+        if (fs_cz_write(&packed, data, new_size) == 0) {
+            fs_inode_write(ino, &packed);
+            return 0;
+        }
+    }
+
+    // Only runs of sectors whose contents changed are written back.
+    ReadAhead ra = {0};
+    uint32_t common = fe.size < new_size ? fe.size : new_size;
+    uint32_t run_start = 0, run_end = 0;
+    for (uint32_t pos = 0; pos < common; pos += SECTOR_SIZE) {
+        uint32_t chunk = common - pos < SECTOR_SIZE ? common - pos : SECTOR_SIZE;
+        fs_file_read_at(&ra, ino, &fe, pos, sector_buffer, chunk);
+        if (memcmp(sector_buffer, data + pos, chunk) == 0) continue;
+        if (pos != run_end) {
+            if (fs_file_write_at(ino, &fe, run_start, data + run_start, run_end - run_start) != (int)(run_end - run_start)) return -1;
+            run_start = pos;
+        }
+        run_end = pos + chunk;
+    }
+    if (fs_file_write_at(ino, &fe, run_start, data + run_start, run_end - run_start) != (int)(run_end - run_start)) return -1;
+
+    if (new_size > common) {
+        return fs_file_write_at(ino, &fe, common, data + common, new_size - common) != (int)(new_size - common) ? -1 : 0;
+    }
+    return fs_file_truncate(ino, &fe, new_size);
+}
+
+int fs_edit_file(const char *filename, const uint8_t *data, uint32_t new_size) {
+    fs_trace_enter(TRACE_CALL_WRITE);
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(filename, leaf);
+    if (mount == FS_TMP_FILE) return fs_tmp_edit(leaf, data, new_size);
+    if (mount == FS_TMP_ROOT) {
+        printf("Is a directory\n");
+        return -1;
+    }
+    if (mount == FS_INITRD) {
+        printf("Read-only file system\n");
+        return -1;
+    }
+
+    fs_journal_begin();
+    int ret = fs_edit_entry(filename, data, new_size);
+    fs_journal_end();
+    return ret;
+}
+
+int fs_open(const char *path, int flags) {
+    fs_trace_enter(TRACE_CALL_OPEN);
+    int slot = -1;
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        if (!fs_open_files[i].in_use) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1) {
+        printf("Too many open files\n");
+        return -1;
+    }
+    OpenFile *of = &fs_open_files[slot];
+
+    char leaf[FS_MAX_PATH];
+    int mount = fs_mount_path(path, leaf);
+    if (mount == FS_TMP_ROOT) {
+        printf("Is a directory\n");
+        return -1;
+    }
+    if (mount == FS_TMP_FILE) {
+        int index = tmpfs_find(leaf);
+        if (index == -1 && (flags & O_CREAT)) index = tmpfs_create(leaf);
+        else if (index == -1) printf("File not found\n");
+        if (index == -1) return -1;
+        if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) tmpfs_truncate(tmpfs_file(index), 0);
+        of->in_use = 1;
+        of->mount = FS_TMP_FILE;
+        of->flags = flags;
+        of->inode = index;
+        of->offset = 0;
+        return slot + FS_FIRST_FD;
+    }
+    if (mount == FS_INITRD) {
+        const InitrdFile *f = initrd_find(leaf);
+        if ((flags & (O_ACCMODE | O_CREAT | O_TRUNC)) != O_RDONLY) {
+            printf("Read-only file system\n");
+            return -1;
+        }
+        if (!f || initrd_is_dir(f)) {
+            printf(f ? "Is a directory\n" : "File not found\n");
+            return -1;
+        }
+        of->in_use = 1;
+        of->mount = FS_INITRD;
+        of->flags = flags;
+        of->inode = f - initrd_files;
+        of->offset = 0;
+        return slot + FS_FIRST_FD;
+    }
+
+    uint32_t ino = fs_resolve(path);
+    if (ino == FS_NO_INODE && (flags & O_CREAT)) {
+        if (fs_create_file(path, NULL, 0) != 0) return -1;
+        ino = fs_resolve(path);
+    }
+    if (ino == FS_NO_INODE) {
+        printf("File not found\n");
+        return -1;
+    }
+
+    FileEntry fe;
+    fs_inode_read(ino, &fe);
+    if (fe.type != FS_TYPE_FILE) {
+        printf("Is a directory\n");
+        return -1;
+    }
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY && fe.size > 0) {
+        fs_journal_begin();
+        if (fs_journal_reserve(fs_bitmap_blocks(fe.num_sectors) + FS_JOURNAL_RESERVE) != 0) {
+            fs_journal_end();
+            return -1;
+        }
+        fs_free_extent(fe.first_sector, fe.num_sectors);
+        fe.first_sector = 0;
+        fe.num_sectors = 0;
+        fe.size = 0;
+        fe.flags = FS_FILE_INLINE;
+        memset(fe.data, 0, FS_INLINE_MAX);
+        fs_inode_write(ino, &fe);
+        fs_journal_end();
+    }
+
+    of->in_use = 1;
+    of->mount = FS_ON_DISK;
+    of->flags = flags;
+    of->inode = ino;
+    of->offset = 0;
+    memset(&of->ra, 0, sizeof(ReadAhead));
+    return slot + FS_FIRST_FD;
+}
+
+int fs_read(int fd, void *buffer, uint32_t count) {
+    fs_trace_enter(TRACE_CALL_READ);
+    OpenFile *of = fs_fd(fd);
+    if (!of || (of->flags & O_ACCMODE) == O_WRONLY) return -1;
+    if (of->mount == FS_TMP_FILE) {
+        uint32_t n = tmpfs_read_at(&tmpfs_files[of->inode], of->offset, buffer, count);
+        of->offset += n;
+        return n;
+    }
+    if (of->mount == FS_INITRD) {
+        const InitrdFile *f = &initrd_files[of->inode];
+        if (of->offset >= f->size) return 0;
+        if (count > f->size - of->offset) count = f->size - of->offset;
+        memcpy(buffer, f->data + of->offset, count);
+        of->offset += count;
+        return count;
+    }
+
+    FileEntry fe;
+    fs_inode_read(of->inode, &fe);
+    uint32_t errors = fs_csum_errors;
+    uint32_t n = fs_file_read_at(&of->ra, of->inode, &fe, of->offset, buffer, count);
+    if (fs_csum_errors != errors) return -1;
+    of->offset += n;
+    return n;
+}
+
+// Writes at `offset` without moving the file offset. Only the sectors
+// the range overlaps are written.
+int fs_pwrite(int fd, const void *data, uint32_t count, uint32_t offset) {
+    fs_trace_enter(TRACE_CALL_WRITE);
+    OpenFile *of = fs_fd(fd);
+    if (!of || (of->flags & O_ACCMODE) == O_RDONLY) return -1;
+    if (of->mount == FS_TMP_FILE) return tmpfs_write_at(&tmpfs_files[of->inode], offset, data, count);
+
+    FileEntry fe;
+    fs_inode_read(of->inode, &fe);
+    fs_journal_begin();
+    int n;
+    if (fe.flags & FS_FILE_COMPRESSED) {
+        CzPatch patch = { offset, data, count, offset + count > fe.size ? offset + count : fe.size };
+        n = count == 0 || fs_cz_update(of->inode, &fe, &patch) == 0 ? (int)count : -1;
+    } else {
+        n = fs_file_write_at(of->inode, &fe, offset, data, count);
+    }
+    fs_journal_end();
+    return n;
+}
+
+int fs_write(int fd, const void *data, uint32_t count) {
+    OpenFile *of = fs_fd(fd);
+    if (!of) return -1;
+
+    if (of->flags & O_APPEND) of->offset = fs_fd_size(of);
+    int n = fs_pwrite(fd, data, count, of->offset);
+    if (n > 0) of->offset += n;
+    return n;
+}
+
+int fs_ftruncate(int fd, uint32_t size) {
+    fs_trace_enter(TRACE_CALL_WRITE);
+    OpenFile *of = fs_fd(fd);
+    if (!of || (of->flags & O_ACCMODE) == O_RDONLY) return -1;
+    if (of->mount == FS_TMP_FILE) return tmpfs_truncate(&tmpfs_files[of->inode], size);
+
+    FileEntry fe;
+    fs_inode_read(of->inode, &fe);
+    fs_journal_begin();
+    int ret;
+    if (fe.flags & FS_FILE_COMPRESSED) {
+        CzPatch patch = { size, NULL, 0, size };
+        ret = fs_cz_update(of->inode, &fe, &patch);
+    } else {
+        ret = fs_file_truncate(of->inode, &fe, size);
+    }
+    fs_journal_end();
+    return ret;
+}
+
+int fs_lseek(int fd, int32_t offset, int whence) {
+    OpenFile *of = fs_fd(fd);
+    if (!of) return -1;
+
+    int32_t base = 0;
+    if (whence == SEEK_CUR) {
+        base = of->offset;
+    } else if (whence == SEEK_END) {
+        base = fs_fd_size(of);
+    } else if (whence != SEEK_SET) {
+        return -1;
+    }
+    if (base + offset < 0) return -1;
+    of->offset = base + offset;
+    return of->offset;
+}
+
+int fs_close(int fd) {
+    OpenFile *of = fs_fd(fd);
+    if (!of) return -1;
+    of->in_use = 0;
+    if (of->mount == FS_ON_DISK && !fs_is_open(of->inode)) fs_reserve_drop(of->inode);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef FS_FORMAT_H
+#define FS_FORMAT_H
+
+// On-disk format of the ZOS file system: the layout, the structures and
+// the helpers that must agree bit for bit between the kernel (fs.h) and
+// disk_util. No includes; the includer provides the stdint types,
+// memcpy and memcmp.
+
+#define FS_MAGIC                "ZOS5"
+#define FS_VERSION              2       // images formatted before versioning read 0
+
+#define SECTOR_SIZE             512
+#define MAX_FILES               32768
+#define MAX_FILENAME            64
+#define FS_MAX_PATH             256
+
+// On-disk layout:
+// [0] boot | [1] superblock | [2..9] inode bitmap | free-space bitmap
+// | FileEntry table | journal (128) | CRC32C per sector | data
+// The free-space bitmap and the checksum table are sized for the disk
+// at format time and recorded in the superblock, so everything past the
+// inode bitmap is found through FsLayout. Before version 2 they were
+// always 64 and 2048 sectors, for at most 128MB.
+#define FS_SUPERBLOCK_SECTOR    1
+#define FS_INODE_BITMAP_SECTOR  2
+#define FS_INODE_BITMAP_SECTORS (MAX_FILES / (SECTOR_SIZE * 8))
+#define FS_BITMAP_SECTOR        (FS_INODE_BITMAP_SECTOR + FS_INODE_BITMAP_SECTORS)
+#define FS_BITS_PER_SECTOR      (SECTOR_SIZE * 8)
+#define FS_V1_BITMAP_SECTORS    64
+#define FS_ENTRIES_PER_SECTOR   ((uint32_t)(SECTOR_SIZE / sizeof(FileEntry)))
+#define FS_TABLE_SECTORS        (MAX_FILES / FS_ENTRIES_PER_SECTOR)
+#define FS_JOURNAL_SECTORS      128
+#define FS_CSUMS_PER_SECTOR     (SECTOR_SIZE / 4)
+
+#define FS_ROOT_INODE           0
+#define FS_NO_INODE             0xFFFFFFFF
+#define FS_TYPE_FILE            1
+#define FS_TYPE_DIR             2
+#define FS_FILE_COMPRESSED      0x01
+#define FS_FILE_INLINE          0x02    // contents live in FileEntry.data
+#define FS_INLINE_MAX           45
+#define FS_CZ_CHUNK             8192
+#define FS_DIR_MAX_BUCKETS      8192
+#define FS_JOURNAL_MAGIC        "ZJNL"
+#define FS_JOURNAL_MAX_BLOCKS   120
+
+// One entry per file or directory; names live in the parent directory.
+typedef struct {
+    uint32_t size;          // bytes for files, number of entries for directories
+    uint32_t first_sector;
+    uint32_t num_sectors;   // for directories: number of hash buckets
+    uint32_t parent;
+    uint8_t in_use;
+    uint8_t type;
+    uint8_t flags;          // FS_FILE_*
+    uint8_t data[FS_INLINE_MAX];
+} FileEntry;
+
+typedef struct {
+    char magic[4];
+    uint32_t num_files;
+    uint32_t total_sectors;
+    uint32_t max_files;
+    uint32_t root;
+    uint32_t version;       // FS_VERSION that last wrote the superblock
+    uint32_t bitmap_sectors;    // 0 before version 2
+    uint32_t csum_sectors;
+} SuperBlock;
+
+// Where each area starts, from the sizes in the superblock.
+typedef struct {
+    uint32_t bitmap_sectors;
+    uint32_t table;
+    uint32_t journal;
+    uint32_t csum;
+    uint32_t csum_sectors;
+    uint32_t data;          // first data sector
+} FsLayout;
+
+// A directory is an array of hash buckets, one sector each. Records are
+// packed back to back: inode (4 bytes), name length (1 byte), name.
+typedef struct {
+    uint16_t count;
+    uint16_t used;
+    uint8_t records[SECTOR_SIZE - 4];
+} DirBlock;
+
+#define DIR_RECORD_HEADER 5
+
+// Journal layout: descriptor, the logged sectors, then the commit record.
+typedef struct {
+    char magic[4];
+    uint32_t seq;
+    uint32_t count;         // 0 when there is nothing to replay
+    uint32_t lbas[FS_JOURNAL_MAX_BLOCKS];
+} JournalHeader;
+
+typedef struct {
+    char magic[4];
+    uint32_t seq;
+    uint32_t count;
+    uint32_t checksum;
+} JournalCommit;
+
+// 0 when the superblock is ours, -1 when it is not a file system, -2
+// when a newer release formatted it.
+static inline int fs_sb_check(const SuperBlock *sb) {
+    if (memcmp(sb->magic, FS_MAGIC, 4) != 0) return -1;
+    return sb->version > FS_VERSION ? -2 : 0;
+}
+
+// Sizes the free-space bitmap and the checksum table for a new file
+// system of `total_sectors`.
+static inline void fs_layout_size(SuperBlock *sb, uint32_t total_sectors) {
+    sb->total_sectors = total_sectors;
+    sb->bitmap_sectors = (total_sectors + FS_BITS_PER_SECTOR - 1) / FS_BITS_PER_SECTOR;
+    sb->csum_sectors = (total_sectors + FS_CSUMS_PER_SECTOR - 1) / FS_CSUMS_PER_SECTOR;
+}
+
+// Derives the layout, first filling in the sizes an older superblock
+// did not record. Returns -1 when the sizes do not cover the file
+// system or leave no room for data in it.
+static inline int fs_layout_load(SuperBlock *sb, FsLayout *layout) {
+    if (sb->bitmap_sectors == 0) {
+        sb->bitmap_sectors = FS_V1_BITMAP_SECTORS;
+        sb->csum_sectors = FS_V1_BITMAP_SECTORS * FS_BITS_PER_SECTOR / FS_CSUMS_PER_SECTOR;
+    }
+    uint64_t metadata = (uint64_t)FS_BITMAP_SECTOR + sb->bitmap_sectors + FS_TABLE_SECTORS +
+                        FS_JOURNAL_SECTORS + sb->csum_sectors;
+    if (metadata >= sb->total_sectors ||
+        (uint64_t)sb->bitmap_sectors * FS_BITS_PER_SECTOR < sb->total_sectors ||
+        (uint64_t)sb->csum_sectors * FS_CSUMS_PER_SECTOR < sb->total_sectors) return -1;
+    layout->bitmap_sectors = sb->bitmap_sectors;
+    layout->table = FS_BITMAP_SECTOR + sb->bitmap_sectors;
+    layout->journal = layout->table + FS_TABLE_SECTORS;
+    layout->csum = layout->journal + FS_JOURNAL_SECTORS;
+    layout->csum_sectors = sb->csum_sectors;
+    layout->data = layout->csum + sb->csum_sectors;
+    return 0;
+}
+
+static uint32_t fs_name_hash(const char *name, uint32_t len) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline uint32_t dir_record_inode(const uint8_t *rec) {
+    uint32_t ino;
+    memcpy(&ino, rec, 4);
+    return ino;
+}
+
+static inline uint32_t dir_record_size(const uint8_t *rec) {
+    return DIR_RECORD_HEADER + rec[4];
+}
+
+static inline int dir_record_matches(const uint8_t *rec, const char *name, uint32_t len) {
+    return rec[4] == len && memcmp(rec + DIR_RECORD_HEADER, name, len) == 0;
+}
+
+static int dir_block_append(DirBlock *blk, uint32_t ino, const char *name, uint32_t len) {
+    if (blk->used + DIR_RECORD_HEADER + len > sizeof(blk->records)) return 0;
+    uint8_t *rec = blk->records + blk->used;
+    memcpy(rec, &ino, 4);
+    rec[4] = (uint8_t)len;
+    memcpy(rec + DIR_RECORD_HEADER, name, len);
+    blk->used += DIR_RECORD_HEADER + len;
+    blk->count++;
+    return 1;
+}
+
+// Covers the logged LBAs and the `count` sectors at `blocks`.
+static uint32_t fs_journal_checksum(const uint32_t *lbas, const uint8_t *blocks, uint32_t count) {
+    uint32_t hash = 2166136261u;
+    const uint8_t *bytes = (const uint8_t *)lbas;
+    for (uint32_t i = 0; i < count * 4; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    for (uint32_t i = 0; i < count * SECTOR_SIZE; i++) {
+        hash ^= blocks[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef INITRD_H
+#define INITRD_H
+
+// Read-only initramfs: a cpio archive in the "newc" format (what
+// `cpio -o -H newc` writes) that GRUB loads as a boot module. Files are
+// served straight from the module, nothing is copied. fs.h mounts it
+// at /initrd.
+#define INITRD_MAGIC            "070701"
+#define INITRD_HEADER_SIZE      110
+#define INITRD_TRAILER          "TRAILER!!!"
+#define INITRD_MAX_FILES        128
+#define INITRD_MODE_TYPE        0170000
+#define INITRD_MODE_DIR         0040000
+
+typedef struct {
+    const char *name;       // without a leading "./" or "/"
+    const uint8_t *data;
+    uint32_t size;
+    uint32_t mode;
+} InitrdFile;
+
+InitrdFile initrd_files[INITRD_MAX_FILES];
+uint32_t initrd_count = 0;
+int initrd_mounted = 0;
+
+static uint32_t initrd_hex(const uint8_t *p) {
+    uint32_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        uint8_t c = p[i];
+        uint32_t digit = (c >= '0' && c <= '9') ? c - '0'
+                       : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                       : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : 0;
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+static inline uint32_t initrd_align(uint32_t offset) {
+    return (offset + 3) & ~3;
+}
+
+// Indexes the archive at `start`. Returns the number of entries, or -1
+// when it is not a newc archive or is cut short.
+int initrd_load(const uint8_t *start, uint32_t size) {
+    uint32_t offset = 0;
+    initrd_count = 0;
+
+    while (1) {
+        if (offset > size || size - offset < INITRD_HEADER_SIZE) return -1;
+        const uint8_t *hdr = start + offset;
+        if (memcmp(hdr, INITRD_MAGIC, 6) != 0) return -1;
+        uint32_t mode = initrd_hex(hdr + 14);
+        uint32_t file_size = initrd_hex(hdr + 54);
+        uint32_t name_size = initrd_hex(hdr + 94);
+
+        uint32_t name_at = offset + INITRD_HEADER_SIZE;
+        if (name_size == 0 || name_size > size - name_at) return -1;
+        const char *name = (const char *)start + name_at;
+        if (name[name_size - 1] != '\0') return -1;
+        uint32_t data_at = initrd_align(name_at + name_size);
+        if (data_at > size || file_size > size - data_at) return -1;
+        offset = initrd_align(data_at + file_size);
+        if (strcmp(name, INITRD_TRAILER) == 0) break;
+
+        if (name[0] == '.' && name[1] == '/') name += 2;
+        while (*name == '/') name++;
+        if (name[0] == '\0' || strcmp(name, ".") == 0) continue;
+        if (initrd_count == INITRD_MAX_FILES) {
+            printf("initrd: more than %d entries, ignoring the rest\n", INITRD_MAX_FILES);
+            break;
+        }
+        InitrdFile *f = &initrd_files[initrd_count++];
+        f->name = name;
+        f->data = start + data_at;
+        f->size = file_size;
+        f->mode = mode;
+    }
+    initrd_mounted = 1;
+    return initrd_count;
+}
+
+static inline int initrd_is_dir(const InitrdFile *f) {
+    return (f->mode & INITRD_MODE_TYPE) == INITRD_MODE_DIR;
+}
+
+// `path` is relative to the archive root. Returns the entry, or NULL.
+const InitrdFile *initrd_find(const char *path) {
+    for (uint32_t i = 0; i < initrd_count; i++) {
+        if (strcmp(initrd_files[i].name, path) == 0) return &initrd_files[i];
+    }
+    return NULL;
+}
+
+// Prints the entries directly inside `dir` ("" for the root).
+void initrd_list(const char *dir) {
+    uint32_t len = strlen(dir);
+    uint32_t count = 0;
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        if (pass == 1) printf("Entries: %d\n", count);
+        for (uint32_t i = 0; i < initrd_count; i++) {
+            const InitrdFile *f = &initrd_files[i];
+            const char *name = f->name;
+            if (len > 0) {
+                if (strncmp(name, dir, len) != 0 || name[len] != '/') continue;
+                name += len + 1;
+            }
+            if (strchr(name, '/')) continue;
+            if (pass == 0) count++;
+            else if (initrd_is_dir(f)) printf("%s/\n", name);
+            else printf("%s - %d bytes\n", name, f->size);
+        }
+    }
+    printf("Read-only (initrd)\n");
+}
+
+#endif
@@ -1114,8 +1114,9 @@ void sprintf(char *buffer, const char *fmt, ...) {
 }
 
 // TODO: Somehow use str_format
+// Returns a static buffer, overwritten by the next call.
 char *time_format(struct Day* day) {
-    char* buffer = malloc(32);
+    static char buffer[32];
     uint8_t pos = 0;
     uint16_t y = day->year;
     buffer[pos++] = '0' + (y / 1000);
@@ -24,8 +24,21 @@ KernelState state = {
 extern void kernel_panic(const char *msg);
 extern int getchar();
 extern void *memmove(void *, const void *, size_t);
+extern int fs_read(int fd, void *buffer, uint32_t count);
+extern int fs_write(int fd, const void *data, uint32_t count);
+extern void fs_sync();
 // --------------- Utils ----------------------------
 
+static inline void ___outb(uint16_t port, uint8_t value) {
+    asm volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t ___inb(uint16_t port) {
+    uint8_t value;
+    asm volatile ("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
 void kernel_delay(int iterations) {
     volatile int i;
     for (i = 0; i < iterations; i++) {}
@@ -220,6 +233,10 @@ void kernel_print_string(const char *str) {
 }
 
 void kernel_write(int fd, const char *str, int count) {
+    if (fd >= 3) {
+        if (state.disk != -1) fs_write(fd, str, count);
+        return;
+    }
     for (int i = 0; i < count && str[i]; i++) {
         if (fd == STDOUT || fd == STDERR) {
             if (str[i] == '\n') {
@@ -261,7 +278,7 @@ int kernel_read(int fd, char *buf, size_t count) {
         }
         return read_count;
     } else if (fd >= 3 && state.disk != -1) {
-        return -1;
+        return fs_read(fd, buf, count);
     }
     return -1;
 }
@@ -440,6 +457,134 @@ char* kernel_bios_get_vendor(SMBIOSHeader* smbios_header) {
 
 
 
+// ---- Clock ----
+// The TSC, calibrated at boot against PIT channel 2. kernel_clock_ns
+// counts from clock_init; without an invariant TSC it drifts when the
+// CPU changes frequency or sleeps in deep C-states.
+
+#define PIT_HZ                  1193182
+#define PIT_CH2                 0x42
+#define PIT_CMD                 0x43
+#define PIT_GATE                0x61
+#define PIT_GATE_OUT2           0x20
+#define CLOCK_CAL_TICKS         11932       // 10 ms of PIT ticks
+#define CLOCK_CAL_RUNS          5
+// An inb from an ISA port takes well over 100 ns, so this many polls
+// outlasts the 10 ms gate several times over.
+#define CLOCK_CAL_POLLS         (CLOCK_CAL_TICKS * 32)
+#define CLOCK_SHIFT             22
+
+uint32_t clock_tsc_khz = 0;
+int clock_invariant = 0;
+static uint32_t clock_mult = 0;            // ns per cycle << CLOCK_SHIFT
+static uint64_t clock_tsc_base = 0;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// 64 by 32 bit division without libgcc.
+static uint64_t kernel_div64(uint64_t n, uint32_t d) {
+    uint32_t hi = n >> 32, lo = n, q_lo, r;
+    uint32_t q_hi = hi / d;
+    hi %= d;
+    asm ("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(hi), "rm"(d));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+// Gates channel 2 (speaker off) and starts a one-shot count of `ticks`;
+// OUT2 goes high when it reaches zero.
+static void pit_oneshot(uint16_t ticks) {
+    ___outb(PIT_GATE, (___inb(PIT_GATE) & ~0x02) | 0x01);
+    ___outb(PIT_CMD, 0xB0);                 // channel 2, lobyte/hibyte, mode 0
+    ___outb(PIT_CH2, ticks & 0xFF);
+    ___outb(PIT_CH2, ticks >> 8);
+}
+
+// Cycles taken by CLOCK_CAL_TICKS PIT ticks, or 0 if OUT2 never rose.
+static uint32_t clock_cal_run() {
+    pit_oneshot(CLOCK_CAL_TICKS);
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < CLOCK_CAL_POLLS; i++) {
+        if (___inb(PIT_GATE) & PIT_GATE_OUT2) return rdtsc() - start;
+    }
+    return 0;
+}
+
+int clock_init() {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & (1 << 4))) {
+        printf("Clock: no TSC\n");
+        return -1;
+    }
+    cpuid(0x80000000, &a, &b, &c, &d);
+    if (a >= 0x80000007) {
+        cpuid(0x80000007, &a, &b, &c, &d);
+        clock_invariant = (d >> 8) & 1;
+    }
+
+    // The shortest run is the one least disturbed by SMIs or the host. A
+    // run that times out means OUT2 is not wired up, so stop there and
+    // leave the delays on the uncalibrated fallback.
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags));
+    uint32_t best = 0;
+    for (int i = 0; i < CLOCK_CAL_RUNS; i++) {
+        uint32_t cycles = clock_cal_run();
+        if (!cycles) {
+            best = 0;
+            break;
+        }
+        if (!best || cycles < best) best = cycles;
+    }
+    if (flags & 0x200) asm volatile("sti");
+    if (!best) {
+        printf("Clock: PIT calibration failed\n");
+        return -1;
+    }
+
+    clock_tsc_khz = kernel_div64((uint64_t)best * PIT_HZ, CLOCK_CAL_TICKS * 1000);
+    clock_mult = kernel_div64(1000000ULL << CLOCK_SHIFT, clock_tsc_khz);
+    clock_tsc_base = rdtsc();
+    printf("Clock: TSC %d.%03d MHz%s\n", clock_tsc_khz / 1000, clock_tsc_khz % 1000,
+           clock_invariant ? " (invariant)" : "");
+    return 0;
+}
+
+uint64_t clock_cycles_to_ns(uint64_t cycles) {
+    uint32_t hi = cycles >> 32, lo = cycles;
+    return (((uint64_t)hi * clock_mult) << (32 - CLOCK_SHIFT)) + (((uint64_t)lo * clock_mult) >> CLOCK_SHIFT);
+}
+
+// Nanoseconds since clock_init; 0 when there is no calibrated TSC.
+uint64_t kernel_clock_ns() {
+    if (!clock_mult) return 0;
+    return clock_cycles_to_ns(rdtsc() - clock_tsc_base);
+}
+
+void kernel_ndelay(uint32_t ns) {
+    if (!clock_mult) {
+        kernel_delay(ns / 4 + 1);           // uncalibrated guess
+        return;
+    }
+    uint64_t end = kernel_clock_ns() + ns;
+    while (kernel_clock_ns() < end) {
+        asm volatile("pause");
+    }
+}
+
+void kernel_udelay(uint32_t us) {
+    // Whole milliseconds at a time keeps ns within 32 bits.
+    while (us >= 1000) {
+        kernel_ndelay(1000000);
+        us -= 1000;
+    }
+    kernel_ndelay(us * 1000);
+}
+
 // --------------------------------- TIME ------------------------------------------
 
 struct time_info {
@@ -451,64 +596,91 @@ static uint8_t bcd_to_bin(uint8_t value) {
     return (value & 0x0F) + ((value >> 4) * 10);
 }
 
+#define CMOS_INDEX              0x70
+#define CMOS_DATA               0x71
+#define CMOS_STATUS_A_UIP       0x80        // update in progress
+
+// Leaves the interrupt flag as it found it.
 void cmos_read(uint8_t reg, uint8_t *value) {
-    asm volatile ("cli");
-    asm volatile ("outb %%al, $0x70" : : "a" (reg));
-    asm volatile ("inb $0x71, %%al" : "=a" (*value));
-    asm volatile ("sti");
+    uint32_t flags;
+    asm volatile ("pushf; pop %0; cli" : "=r"(flags));
+    ___outb(CMOS_INDEX, reg);
+    *value = ___inb(CMOS_DATA);
+    if (flags & 0x200) asm volatile ("sti");
 }
 
-struct time_info kernel_time() {
-    struct time_info time_info;
-    uint8_t seconds, minutes, hours, day, month, year, status_b;
-    
-    cmos_read(0x00, &seconds);
-    cmos_read(0x02, &minutes);
-    cmos_read(0x04, &hours);
-    cmos_read(0x07, &day);
-    cmos_read(0x08, &month);
-    cmos_read(0x09, &year);
+// Days since 1970-01-01 of a proleptic Gregorian date, and back, in
+// constant time (Howard Hinnant's civil algorithms, with eras of 400
+// years). Valid from year 0.
+int32_t days_from_civil(int32_t y, uint32_t m, uint32_t d) {
+    y -= m <= 2;
+    int32_t era = (y >= 0 ? y : y - 399) / 400;
+    uint32_t yoe = y - era * 400;
+    uint32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int32_t)doe - 719468;
+}
+
+void civil_from_days(int32_t z, int32_t *y, uint32_t *m, uint32_t *d) {
+    z += 719468;
+    int32_t era = (z >= 0 ? z : z - 146096) / 146097;
+    uint32_t doe = z - era * 146097;
+    uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint32_t mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = (int32_t)yoe + era * 400 + (*m <= 2);
+}
+
+// Seconds since the epoch from the RTC. Reads until two passes agree so
+// an update cannot tear the fields.
+uint32_t rtc_read() {
+    uint8_t now[6], last[6], status_a, status_b;
+    static const uint8_t regs[6] = { 0x00, 0x02, 0x04, 0x07, 0x08, 0x09 };
+    int passes = 0;
+    do {
+        memcpy(last, now, sizeof(now));
+        do {
+            cmos_read(0x0A, &status_a);
+        } while (status_a & CMOS_STATUS_A_UIP);
+        for (int i = 0; i < 6; i++) cmos_read(regs[i], &now[i]);
+    } while (++passes < 2 || memcmp(now, last, sizeof(now)) != 0);
+
     cmos_read(0x0B, &status_b);
-    
     if (!(status_b & 0x04)) {
-        seconds = bcd_to_bin(seconds);
-        minutes = bcd_to_bin(minutes);
-        hours = bcd_to_bin(hours);
-        day = bcd_to_bin(day);
-        month = bcd_to_bin(month);
-        year = bcd_to_bin(year);
-    }
-    uint16_t full_year = 2000 + year;
-    uint32_t total_seconds = 0;
-    uint32_t days_since_epoch = 0;
-    for (uint16_t y = 1970; y < full_year; y++) {
-        days_since_epoch += 365 + (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0) ? 1 : 0);
+        for (int i = 0; i < 6; i++) now[i] = bcd_to_bin(now[i]);
     }
-    
-    static const uint8_t days_in_month[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
-    for (uint8_t m = 0; m < month - 1; m++) {
-        days_since_epoch += days_in_month[m];
-        if (m == 1 && (full_year % 4 == 0 && (full_year % 100 != 0 || full_year % 400 == 0))) {
-            days_since_epoch += 1;
-        }
+    // Unsigned so the product stays defined past 2038, up to 2106.
+    uint32_t days = days_from_civil(2000 + now[5], now[4], now[3]);
+    return days * 86400 + now[2] * 3600 + now[1] * 60 + now[0];
+}
+
+// Wall time is the RTC, read once, plus the monotonic clock since. Until
+// the TSC is calibrated every call falls back to the RTC.
+static uint32_t wall_base = 0;
+static uint64_t wall_base_ns = 0;
+static int wall_synced = 0;
+
+void kernel_time_sync() {
+    if (!clock_mult) return;
+    wall_base = rtc_read();
+    wall_base_ns = kernel_clock_ns();
+    wall_synced = 1;
+}
+
+struct time_info kernel_time() {
+    struct time_info time_info;
+    if (!wall_synced) kernel_time_sync();
+    if (!wall_synced) {
+        time_info.seconds = rtc_read();
+        time_info.microseconds = 0;
+        return time_info;
     }
-    
-    days_since_epoch += day - 1;
-    
-    total_seconds = days_since_epoch * 86400 + hours * 3600 + minutes * 60 + seconds;
-    
-    time_info.seconds = total_seconds;
-    
-    uint16_t pit_counter;
-    asm volatile ("inb $0x61, %%al" : : ); 
-    asm volatile ("inb $0x42, %%al" : "=a" (pit_counter) : );
-    uint8_t low = (uint8_t)pit_counter;
-    asm volatile ("inb $0x42, %%al" : "=a" (pit_counter) : );
-    uint8_t high = (uint8_t)pit_counter;
-    pit_counter = (high << 8) | low;
-    
-    time_info.microseconds = ((65536 - pit_counter) * 1000000) / 1193182;
-    
+    uint64_t us = kernel_div64(kernel_clock_ns() - wall_base_ns, 1000);
+    uint64_t secs = kernel_div64(us, 1000000);
+    time_info.seconds = wall_base + (uint32_t)secs;
+    time_info.microseconds = (uint32_t)(us - secs * 1000000);
     return time_info;
 }
 
@@ -521,49 +693,30 @@ struct Day {
     uint8_t seconds;
 };
 
-static int is_leap_year(uint16_t year) {
-    return (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0));
-}
-
+// Broken-down local time, with state.timezone in whole hours.
 struct Day kernel_localtime(uint32_t timestamp) {
-    struct Day* dt = malloc(sizeof(struct Day));
+    struct Day dt;
     uint32_t days = timestamp / 86400;
-    uint32_t remaining_seconds = timestamp % 86400;
-    
-    dt->hours = remaining_seconds / 3600 + state.timezone;
-    remaining_seconds %= 3600;
-    dt->minutes = remaining_seconds / 60;
-    dt->seconds = remaining_seconds % 60;
-    
-    uint16_t year = 1970;
-    while (days >= ((uint32_t)(365 + is_leap_year(year)))) {
-        days -= 365 + is_leap_year(year);
-        year++;
+    int32_t secs = timestamp % 86400 + state.timezone * 3600;
+    while (secs < 0) {
+        secs += 86400;
+        days--;
     }
-    dt->year = year;
-    
-    static const uint8_t days_in_month[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
-    uint8_t month = 0;
-    
-    while (month < 12) {
-        uint8_t mdays = days_in_month[month];
-        if (month == 1 && is_leap_year(year)) {
-            mdays++;
-        }
-        
-        if (days < mdays) {
-            break;
-        }
-        
-        days -= mdays;
-        month++;
+    while (secs >= 86400) {
+        secs -= 86400;
+        days++;
     }
-    
-    dt->month = month + 1;
-    dt->day = days + 1;
-    
-    struct Day result = *dt;
-    return result;
+    int32_t year;
+    uint32_t month, day;
+    civil_from_days((int32_t)days, &year, &month, &day);
+
+    dt.year = year;
+    dt.month = month;
+    dt.day = day;
+    dt.hours = secs / 3600;
+    dt.minutes = secs % 3600 / 60;
+    dt.seconds = secs % 60;
+    return dt;
 }
 
 void kernel_wait(unsigned int seconds) {
@@ -582,8 +735,7 @@ uint32_t rand_state = 1;
 #define LCG_M (1ULL << 32)
 
 uint32_t kernel_rand() {
-    uint32_t t = kernel_time().seconds;
-    rand_state = (LCG_A * rand_state + LCG_C + (t%2)/2) % LCG_M;
+    rand_state = (LCG_A * rand_state + LCG_C) % LCG_M;
     return rand_state;
 }
 
@@ -600,6 +752,7 @@ uint32_t kernel_rand_range(uint32_t min, uint32_t max) {
 // ------------------- Critical / System ------------------------------
 
 void kernel_shutdown(void) {
+    fs_sync();
     __asm__ volatile (
         "mov $0x2000, %%ax\n\t"
         "mov $0x604, %%dx\n\t"
@@ -691,33 +844,195 @@ struct idt_ptr {
 struct idt_entry idt[256] = {0};
 struct idt_ptr idtp = {sizeof(idt) - 1, (uint32_t)&idt};
 
-void init_idt() {
-    asm volatile("lidt %0" : : "m"(idtp));
-}
+// ---- Interrupts ----
+// boot.asm has an entry stub per vector for the 32 exceptions and the
+// 16 PIC IRQs (remapped to 32..47); all of them land in
+// interrupt_dispatch with this frame on the stack.
 
-void exception_handler() {
-    kernel_panic("Unhandled exception!");
+#define IRQ_BASE                32
+#define IRQ_COUNT               16
+#define ISR_STUBS               (IRQ_BASE + IRQ_COUNT)
+
+#define PIC1_CMD                0x20
+#define PIC1_DATA               0x21
+#define PIC2_CMD                0xA0
+#define PIC2_DATA               0xA1
+#define PIC_EOI                 0x20
+#define PIC_READ_ISR            0x0B
+#define PIC_CASCADE_IRQ         2
+
+typedef struct {
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;    // pusha
+    uint32_t vector, error;
+    uint32_t eip, cs, eflags;                           // pushed by the CPU
+} InterruptFrame;
+
+typedef void (*InterruptHandler)(InterruptFrame *frame);
+
+extern uint32_t isr_stub_table[ISR_STUBS];
+InterruptHandler interrupt_handlers[256] = {0};
+
+static const char *exception_names[32] = {
+    "Divide error", "Debug", "NMI", "Breakpoint", "Overflow", "Bound range exceeded",
+    "Invalid opcode", "Device not available", "Double fault", "Coprocessor segment overrun",
+    "Invalid TSS", "Segment not present", "Stack-segment fault", "General protection fault",
+    "Page fault", "Reserved", "x87 floating-point", "Alignment check", "Machine check",
+    "SIMD floating-point", "Virtualization", "Control protection", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved", "Hypervisor injection",
+    "VMM communication", "Security", "Reserved",
+};
+
+void idt_set_gate(uint8_t vector, uint32_t base, uint16_t selector, uint8_t flags) {
+    idt[vector].base_low = base & 0xFFFF;
+    idt[vector].base_high = (base >> 16) & 0xFFFF;
+    idt[vector].selector = selector;
+    idt[vector].zero = 0;
+    idt[vector].flags = flags;
 }
 
-static inline void ___outb(uint16_t port, uint8_t value) {
-    asm volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
+void init_idt() {
+    // The loader's GDT stays in use, so gate through whatever code
+    // segment we are running in.
+    uint16_t cs;
+    asm volatile("mov %%cs, %0" : "=r"(cs));
+    for (int i = 0; i < ISR_STUBS; i++) {
+        idt_set_gate(i, isr_stub_table[i], cs, 0x8E);   // present, ring 0, 32-bit interrupt gate
+    }
+    asm volatile("lidt %0" : : "m"(idtp));
 }
 
 void init_pic() {
-    ___outb(0x20, 0x11);
-    ___outb(0xA0, 0x11);
+    ___outb(PIC1_CMD, 0x11);
+    ___outb(PIC2_CMD, 0x11);
     
-    ___outb(0x21, 0x20);
-    ___outb(0xA1, 0x28);
+    ___outb(PIC1_DATA, IRQ_BASE);
+    ___outb(PIC2_DATA, IRQ_BASE + 8);
     
-    ___outb(0x21, 0x04);
-    ___outb(0xA1, 0x02);
+    ___outb(PIC1_DATA, 0x04);
+    ___outb(PIC2_DATA, 0x02);
     
-    ___outb(0x21, 0x01);
-    ___outb(0xA1, 0x01);
+    ___outb(PIC1_DATA, 0x01);
+    ___outb(PIC2_DATA, 0x01);
     
-    ___outb(0x21, 0xFF);
-    ___outb(0xA1, 0xFF);
+    // Everything stays masked until a driver registers for its line.
+    ___outb(PIC1_DATA, 0xFF);
+    ___outb(PIC2_DATA, 0xFF);
+}
+
+void pic_unmask(uint8_t irq) {
+    if (irq >= 8) {
+        ___outb(PIC2_DATA, ___inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        irq = PIC_CASCADE_IRQ;
+    }
+    ___outb(PIC1_DATA, ___inb(PIC1_DATA) & ~(1 << irq));
+}
+
+void pic_mask(uint8_t irq) {
+    if (irq >= 8) {
+        ___outb(PIC2_DATA, ___inb(PIC2_DATA) | (1 << (irq - 8)));
+    } else {
+        ___outb(PIC1_DATA, ___inb(PIC1_DATA) | (1 << irq));
+    }
+}
+
+void pic_eoi(uint8_t irq) {
+    if (irq >= 8) ___outb(PIC2_CMD, PIC_EOI);
+    ___outb(PIC1_CMD, PIC_EOI);
+}
+
+// IRQ7 and IRQ15 also fire spuriously, with their bit clear in the
+// in-service register. Those must not be EOI'd, except that a spurious
+// IRQ15 still took the master's cascade line.
+static int pic_spurious(uint8_t irq) {
+    if (irq != 7 && irq != 15) return 0;
+    uint16_t cmd = irq == 7 ? PIC1_CMD : PIC2_CMD;
+    ___outb(cmd, PIC_READ_ISR);
+    if (___inb(cmd) & 0x80) return 0;
+    if (irq == 15) ___outb(PIC1_CMD, PIC_EOI);
+    return 1;
+}
+
+void interrupt_register(uint8_t vector, InterruptHandler handler) {
+    interrupt_handlers[vector] = handler;
+}
+
+// Installs the handler and unmasks the line.
+void irq_register(uint8_t irq, InterruptHandler handler) {
+    if (irq >= IRQ_COUNT) {
+        printf("IRQ: invalid line %d\n", irq);
+        return;
+    }
+    interrupt_register(IRQ_BASE + irq, handler);
+    pic_unmask(irq);
+}
+
+void irq_unregister(uint8_t irq) {
+    if (irq >= IRQ_COUNT) return;
+    pic_mask(irq);
+    interrupt_register(IRQ_BASE + irq, NULL);
+}
+
+// ---- Sleeping on a device ----
+// Drivers halt while a request is outstanding instead of spinning on the
+// device. Nothing else ticks, so PIT channel 0 is armed as a one-shot
+// first: a completion interrupt that never comes costs one 10 ms wakeup
+// rather than a hang, and the driver's own timeout still runs.
+
+#define PIT_CH0                 0x40
+#define PIT_IRQ                 0
+#define IRQ_WAIT_TICKS          11932       // 10 ms of PIT ticks
+
+static void irq_wait_timer(InterruptFrame *frame) {
+    (void)frame;
+}
+
+// Halts until the next interrupt unless `ready` already holds. Returns -1
+// without halting when interrupts are off, so the caller polls instead.
+int irq_wait(int (*ready)(void)) {
+    uint32_t flags;
+    asm volatile("pushf; pop %0" : "=r"(flags));
+    if (!(flags & 0x200)) return -1;
+    asm volatile("cli");
+    if (ready()) {
+        asm volatile("sti");
+        return 0;
+    }
+    if (interrupt_handlers[IRQ_BASE + PIT_IRQ] == NULL) irq_register(PIT_IRQ, irq_wait_timer);
+    ___outb(PIT_CMD, 0x30);                 // channel 0, lobyte/hibyte, mode 0
+    ___outb(PIT_CH0, IRQ_WAIT_TICKS & 0xFF);
+    ___outb(PIT_CH0, IRQ_WAIT_TICKS >> 8);
+    asm volatile("sti; hlt");
+    return 0;
+}
+
+void interrupt_dispatch(InterruptFrame *frame) {
+    uint32_t vector = frame->vector;
+    InterruptHandler handler = interrupt_handlers[vector];
+
+    if (vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT) {
+        uint8_t irq = vector - IRQ_BASE;
+        if (pic_spurious(irq)) return;
+        if (handler) handler(frame);
+        pic_eoi(irq);
+        return;
+    }
+
+    if (handler) {
+        handler(frame);
+        return;
+    }
+
+    printf("\n%s (vector %d, error 0x%x) at eip 0x%x\n",
+           vector < 32 ? exception_names[vector] : "Interrupt", vector, frame->error, frame->eip);
+    if (vector == 14) {
+        uint32_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        printf("Faulting address 0x%x\n", cr2);
+    }
+    printf("eax 0x%x ebx 0x%x ecx 0x%x edx 0x%x\n", frame->eax, frame->ebx, frame->ecx, frame->edx);
+    printf("esi 0x%x edi 0x%x ebp 0x%x eflags 0x%x\n", frame->esi, frame->edi, frame->ebp, frame->eflags);
+    kernel_panic("Unhandled exception!");
 }
 
 #endif
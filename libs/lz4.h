@@ -0,0 +1,138 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+// LZ4 block format, greedy single-probe compressor and bounds-checked
+// decompressor. No includes so disk_util can share it with the kernel;
+// the includer provides the stdint types.
+
+#define LZ4_HASH_BITS       12
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5       // the format ends with at least this many literals
+#define LZ4_MATCH_LIMIT     12      // no match may start closer than this to the end
+#define LZ4_MAX_INPUT       65536   // positions in the hash table are 16 bits
+
+static uint16_t lz4_table[1 << LZ4_HASH_BITS];
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t *lz4_put_length(uint8_t *op, uint32_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+// Emits literals [anchor, ip) and, when `offset` is not 0, a match.
+// Returns NULL if the sequence does not fit before `oend`.
+static uint8_t *lz4_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *anchor, const uint8_t *ip,
+                                 uint32_t offset, uint32_t match) {
+    uint32_t literals = ip - anchor;
+    if ((uint32_t)(oend - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) return 0;
+
+    uint8_t *token = op++;
+    *token = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15) op = lz4_put_length(op, literals - 15);
+    for (uint32_t i = 0; i < literals; i++) *op++ = anchor[i];
+    if (offset == 0) return op;
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    *token |= match >= 15 ? 15 : match;
+    if (match >= 15) op = lz4_put_length(op, match - 15);
+    return op;
+}
+
+// Returns the compressed size, or 0 if it would not fit in `max` bytes.
+uint32_t lz4_compress(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max) {
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + size;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + max;
+
+    if (size > LZ4_MAX_INPUT) return 0;
+    if (size > LZ4_MATCH_LIMIT) {
+        const uint8_t *match_limit = end - LZ4_LAST_LITERALS;
+        const uint8_t *start_limit = end - LZ4_MATCH_LIMIT;
+        for (uint32_t i = 0; i < (1 << LZ4_HASH_BITS); i++) lz4_table[i] = 0;
+
+        while (ip < start_limit) {
+            uint32_t sequence = lz4_read32(ip);
+            uint32_t h = lz4_hash(sequence);
+            const uint8_t *ref = src + lz4_table[h];
+            lz4_table[h] = ip - src;
+            if (ref >= ip || lz4_read32(ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *m = ip + LZ4_MIN_MATCH;
+            const uint8_t *r = ref + LZ4_MIN_MATCH;
+            while (m < match_limit && *m == *r) {
+                m++;
+                r++;
+            }
+            op = lz4_put_sequence(op, oend, anchor, ip, ip - ref, m - ip - LZ4_MIN_MATCH);
+            if (!op) return 0;
+            ip = m;
+            anchor = ip;
+        }
+    }
+
+    op = lz4_put_sequence(op, oend, anchor, end, 0, 0);
+    return op ? (uint32_t)(op - dst) : 0;
+}
+
+// Returns the decompressed size, or -1 if the input is malformed or
+// would overflow `max` bytes.
+int lz4_decompress(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + size;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + max;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        uint32_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > (uint32_t)(iend - ip) || literals > (uint32_t)(oend - op)) return -1;
+        for (uint32_t i = 0; i < literals; i++) *op++ = *ip++;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst)) return -1;
+        uint32_t match = token & 15;
+        if (match == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += LZ4_MIN_MATCH;
+        if (match > (uint32_t)(oend - op)) return -1;
+        const uint8_t *ref = op - offset;
+        while (match--) *op++ = *ref++;
+    }
+    return op - dst;
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include "../msstd.h"
+
+// Multiboot 1 boot information, as GRUB hands it to _start in ebx.
+#define MULTIBOOT_BOOTLOADER_MAGIC      0x2BADB002
+#define MULTIBOOT_INFO_MEMORY           0x00000001
+#define MULTIBOOT_INFO_CMDLINE          0x00000004
+#define MULTIBOOT_INFO_MODS             0x00000008
+#define MULTIBOOT_INFO_MEM_MAP          0x00000040
+#define MULTIBOOT_INFO_BOOT_LOADER_NAME 0x00000200
+#define MULTIBOOT_INFO_FRAMEBUFFER      0x00001000
+#define MULTIBOOT_MEMORY_AVAILABLE      1
+#define MULTIBOOT_MAX_MODULES           8
+
+typedef struct __attribute__((packed)) {
+    uint32_t flags;
+    uint32_t mem_lower;             // KB below 1 MB
+    uint32_t mem_upper;             // KB above 1 MB
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+    uint32_t drives_length;
+    uint32_t drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+    uint32_t vbe_control_info;
+    uint32_t vbe_mode_info;
+    uint16_t vbe_mode;
+    uint16_t vbe_interface_seg;
+    uint16_t vbe_interface_off;
+    uint16_t vbe_interface_len;
+    uint64_t framebuffer_addr;
+    uint32_t framebuffer_pitch;
+    uint32_t framebuffer_width;
+    uint32_t framebuffer_height;
+    uint8_t framebuffer_bpp;
+    uint8_t framebuffer_type;
+    uint8_t color_info[6];
+} MultibootInfo;
+
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t cmdline;
+    uint32_t reserved;
+} MultibootModule;
+
+// `size` does not count itself, so entries are size + 4 bytes apart.
+typedef struct __attribute__((packed)) {
+    uint32_t size;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} MultibootMmapEntry;
+
+// What kernel_main needs after boot. GRUB leaves the strings and the
+// modules where they are, so these point straight at them.
+typedef struct {
+    const char *cmdline;
+    const char *loader;
+    uint32_t memory_kb;             // usable RAM according to the memory map
+    uint32_t num_modules;
+    MultibootModule modules[MULTIBOOT_MAX_MODULES];
+    uint32_t framebuffer;           // 0 when there is none
+    uint32_t framebuffer_pitch;
+    uint32_t framebuffer_width;
+    uint32_t framebuffer_height;
+    uint8_t framebuffer_bpp;
+} BootInfo;
+
+BootInfo boot_info;
+
+// Returns -1 when the kernel was not started by a multiboot loader.
+int multiboot_parse(uint32_t magic, const MultibootInfo *mb) {
+    memset(&boot_info, 0, sizeof(BootInfo));
+    boot_info.cmdline = "";
+    boot_info.loader = "unknown";
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC) return -1;
+
+    if (mb->flags & MULTIBOOT_INFO_CMDLINE) boot_info.cmdline = (const char *)mb->cmdline;
+    if (mb->flags & MULTIBOOT_INFO_BOOT_LOADER_NAME) boot_info.loader = (const char *)mb->boot_loader_name;
+
+    if (mb->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uint32_t addr = mb->mmap_addr;
+        uint64_t usable = 0;
+        while (addr < mb->mmap_addr + mb->mmap_length) {
+            const MultibootMmapEntry *e = (const MultibootMmapEntry *)addr;
+            if (e->type == MULTIBOOT_MEMORY_AVAILABLE) usable += e->len;
+            addr += e->size + 4;
+        }
+        boot_info.memory_kb = (uint32_t)(usable >> 10);
+    } else if (mb->flags & MULTIBOOT_INFO_MEMORY) {
+        boot_info.memory_kb = mb->mem_lower + mb->mem_upper;
+    }
+
+    if (mb->flags & MULTIBOOT_INFO_MODS) {
+        const MultibootModule *mods = (const MultibootModule *)mb->mods_addr;
+        uint32_t count = mb->mods_count;
+        if (count > MULTIBOOT_MAX_MODULES) count = MULTIBOOT_MAX_MODULES;
+        for (uint32_t i = 0; i < count; i++) boot_info.modules[i] = mods[i];
+        boot_info.num_modules = count;
+    }
+
+    // The framebuffer is only usable when it sits below 4 GB.
+    if ((mb->flags & MULTIBOOT_INFO_FRAMEBUFFER) && (mb->framebuffer_addr >> 32) == 0) {
+        boot_info.framebuffer = (uint32_t)mb->framebuffer_addr;
+        boot_info.framebuffer_pitch = mb->framebuffer_pitch;
+        boot_info.framebuffer_width = mb->framebuffer_width;
+        boot_info.framebuffer_height = mb->framebuffer_height;
+        boot_info.framebuffer_bpp = mb->framebuffer_bpp;
+    }
+    return 0;
+}
+
+void multiboot_report() {
+    printf("Boot: %s, %d MB usable, %d modules", boot_info.loader, boot_info.memory_kb >> 10,
+           boot_info.num_modules);
+    if (boot_info.cmdline[0]) printf(", cmdline \"%s\"", boot_info.cmdline);
+    printf("\n");
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include "../msstd.h"
+
+#define PCI_CONFIG_ADDRESS      0xCF8
+#define PCI_CONFIG_DATA         0xCFC
+
+#define PCI_VENDOR_ID           0x00
+#define PCI_COMMAND             0x04
+#define PCI_CLASS               0x08
+#define PCI_HEADER_TYPE         0x0C
+#define PCI_BAR0                0x10
+#define PCI_BAR5                0x24
+#define PCI_INTERRUPT_LINE      0x3C
+
+#define PCI_COMMAND_IO          0x1
+#define PCI_COMMAND_MEMORY      0x2
+#define PCI_COMMAND_MASTER      0x4
+#define PCI_COMMAND_INTX_OFF    0x400
+#define PCI_NO_IRQ              0xFF
+
+// --------------- Port I/O -------------------------
+// The memory clobber keeps the compiler from moving ring and buffer
+// stores past a doorbell write, or loads ahead of a status read.
+
+static inline void outb(uint16_t port, uint8_t value) {
+    asm volatile("outb %0, %1" : : "a"(value), "Nd"(port) : "memory");
+}
+
+static inline uint8_t __inb(uint16_t port) {
+    uint8_t value;
+    asm volatile("inb %1, %0" : "=a"(value) : "Nd"(port) : "memory");
+    return value;
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t value;
+    asm volatile("inw %1, %0" : "=a"(value) : "Nd"(port) : "memory");
+    return value;
+}
+
+static inline void outw(uint16_t port, uint16_t value) {
+    asm volatile("outw %0, %1" : : "a"(value), "Nd"(port) : "memory");
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t value;
+    asm volatile("inl %1, %0" : "=a"(value) : "Nd"(port) : "memory");
+    return value;
+}
+
+static inline void outl(uint16_t port, uint32_t value) {
+    asm volatile("outl %0, %1" : : "a"(value), "Nd"(port) : "memory");
+}
+
+// --------------- Configuration space --------------
+
+typedef struct {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+} PciDevice;
+
+uint32_t pci_read32(const PciDevice *dev, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, 0x80000000 | (dev->bus << 16) | (dev->slot << 11) |
+                             (dev->func << 8) | (offset & 0xFC));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write32(const PciDevice *dev, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, 0x80000000 | (dev->bus << 16) | (dev->slot << 11) |
+                             (dev->func << 8) | (offset & 0xFC));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// Finds the first function whose config dword at `offset`, masked,
+// equals `value`. Returns 0 when found.
+static int pci_scan(uint8_t offset, uint32_t mask, uint32_t value, PciDevice *out) {
+    PciDevice dev;
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint32_t slot = 0; slot < 32; slot++) {
+            dev.bus = bus;
+            dev.slot = slot;
+            dev.func = 0;
+            uint32_t id = pci_read32(&dev, PCI_VENDOR_ID);
+            if ((id & 0xFFFF) == 0xFFFF) continue;
+            uint32_t funcs = (pci_read32(&dev, PCI_HEADER_TYPE) & 0x800000) ? 8 : 1;
+            for (uint32_t func = 0; func < funcs; func++) {
+                dev.func = func;
+                if ((pci_read32(&dev, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) continue;
+                if ((pci_read32(&dev, offset) & mask) == value) {
+                    *out = dev;
+                    return 0;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+int pci_find(uint16_t vendor, uint16_t device, PciDevice *out) {
+    return pci_scan(PCI_VENDOR_ID, 0xFFFFFFFF, ((uint32_t)device << 16) | vendor, out);
+}
+
+int pci_find_class(uint8_t class, uint8_t subclass, uint8_t prog_if, PciDevice *out) {
+    uint32_t value = ((uint32_t)class << 24) | ((uint32_t)subclass << 16) | ((uint32_t)prog_if << 8);
+    return pci_scan(PCI_CLASS, 0xFFFFFF00, value, out);
+}
+
+// Enables I/O and memory decoding and lets the device master the bus.
+void pci_enable(const PciDevice *dev) {
+    uint32_t command = pci_read32(dev, PCI_COMMAND);
+    command |= PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
+    command &= ~PCI_COMMAND_INTX_OFF;
+    pci_write32(dev, PCI_COMMAND, command);
+}
+
+// The PIC line the firmware routed INTx to, or PCI_NO_IRQ.
+uint8_t pci_irq_line(const PciDevice *dev) {
+    uint8_t line = pci_read32(dev, PCI_INTERRUPT_LINE) & 0xFF;
+    return line < IRQ_COUNT ? line : PCI_NO_IRQ;
+}
+
+#endif
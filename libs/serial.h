@@ -0,0 +1,53 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "pci.h"
+
+// Polled 16550 UART on COM1, 115200 8N1. Output only; under QEMU,
+// `-serial file:<path>` captures it on the host.
+
+#define SERIAL_COM1             0x3F8
+#define SERIAL_REG_DATA         0
+#define SERIAL_REG_IER          1
+#define SERIAL_REG_FIFO         2
+#define SERIAL_REG_LCR          3
+#define SERIAL_REG_MCR          4
+#define SERIAL_REG_LSR          5
+#define SERIAL_LCR_DLAB         0x80
+#define SERIAL_LSR_THR_EMPTY    0x20
+#define SERIAL_FIFO_SIZE        16
+
+int serial_present = 0;
+
+int serial_init() {
+    if (serial_present) return 0;
+    uint16_t io = SERIAL_COM1;
+    outb(io + SERIAL_REG_IER, 0x00);
+    outb(io + SERIAL_REG_LCR, SERIAL_LCR_DLAB);
+    outb(io + SERIAL_REG_DATA, 0x01);           // divisor 1: 115200 baud
+    outb(io + SERIAL_REG_IER, 0x00);
+    outb(io + SERIAL_REG_LCR, 0x03);            // 8 bits, no parity, 1 stop bit
+    outb(io + SERIAL_REG_FIFO, 0xC7);           // enable and clear the FIFOs
+    outb(io + SERIAL_REG_MCR, 0x03);
+    // A missing port floats high.
+    if (inb(io + SERIAL_REG_LSR) == 0xFF) return -1;
+    serial_present = 1;
+    return 0;
+}
+
+// Room for a full FIFO of bytes.
+static inline int serial_ready() {
+    return inb(SERIAL_COM1 + SERIAL_REG_LSR) & SERIAL_LSR_THR_EMPTY;
+}
+
+void serial_write(const void *data, uint32_t size) {
+    const uint8_t *bytes = data;
+    for (uint32_t i = 0; i < size; i++) {
+        if (i % SERIAL_FIFO_SIZE == 0) {
+            while (!serial_ready());
+        }
+        outb(SERIAL_COM1 + SERIAL_REG_DATA, bytes[i]);
+    }
+}
+
+#endif
@@ -62,11 +62,76 @@ int get_keyboard_layout(void) {
     return layout;
 }
 
-int getchar(void) {
-    while (!(inb(0x64) & 1));
+// ---- Keyboard ----
+// Once keyboard_init has hooked IRQ1, the handler is the only reader of
+// the controller and the only writer of kbd_head; the readers below are
+// the only writers of kbd_tail. Before that, scancodes are polled.
+
+#define KBD_DATA            0x60
+#define KBD_STATUS          0x64
+#define KBD_STATUS_FULL     0x01
+#define KBD_IRQ             1
+#define KBD_RING_SIZE       256     // power of two
+
+static uint8_t kbd_ring[KBD_RING_SIZE];
+static volatile uint32_t kbd_head = 0, kbd_tail = 0;
+static int kbd_irq_on = 0;
+uint32_t kbd_dropped = 0;
+
+// Background work, run while getchar waits for a key. Returns nonzero
+// while it has more to do; otherwise the CPU halts until the next IRQ.
+int (*kernel_idle)(void) = NULL;
+
+static void kbd_irq(InterruptFrame *frame) {
+    (void)frame;
+    if (!(inb(KBD_STATUS) & KBD_STATUS_FULL)) return;
+    uint8_t scancode = inb(KBD_DATA);
+    uint32_t head = kbd_head;
+    if (head - kbd_tail == KBD_RING_SIZE) {
+        kbd_dropped++;
+        return;
+    }
+    kbd_ring[head % KBD_RING_SIZE] = scancode;
+    __asm__ volatile ("" ::: "memory");     // publish the byte before the index
+    kbd_head = head + 1;
+}
 
-    uint8_t scancode = inb(0x60);
-    
+void keyboard_init(void) {
+    // Drop whatever the firmware left in the controller.
+    while (inb(KBD_STATUS) & KBD_STATUS_FULL) inb(KBD_DATA);
+    kbd_irq_on = 1;
+    irq_register(KBD_IRQ, kbd_irq);
+}
+
+// Next raw scancode, or -1 when none is waiting.
+static int kbd_scancode(void) {
+    if (!kbd_irq_on) {
+        if (!(inb(KBD_STATUS) & KBD_STATUS_FULL)) return -1;
+        return inb(KBD_DATA);
+    }
+    uint32_t tail = kbd_tail;
+    if (tail == kbd_head) return -1;
+    __asm__ volatile ("" ::: "memory");
+    uint8_t scancode = kbd_ring[tail % KBD_RING_SIZE];
+    kbd_tail = tail + 1;
+    return scancode;
+}
+
+// Halts until an interrupt arrives, unless a scancode already has.
+// `sti; hlt` leaves no window for the IRQ to slip in between.
+static void kbd_wait(void) {
+    if (!kbd_irq_on) return;
+    __asm__ volatile ("cli");
+    if (kbd_tail == kbd_head) {
+        __asm__ volatile ("sti; hlt");
+    } else {
+        __asm__ volatile ("sti");
+    }
+}
+
+// Turns a scancode into a key, tracking modifiers. Returns 0 for
+// scancodes that produce no key.
+static int kbd_decode(uint8_t scancode) {
     if (scancode == 0xE0) {
         extended = 1;
         return 0;
@@ -144,6 +209,15 @@ int getchar(void) {
     return key;
 }
 
+int getchar(void) {
+    int scancode;
+    while ((scancode = kbd_scancode()) < 0) {
+        if (kernel_idle && kernel_idle()) continue;
+        kbd_wait();
+    }
+    return kbd_decode(scancode);
+}
+
 int is_shift_pressed(void) {
     return shift;
 }
@@ -273,85 +347,11 @@ char *fgets_dcc(int size) {
 }
 
 int getchar_nb(void) {
-    if (!(inb(0x64) & 1)) {
+    int scancode = kbd_scancode();
+    if (scancode < 0) {
         return -1;
     }
-    
-    uint8_t scancode = inb(0x60);
-    
-    if (scancode == 0xE0) {
-        extended = 1;
-        return 0;
-    }
-    
-    if (extended) {
-        extended = 0;
-        switch (scancode) {
-            case 0x48: return KEY_UP;
-            case 0x50: return KEY_DOWN;
-            case 0x4B: return KEY_LEFT;
-            case 0x4D: return KEY_RIGHT;
-            case 0xAA:
-            case 0xC8: case 0xD0: case 0xCB: case 0xCD:
-                return 0;
-        }
-    }
-    
-    if (scancode == 0x2A || scancode == 0x36) {
-        shift = 1;
-        return 0;
-    }
-    if (scancode == 0xAA || scancode == 0xB6) {
-        shift = 0;
-        return 0;
-    }
-    if (scancode == 0x1D) {
-        ctrl = 1;
-        return 0;
-    }
-    if (scancode == 0x9D) {
-        ctrl = 0;
-        return 0;
-    }
-    if (scancode == 0x38) {
-        alt = 1;
-        return 0;
-    }
-    if (scancode == 0xB8) {
-        alt = 0;
-        return 0;
-    }
-
-    if (alt && ctrl && scancode == 0x21) {
-        layout = 0;
-        return 0;
-    }
-
-    if (alt && ctrl && scancode == 0x22) {
-        layout = 1;
-        return 0;
-    }
-    
-    if (scancode & 0x80) {
-        return 0;
-    }
-    
-    char key;
-    if (layout == 0) {
-        key = shift ? qwerty_shift_map[scancode] : qwerty_map[scancode];
-    } else {
-        key = shift ? qwertz_shift_map[scancode] : qwertz_map[scancode];
-    }
-
-    if (ctrl) {
-        if (key >= 'a' && key <= 'z') {
-            key = key - 'a' + 1;
-        } else if (key >= 'A' && key <= 'Z') {
-            key = key - 'A' + 1;
-        }
-    }
-    
-    return key;
+    return kbd_decode(scancode);
 }
 
 #endif
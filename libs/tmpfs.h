@@ -0,0 +1,197 @@
+#ifndef TMPFS_H
+#define TMPFS_H
+
+// In-memory file system for scratch files. Nothing here ever reaches a
+// block device and everything is gone after a reboot. The namespace is
+// flat: fs.h mounts it at /tmp and hands it the leaf names.
+#define TMPFS_PAGE_SIZE         4096
+#define TMPFS_PAGES             1024    // 4 MB
+#define TMPFS_MAX_FILES         64
+#define TMPFS_NAME_MAX          64
+#define TMPFS_NO_PAGE           0xFFFF
+
+// Pages of a file are chained through tmpfs_next. The last page looked
+// up is remembered, so sequential access does not walk the chain.
+typedef struct {
+    uint8_t in_use;
+    char name[TMPFS_NAME_MAX];
+    uint32_t size;
+    uint16_t first_page;
+    uint16_t num_pages;
+    uint16_t cur_page;
+    uint16_t cur_index;
+} TmpFile;
+
+uint8_t tmpfs_pool[TMPFS_PAGES][TMPFS_PAGE_SIZE] __attribute__((aligned(TMPFS_PAGE_SIZE)));
+uint16_t tmpfs_next[TMPFS_PAGES];
+uint16_t tmpfs_free_head = TMPFS_NO_PAGE;
+uint32_t tmpfs_free_pages = 0;
+TmpFile tmpfs_files[TMPFS_MAX_FILES];
+
+void tmpfs_init() {
+    for (uint32_t i = 0; i < TMPFS_PAGES; i++) {
+        tmpfs_next[i] = i + 1 < TMPFS_PAGES ? i + 1 : TMPFS_NO_PAGE;
+    }
+    tmpfs_free_head = 0;
+    tmpfs_free_pages = TMPFS_PAGES;
+    memset(tmpfs_files, 0, sizeof(tmpfs_files));
+}
+
+static uint16_t tmpfs_page_alloc() {
+    uint16_t page = tmpfs_free_head;
+    if (page == TMPFS_NO_PAGE) return page;
+    tmpfs_free_head = tmpfs_next[page];
+    tmpfs_next[page] = TMPFS_NO_PAGE;
+    tmpfs_free_pages--;
+    memset(tmpfs_pool[page], 0, TMPFS_PAGE_SIZE);
+    return page;
+}
+
+static void tmpfs_page_free_chain(uint16_t page) {
+    while (page != TMPFS_NO_PAGE) {
+        uint16_t next = tmpfs_next[page];
+        tmpfs_next[page] = tmpfs_free_head;
+        tmpfs_free_head = page;
+        tmpfs_free_pages++;
+        page = next;
+    }
+}
+
+// Page holding page `index` of the file; index must be < num_pages.
+static uint16_t tmpfs_page_at(TmpFile *f, uint32_t index) {
+    uint16_t page = f->first_page;
+    uint32_t i = 0;
+    if (f->cur_page != TMPFS_NO_PAGE && index >= f->cur_index) {
+        page = f->cur_page;
+        i = f->cur_index;
+    }
+    for (; i < index; i++) page = tmpfs_next[page];
+    f->cur_page = page;
+    f->cur_index = index;
+    return page;
+}
+
+int tmpfs_find(const char *name) {
+    for (int i = 0; i < TMPFS_MAX_FILES; i++) {
+        if (tmpfs_files[i].in_use && strcmp(tmpfs_files[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+TmpFile *tmpfs_file(int index) {
+    if (index < 0 || index >= TMPFS_MAX_FILES || !tmpfs_files[index].in_use) return NULL;
+    return &tmpfs_files[index];
+}
+
+// Returns the new file's index, or -1.
+int tmpfs_create(const char *name) {
+    if (name[0] == '\0' || strchr(name, '/') || strlen(name) >= TMPFS_NAME_MAX) {
+        printf("Invalid path\n");
+        return -1;
+    }
+    if (tmpfs_find(name) != -1) {
+        printf("File already exists\n");
+        return -1;
+    }
+    for (int i = 0; i < TMPFS_MAX_FILES; i++) {
+        TmpFile *f = &tmpfs_files[i];
+        if (f->in_use) continue;
+        memset(f, 0, sizeof(TmpFile));
+        f->in_use = 1;
+        strcpy(f->name, name);
+        f->first_page = TMPFS_NO_PAGE;
+        f->cur_page = TMPFS_NO_PAGE;
+        return i;
+    }
+    printf("No free file entries\n");
+    return -1;
+}
+
+void tmpfs_delete(int index) {
+    TmpFile *f = &tmpfs_files[index];
+    tmpfs_page_free_chain(f->first_page);
+    f->in_use = 0;
+}
+
+// Bytes past the end of the file are always zero, so growing never has
+// to clear anything beyond freshly allocated pages.
+int tmpfs_truncate(TmpFile *f, uint32_t size) {
+    uint32_t pages = (size + TMPFS_PAGE_SIZE - 1) / TMPFS_PAGE_SIZE;
+
+    if (pages > f->num_pages) {
+        if (pages - f->num_pages > tmpfs_free_pages) {
+            printf("tmpfs: out of memory\n");
+            return -1;
+        }
+        uint16_t last = f->num_pages ? tmpfs_page_at(f, f->num_pages - 1) : TMPFS_NO_PAGE;
+        for (uint32_t i = f->num_pages; i < pages; i++) {
+            uint16_t page = tmpfs_page_alloc();
+            if (last == TMPFS_NO_PAGE) f->first_page = page;
+            else tmpfs_next[last] = page;
+            last = page;
+        }
+    } else if (pages < f->num_pages) {
+        if (pages == 0) {
+            tmpfs_page_free_chain(f->first_page);
+            f->first_page = TMPFS_NO_PAGE;
+        } else {
+            uint16_t last = tmpfs_page_at(f, pages - 1);
+            tmpfs_page_free_chain(tmpfs_next[last]);
+            tmpfs_next[last] = TMPFS_NO_PAGE;
+        }
+        f->cur_page = TMPFS_NO_PAGE;
+    }
+    f->num_pages = pages;
+
+    if (size < f->size && size % TMPFS_PAGE_SIZE) {
+        uint8_t *tail = tmpfs_pool[tmpfs_page_at(f, size / TMPFS_PAGE_SIZE)];
+        memset(tail + size % TMPFS_PAGE_SIZE, 0, TMPFS_PAGE_SIZE - size % TMPFS_PAGE_SIZE);
+    }
+    f->size = size;
+    return 0;
+}
+
+uint32_t tmpfs_read_at(TmpFile *f, uint32_t offset, uint8_t *buffer, uint32_t count) {
+    if (offset >= f->size) return 0;
+    if (count > f->size - offset) count = f->size - offset;
+
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pos = offset + done;
+        uint32_t in_page = pos % TMPFS_PAGE_SIZE;
+        uint32_t chunk = TMPFS_PAGE_SIZE - in_page;
+        if (chunk > count - done) chunk = count - done;
+        memcpy(buffer + done, tmpfs_pool[tmpfs_page_at(f, pos / TMPFS_PAGE_SIZE)] + in_page, chunk);
+        done += chunk;
+    }
+    return count;
+}
+
+int tmpfs_write_at(TmpFile *f, uint32_t offset, const uint8_t *data, uint32_t count) {
+    if (offset + count < offset) return -1;
+    if (offset + count > f->size && tmpfs_truncate(f, offset + count) != 0) return -1;
+
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pos = offset + done;
+        uint32_t in_page = pos % TMPFS_PAGE_SIZE;
+        uint32_t chunk = TMPFS_PAGE_SIZE - in_page;
+        if (chunk > count - done) chunk = count - done;
+        memcpy(tmpfs_pool[tmpfs_page_at(f, pos / TMPFS_PAGE_SIZE)] + in_page, data + done, chunk);
+        done += chunk;
+    }
+    return count;
+}
+
+void tmpfs_list() {
+    uint32_t count = 0;
+    for (int i = 0; i < TMPFS_MAX_FILES; i++) count += tmpfs_files[i].in_use;
+    printf("Entries: %d\n", count);
+    for (int i = 0; i < TMPFS_MAX_FILES; i++) {
+        if (tmpfs_files[i].in_use) printf("%s - %d bytes\n", tmpfs_files[i].name, tmpfs_files[i].size);
+    }
+    printf("Free: %d of %d KB (tmpfs)\n", tmpfs_free_pages * (TMPFS_PAGE_SIZE / 1024),
+           TMPFS_PAGES * (TMPFS_PAGE_SIZE / 1024));
+}
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "pci.h"
+
+// Legacy (transitional) virtio-pci block device, as QEMU attaches it
+// with -drive if=virtio. Registers live in the I/O BAR.
+#define VIRTIO_VENDOR_ID            0x1AF4
+#define VIRTIO_BLK_DEVICE_ID        0x1001
+
+#define VIRTIO_REG_DEVICE_FEATURES  0x00
+#define VIRTIO_REG_GUEST_FEATURES   0x04
+#define VIRTIO_REG_QUEUE_PFN        0x08
+#define VIRTIO_REG_QUEUE_SIZE       0x0C
+#define VIRTIO_REG_QUEUE_SELECT     0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY     0x10
+#define VIRTIO_REG_STATUS           0x12
+#define VIRTIO_REG_ISR              0x13
+#define VIRTIO_REG_BLK_CAPACITY     0x14
+
+#define VIRTIO_STATUS_ACK           0x01
+#define VIRTIO_STATUS_DRIVER        0x02
+#define VIRTIO_STATUS_DRIVER_OK     0x04
+#define VIRTIO_STATUS_FAILED        0x80
+
+#define VIRTIO_BLK_F_FLUSH          (1 << 9)
+#define VIRTIO_BLK_T_IN             0
+#define VIRTIO_BLK_T_OUT            1
+#define VIRTIO_BLK_T_FLUSH          4
+
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+#define VRING_AVAIL_F_NO_INTERRUPT  1
+
+#define VIRTIO_PAGE_SIZE            4096
+#define VIRTIO_QUEUE_MAX_SIZE       1024
+#define VIRTIO_RING_BYTES           (8 * VIRTIO_PAGE_SIZE)
+#define VIRTIO_BLK_MAX_INFLIGHT     32
+#define VIRTIO_BLK_MAX_SECTORS      128     // per request
+#define VIRTIO_BLK_MAX_SEGS         (VIRTIO_BLK_MAX_SECTORS * 512 / VIRTIO_PAGE_SIZE + 1)
+#define VIRTIO_TIMEOUT              10000000    // polls
+#define VIRTIO_TIMEOUT_SLEEPS       1000        // 10 ms wakeups
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VringDesc;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} VringAvail;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} VringUsedElem;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    VringUsedElem ring[];
+} VringUsed;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} VirtioBlkHeader;
+
+// One request in flight: header, data segments, status byte.
+typedef struct {
+    VirtioBlkHeader header;
+    volatile uint8_t status;
+    uint8_t in_use;
+    uint16_t head;
+} VirtioBlkRequest;
+
+uint8_t virtio_ring[VIRTIO_RING_BYTES] __attribute__((aligned(VIRTIO_PAGE_SIZE)));
+VringDesc *virtio_desc;
+VringAvail *virtio_avail;
+volatile VringUsed *virtio_used;
+uint16_t virtio_queue_size = 0;
+uint16_t virtio_free_head;
+uint16_t virtio_free_count;
+uint16_t virtio_last_used;
+uint16_t virtio_io_base = 0;
+uint32_t virtio_features = 0;
+uint64_t virtio_blk_capacity = 0;
+VirtioBlkRequest virtio_requests[VIRTIO_BLK_MAX_INFLIGHT];
+uint32_t virtio_inflight = 0;
+uint32_t virtio_errors = 0;
+uint8_t virtio_irq = PCI_NO_IRQ;
+
+static inline void virtio_barrier() {
+    __sync_synchronize();
+}
+
+int virtio_blk_ready() {
+    return virtio_queue_size != 0;
+}
+
+// Reading the ISR status acknowledges the interrupt and drops the line.
+// Completions are reaped by the waiter, not here.
+static void virtio_blk_irq(InterruptFrame *frame) {
+    (void)frame;
+    __inb(virtio_io_base + VIRTIO_REG_ISR);
+}
+
+// Returns 0 when a virtio disk was found and set up.
+int virtio_blk_init() {
+    PciDevice pci;
+    if (pci_find(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, &pci) != 0) return -1;
+
+    uint32_t bar0 = pci_read32(&pci, PCI_BAR0);
+    if (!(bar0 & 1)) return -1;
+    pci_enable(&pci);
+    uint16_t io = bar0 & 0xFFFC;
+
+    outb(io + VIRTIO_REG_STATUS, 0);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+    virtio_features = inl(io + VIRTIO_REG_DEVICE_FEATURES) & VIRTIO_BLK_F_FLUSH;
+    outl(io + VIRTIO_REG_GUEST_FEATURES, virtio_features);
+
+    outw(io + VIRTIO_REG_QUEUE_SELECT, 0);
+    uint16_t size = inw(io + VIRTIO_REG_QUEUE_SIZE);
+    uint32_t used_offset = (size * sizeof(VringDesc) + 6 + size * 2 + VIRTIO_PAGE_SIZE - 1) &
+                           ~(VIRTIO_PAGE_SIZE - 1);
+    // A full request takes its data segments plus the header and status
+    // descriptors; a smaller ring could never take one, so use ATA.
+    if (size < VIRTIO_BLK_MAX_SEGS + 2 || size > VIRTIO_QUEUE_MAX_SIZE ||
+        used_offset + 6 + size * sizeof(VringUsedElem) > VIRTIO_RING_BYTES) {
+        outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    memset(virtio_ring, 0, sizeof(virtio_ring));
+    virtio_desc = (VringDesc *)virtio_ring;
+    virtio_avail = (VringAvail *)(virtio_ring + size * sizeof(VringDesc));
+    virtio_used = (volatile VringUsed *)(virtio_ring + used_offset);
+    for (uint16_t i = 0; i < size; i++) {
+        virtio_desc[i].next = i + 1;
+    }
+    virtio_free_head = 0;
+    virtio_free_count = size;
+    virtio_last_used = 0;
+    // Without a routed line, completions are polled.
+    virtio_irq = pci_irq_line(&pci);
+    virtio_avail->flags = virtio_irq == PCI_NO_IRQ ? VRING_AVAIL_F_NO_INTERRUPT : 0;
+
+    outl(io + VIRTIO_REG_QUEUE_PFN, (uint32_t)virtio_ring / VIRTIO_PAGE_SIZE);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    virtio_blk_capacity = inl(io + VIRTIO_REG_BLK_CAPACITY) |
+                          ((uint64_t)inl(io + VIRTIO_REG_BLK_CAPACITY + 4) << 32);
+    virtio_io_base = io;
+    virtio_queue_size = size;
+    if (virtio_irq != PCI_NO_IRQ) irq_register(virtio_irq, virtio_blk_irq);
+    return 0;
+}
+
+// Reaps finished requests and returns their descriptors to the free list.
+static void virtio_blk_reap() {
+    while (virtio_last_used != virtio_used->idx) {
+        virtio_barrier();
+        uint16_t head = virtio_used->ring[virtio_last_used % virtio_queue_size].id;
+        virtio_last_used++;
+
+        for (uint32_t i = 0; i < VIRTIO_BLK_MAX_INFLIGHT; i++) {
+            VirtioBlkRequest *req = &virtio_requests[i];
+            if (req->in_use && req->head == head) {
+                if (req->status != 0) virtio_errors++;
+                req->in_use = 0;
+                virtio_inflight--;
+                break;
+            }
+        }
+
+        uint16_t last = head;
+        uint16_t count = 1;
+        while (virtio_desc[last].flags & VRING_DESC_F_NEXT) {
+            last = virtio_desc[last].next;
+            count++;
+        }
+        virtio_desc[last].next = virtio_free_head;
+        virtio_free_head = head;
+        virtio_free_count += count;
+    }
+}
+
+static void virtio_blk_kick() {
+    outw(virtio_io_base + VIRTIO_REG_QUEUE_NOTIFY, 0);
+}
+
+static int virtio_blk_completed() {
+    return virtio_last_used != virtio_used->idx;
+}
+
+// Waits until no more than `limit` requests are in flight, halting
+// between completions when the device can interrupt.
+static int virtio_blk_wait(uint32_t limit) {
+    uint32_t polls = 0, sleeps = 0;
+    virtio_blk_reap();
+    while (virtio_inflight > limit) {
+        if (virtio_irq != PCI_NO_IRQ && irq_wait(virtio_blk_completed) == 0) {
+            sleeps++;
+        } else {
+            polls++;
+        }
+        if (polls == VIRTIO_TIMEOUT || sleeps == VIRTIO_TIMEOUT_SLEEPS) {
+            printf("virtio-blk: request timed out\n");
+            return -1;
+        }
+        virtio_blk_reap();
+    }
+    return 0;
+}
+
+static uint16_t virtio_desc_alloc() {
+    uint16_t id = virtio_free_head;
+    virtio_free_head = virtio_desc[id].next;
+    virtio_free_count--;
+    return id;
+}
+
+// Queues one request without notifying the device. The data buffer is
+// split at page boundaries into a scatter-gather list.
+static int virtio_blk_submit(uint32_t type, uint32_t lba, uint8_t *buffer, uint32_t count) {
+    while (virtio_inflight == VIRTIO_BLK_MAX_INFLIGHT || virtio_free_count < VIRTIO_BLK_MAX_SEGS + 2) {
+        virtio_blk_kick();
+        if (virtio_blk_wait(virtio_inflight - 1) != 0) return -1;
+    }
+
+    VirtioBlkRequest *req = virtio_requests;
+    while (req->in_use) req++;
+    req->header.type = type;
+    req->header.reserved = 0;
+    req->header.sector = lba;
+    req->status = 0xFF;
+    req->in_use = 1;
+
+    uint16_t head = virtio_desc_alloc();
+    uint16_t prev = head;
+    virtio_desc[head].addr = (uint32_t)&req->header;
+    virtio_desc[head].len = sizeof(VirtioBlkHeader);
+    virtio_desc[head].flags = VRING_DESC_F_NEXT;
+
+    uint32_t addr = (uint32_t)buffer;
+    uint32_t end = addr + count * 512;
+    while (addr < end) {
+        uint32_t page_end = (addr & ~(VIRTIO_PAGE_SIZE - 1)) + VIRTIO_PAGE_SIZE;
+        uint32_t len = (page_end < end ? page_end : end) - addr;
+        uint16_t id = virtio_desc_alloc();
+        virtio_desc[id].addr = addr;
+        virtio_desc[id].len = len;
+        virtio_desc[id].flags = VRING_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0);
+        virtio_desc[prev].next = id;
+        prev = id;
+        addr += len;
+    }
+
+    uint16_t status = virtio_desc_alloc();
+    virtio_desc[status].addr = (uint32_t)&req->status;
+    virtio_desc[status].len = 1;
+    virtio_desc[status].flags = VRING_DESC_F_WRITE;
+    virtio_desc[prev].next = status;
+
+    req->head = head;
+    virtio_avail->ring[virtio_avail->idx % virtio_queue_size] = head;
+    virtio_barrier();
+    virtio_avail->idx++;
+    virtio_inflight++;
+    return 0;
+}
+
+// Splits a transfer into requests that are all in flight at once.
+static int virtio_blk_rw(uint32_t type, uint32_t lba, uint32_t count, uint8_t *buffer) {
+    uint32_t errors = virtio_errors;
+    while (count > 0) {
+        uint32_t n = count < VIRTIO_BLK_MAX_SECTORS ? count : VIRTIO_BLK_MAX_SECTORS;
+        if (virtio_blk_submit(type, lba, buffer, n) != 0) return -1;
+        lba += n;
+        buffer += n * 512;
+        count -= n;
+    }
+    virtio_blk_kick();
+    if (virtio_blk_wait(0) != 0) return -1;
+    return virtio_errors == errors ? 0 : -1;
+}
+
+void virtio_blk_read(uint32_t lba, uint32_t count, uint8_t *buffer) {
+    if (virtio_blk_rw(VIRTIO_BLK_T_IN, lba, count, buffer) != 0) {
+        printf("virtio-blk: read error at sector %d\n", lba);
+    }
+}
+
+void virtio_blk_write(uint32_t lba, uint32_t count, const uint8_t *buffer) {
+    if (virtio_blk_rw(VIRTIO_BLK_T_OUT, lba, count, (uint8_t *)buffer) != 0) {
+        printf("virtio-blk: write error at sector %d\n", lba);
+    }
+}
+
+void virtio_blk_flush() {
+    if (!(virtio_features & VIRTIO_BLK_F_FLUSH)) return;
+    uint32_t errors = virtio_errors;
+    if (virtio_blk_submit(VIRTIO_BLK_T_FLUSH, 0, NULL, 0) == 0) {
+        virtio_blk_kick();
+        if (virtio_blk_wait(0) == 0 && virtio_errors == errors) return;
+    }
+    printf("virtio-blk: flush failed\n");
+}
+
+#endif
@@ -3,7 +3,6 @@
 
 #define K_VERSION 1.0
 #define K_SHELL_SYMBOL "$ "
-#define K_MAGIC "ZOS1"
 
 #include "libs/types.h"
 #include "libs/memory.h"